@@ -0,0 +1,54 @@
+#!/bin/sh
+# Compare switch dispatch against direct-threaded (computed goto) dispatch.
+#
+# Builds three optimized interpreters without tracing: one that counts the
+# instructions it executes, one forced onto the switch fallback and one using
+# the threaded dispatch table, then reports the best wall time of each and the
+# resulting cost per dispatched instruction.
+#
+# usage: benchmarks/dispatch.sh [script.lox] [runs]
+
+set -e
+
+SCRIPT=${1:-benchmarks/fib.lox}
+RUNS=${2:-5}
+CC=${CC:-gcc}
+OUT=${TMPDIR:-/tmp}/clox_dispatch
+SOURCES=$(ls src/*.c)
+CFLAGS="-std=c99 -O2 -DNDEBUG -I."
+
+mkdir -p "$OUT"
+$CC $CFLAGS -DDEBUG_COUNT_INSTRUCTIONS -o "$OUT/clox_count" $SOURCES
+$CC $CFLAGS -DSWITCH_DISPATCH -o "$OUT/clox_switch" $SOURCES
+$CC $CFLAGS -o "$OUT/clox_threaded" $SOURCES
+
+INSTRUCTIONS=$("$OUT/clox_count" "$SCRIPT" 2>&1 >/dev/null |
+    sed -n 's/^instructions: //p')
+
+best_time()
+{
+    best=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$1" "$SCRIPT" >/dev/null
+        end=$(date +%s%N)
+        elapsed=$((end - start))
+        if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+SWITCH_NS=$(best_time "$OUT/clox_switch")
+THREADED_NS=$(best_time "$OUT/clox_threaded")
+
+echo "script:        $SCRIPT ($RUNS runs, best of)"
+echo "instructions:  $INSTRUCTIONS"
+awk -v n="$INSTRUCTIONS" -v s="$SWITCH_NS" -v t="$THREADED_NS" 'BEGIN {
+    printf "switch:        %8.1f ms  %6.2f ns/op\n", s / 1e6, s / n
+    printf "threaded:      %8.1f ms  %6.2f ns/op\n", t / 1e6, t / n
+    printf "speedup:       %8.2fx\n", s / t
+}'
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Rank opcode pairs by how often they execute back to back.
+#
+# Builds an optimized interpreter with DEBUG_PROFILE_PAIRS, runs every
+# script given (the whole benchmark corpus by default) and sums the pair
+# counts each run dumps at exit. The top of the list is where fusing two
+# instructions into a superinstruction saves the most dispatches.
+#
+# usage: benchmarks/pairs.sh [top] [script.lox ...]
+
+set -e
+
+TOP=${1:-25}
+[ $# -gt 0 ] && shift
+SCRIPTS=${*:-$(ls benchmarks/*.lox)}
+CC=${CC:-gcc}
+OUT=${TMPDIR:-/tmp}/clox_pairs
+
+$CC -std=c99 -O2 -DNDEBUG -DDEBUG_PROFILE_PAIRS -I. -pthread -o "$OUT" \
+    $(ls src/*.c)
+
+for script in $SCRIPTS; do
+    "$OUT" "$script" 2>&1 >/dev/null | grep '^pair '
+done | awk '
+    { count[$2 " " $3] += $4; total += $4 }
+    END {
+        for (pair in count)
+            printf "%14d %6.2f%%  %s\n", count[pair], 100 * count[pair] / total, pair
+    }' | sort -rn | head -n "$TOP"
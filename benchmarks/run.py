@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""Run the benchmarks/*.lox corpus and compare it against a baseline.
+
+Every script is run several times with the release interpreter. The report
+gives the median and standard deviation of the wall time, the peak resident
+set size and, when an interpreter built with DEBUG_COUNT_INSTRUCTIONS is
+given, the number of instructions executed. Medians are compared with the
+stored baseline, and the exit status is 1 when any of them regressed by more
+than the threshold. --flags passes options to both interpreters, so
+--flags=--registers compares the register backend with the stack baseline.
+
+usage: benchmarks/run.py --clox ./clox [--counter ./clox_count]
+                         [--flags='--registers'] [--runs 5] [--threshold 35]
+                         [--save-baseline] [script.lox ...]
+"""
+
+import argparse
+import glob
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BASELINE = os.path.join(HERE, "baseline.json")
+
+
+def run_once(clox, flags, script):
+    """Returns (wall seconds, peak RSS in KiB) of one run of script."""
+    start = time.perf_counter()
+    process = subprocess.Popen([clox, *flags, script],
+                               stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(process.pid, 0)
+    elapsed = time.perf_counter() - start
+    # Popen does not know about the wait4() above
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        sys.exit(f"{script}: exit status {process.returncode}")
+    return elapsed, usage.ru_maxrss
+
+
+def count_instructions(counter, flags, script):
+    result = subprocess.run([counter, *flags, script],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, check=True)
+    match = re.search(rb"^instructions: (\d+)$", result.stderr, re.M)
+    return int(match.group(1)) if match else None
+
+
+def measure(args, script):
+    times = []
+    peak_rss = 0
+    for _ in range(args.runs):
+        elapsed, rss = run_once(args.clox, args.flags.split(), script)
+        times.append(elapsed)
+        peak_rss = max(peak_rss, rss)
+
+    result = {
+        "median_ms": round(statistics.median(times) * 1000, 1),
+        "stddev_ms": round(statistics.stdev(times) * 1000, 1)
+        if len(times) > 1 else 0,
+        "peak_rss_kb": peak_rss,
+    }
+    if args.counter:
+        result["instructions"] = count_instructions(
+            args.counter, args.flags.split(), script)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--clox", default="./clox")
+    parser.add_argument("--counter",
+                        help="interpreter built with DEBUG_COUNT_INSTRUCTIONS")
+    parser.add_argument("--flags", default="",
+                        help="interpreter options, e.g. --flags=--registers")
+    parser.add_argument("--runs", type=int, default=5)
+    # Medians of the same build moved by up to a third between sessions
+    # on the single-core machine the baseline was recorded on, so a
+    # smaller default reports noise as regressions.
+    parser.add_argument("--threshold", type=float, default=35.0,
+                        help="allowed median slowdown in percent")
+    parser.add_argument("--baseline", default=DEFAULT_BASELINE)
+    parser.add_argument("--save-baseline", action="store_true",
+                        help="store these results as the new baseline")
+    parser.add_argument("scripts", nargs="*")
+    args = parser.parse_args()
+
+    scripts = args.scripts or sorted(glob.glob(os.path.join(HERE, "*.lox")))
+
+    baseline = {}
+    if os.path.exists(args.baseline) and not args.save_baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)
+
+    print(f"{'benchmark':<16} {'median':>9} {'stddev':>8} {'peak rss':>9} "
+          f"{'instructions':>13} {'baseline':>9} {'change':>8}")
+
+    results = {}
+    regressions = []
+    for script in scripts:
+        name = os.path.splitext(os.path.basename(script))[0]
+        result = measure(args, script)
+        results[name] = result
+
+        instructions = result.get("instructions")
+        line = (f"{name:<16} {result['median_ms']:7.1f}ms "
+                f"{result['stddev_ms']:6.1f}ms "
+                f"{result['peak_rss_kb'] / 1024:7.1f}MB "
+                f"{instructions if instructions is not None else '-':>13}")
+
+        if name in baseline:
+            before = baseline[name]["median_ms"]
+            change = (result["median_ms"] - before) / before * 100
+            line += f" {before:7.1f}ms {change:+7.1f}%"
+            if change > args.threshold:
+                line += "  REGRESSION"
+                regressions.append(name)
+        print(line, flush=True)
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as file:
+            json.dump(results, file, indent=2, sort_keys=True)
+            file.write("\n")
+        print(f"baseline written to {os.path.relpath(args.baseline)}")
+
+    if regressions:
+        print(f"regressed by more than {args.threshold:g}%: "
+              + ", ".join(regressions))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,115 @@
+// Microbenchmark for the hash table in src/table.c.
+//
+// For each table size it interns N fresh strings, looks each of them up
+// again through table_find_string(), then sets, gets and deletes all of
+// them in a separate table, and reports the mean cost of one operation.
+//
+// usage: table_bench [keys...]    (default: 1000 100000 10000000)
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "src/memory.h"
+#include "src/object.h"
+#include "src/table.h"
+#include "src/vm.h"
+
+static u64 now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000u + (u64)now.tv_nsec;
+}
+
+static void report(const char* name, u64 start, int count)
+{
+    printf("  %-14s %8.2f ns/op\n", name, (double)(now_ns() - start) / count);
+}
+
+static void run(int count)
+{
+    ObjString** keys = malloc(sizeof(ObjString*) * count);
+    if (keys == NULL)
+        exit(1);
+
+    printf("%d keys\n", count);
+
+    static int generation = 0;
+    generation++;
+
+    char buffer[32];
+    u64  start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(buffer, sizeof(buffer), "k%d_%d", generation, i);
+        keys[i] = copy_string(buffer, length);
+    }
+    report("intern insert", start, count);
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        ObjString* key = keys[i];
+        if (table_find_string(&vm.strings, key->chars, key->length,
+                              key->hash) != key)
+            exit(1);
+    }
+    report("intern lookup", start, count);
+
+    Table table;
+    init_table(&table);
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+    report("set", start, count);
+
+    Value value;
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        if (!table_get(&table, keys[i], &value))
+            exit(1);
+    }
+    report("get", start, count);
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        table_delete(&table, keys[i]);
+    }
+    report("delete", start, count);
+
+    free_table(&table);
+    free(keys);
+}
+
+int main(int argc, char* argv[])
+{
+    init_VM();
+    // every key stays reachable only from the C array above
+    vm.next_gc = SIZE_MAX;
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            run(atoi(argv[i]));
+        }
+    }
+    else
+    {
+        run(1000);
+        run(100000);
+        run(10000000);
+    }
+
+    free_VM();
+    return 0;
+}
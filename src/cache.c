@@ -0,0 +1,638 @@
+// mkstemp(), fchmod() and mmap() are not C99
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "register.h"
+#include "vm.h"
+
+// A cache file is a header, the names of the global slots the code refers
+// to in slot order, then the script function. A function is its counts,
+// name, lines, code and constants, nested functions written out in place.
+// Everything is in the byte order of the machine that wrote it, which is
+// the only one expected to read it back; a file from anywhere else fails
+// the magic number.
+//
+//   u32 magic, version, opcode fingerprint, flags
+//   u64 source length, source hash, payload hash
+//   u32 global count, then per global: string name, u8 immutable
+//   function: u32 arity, upvalue count, slot count, u8 register code
+//             string name, or u32 NO_NAME for the script
+//             u32 code count, zeros up to a multiple of 4 bytes into the
+//             file, i32 line per code byte, code bytes
+//             u32 constant count, then per constant a u8 tag and its value
+//   string:   u32 length, bytes
+//
+// The payload hash is FNV-1a over everything after the header and is
+// checked before any of it is read, so a file damaged on disk is compiled
+// over rather than run. The code is still walked once it is read: every
+// opcode must exist and every constant and global operand name an entry
+// the file holds, or the file is treated as corrupt.
+//
+// The file holds no pointers, so it is mapped read-only wherever mmap()
+// puts it and the chunks run their code and lines in place: processes
+// running the same script share one copy through the page cache. Strings
+// are interned from the mapping; an ObjString keeps its characters inline
+// and the collector moves and marks it, so it cannot live there itself.
+// Writers never touch an existing file, which others may have mapped, but
+// rename a new one over it.
+
+#define CACHE_MAGIC 0x43584f4cu  // "LOXC" in little-endian
+#define CACHE_REGISTERS 1        // flags: compiled with --registers
+#define CACHE_OPTIMIZED 2        // and without --no-optimize
+#define NO_NAME UINT32_MAX
+#define FNV_OFFSET 0xcbf29ce484222325ull
+// nested functions deeper than this are a corrupt file, not a real script
+#define CACHE_MAX_DEPTH 256
+
+enum
+{
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+};
+
+typedef struct
+{
+    const u8* start;
+    const u8* at;
+    const u8* end;
+    u32       global_count;  // slots the file names, once they are read
+    bool      ok;            // cleared by the first read past the end
+} Reader;
+
+typedef struct
+{
+    FILE* out;
+    u64   hash;  // of the bytes written since the header
+} Writer;
+
+typedef struct
+{
+    void*  base;
+    size_t size;
+} Image;
+
+// Mapped until free_cache_images(), chunks point into them.
+static Image* images = NULL;
+static int    image_count = 0;
+static int    image_capacity = 0;
+
+static u64 hash_bytes(u64 hash, const void* bytes, size_t length)
+{
+    // FNV-1a
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ ((const u8*)bytes)[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// The opcodes by name, so a build that renumbered or added any never reads
+// bytecode another one wrote.
+static u32 opcode_fingerprint()
+{
+    u64 hash = FNV_OFFSET;
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        const char* name = opcode_name((u8)i);
+        hash = hash_bytes(hash, name, strlen(name) + 1);
+    }
+    return (u32)(hash ^ (hash >> 32));
+}
+
+static u32 cache_flags()
+{
+    return (vm.register_mode ? CACHE_REGISTERS : 0) |
+           (vm.optimize_code ? CACHE_OPTIMIZED : 0);
+}
+
+static char* cache_path(const char* path)
+{
+    size_t length = strlen(path);
+    bool   lox = length >= 4 && strcmp(path + length - 4, ".lox") == 0;
+    char*  result = (char*)malloc(length + (lox ? 2 : 6));
+    if (result == NULL)
+        exit(1);
+    strcpy(result, path);
+    strcat(result, lox ? "c" : ".loxc");
+    return result;
+}
+
+static void write_bytes(Writer* writer, const void* bytes, size_t length)
+{
+    fwrite(bytes, 1, length, writer->out);
+    writer->hash = hash_bytes(writer->hash, bytes, length);
+}
+
+static void write_u8(Writer* writer, u8 value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_u32(Writer* writer, u32 value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_u64(Writer* writer, u64 value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_string(Writer* writer, ObjString* string)
+{
+    write_u32(writer, (u32)string->length);
+    write_bytes(writer, string->chars, string->length);
+}
+
+static void write_function(Writer* writer, ObjFunction* function)
+{
+    write_u32(writer, (u32)function->arity);
+    write_u32(writer, (u32)function->upvalue_count);
+    write_u32(writer, (u32)function->slot_count);
+    write_u8(writer, function->register_code);
+    if (function->name == NULL)
+        write_u32(writer, NO_NAME);
+    else
+        write_string(writer, function->name);
+
+    Chunk* chunk = &function->chunk;
+    write_u32(writer, (u32)chunk->count);
+    while (ftell(writer->out) % sizeof(int) != 0)
+    {
+        write_u8(writer, 0);
+    }
+    write_bytes(writer, chunk->lines, sizeof(int) * chunk->count);
+    write_bytes(writer, chunk->code, chunk->count);
+
+    write_u32(writer, (u32)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_NIL(constant))
+            write_u8(writer, CONSTANT_NIL);
+        else if (IS_BOOL(constant))
+            write_u8(writer,
+                     AS_BOOL(constant) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        else if (IS_NUMBER(constant))
+        {
+            double number = AS_NUMBER(constant);
+            write_u8(writer, CONSTANT_NUMBER);
+            write_bytes(writer, &number, sizeof(number));
+        }
+        else if (IS_STRING(constant))
+        {
+            write_u8(writer, CONSTANT_STRING);
+            write_string(writer, AS_STRING(constant));
+        }
+        else
+        {
+            write_u8(writer, CONSTANT_FUNCTION);
+            write_function(writer, AS_FUNCTION(constant));
+        }
+    }
+}
+
+// Written under a name of its own and renamed into place, so a run reading
+// the cache while another one writes it sees the old file or the new one.
+// mkstemp() picks the name and creates the file, so nothing planted at a
+// name known in advance is written through.
+static void write_cache(const char* path, const char* source,
+                        ObjFunction* script)
+{
+    char* temporary = (char*)checked_malloc(strlen(path) + 8);
+    sprintf(temporary, "%s.XXXXXX", path);
+    int descriptor = mkstemp(temporary);
+    if (descriptor < 0)
+    {
+        free(temporary);
+        return;
+    }
+    // mkstemp() leaves the file to its owner alone, the cache gets the
+    // permissions of any other new file
+    mode_t mask = umask(0);
+    umask(mask);
+    FILE* out = fchmod(descriptor, 0666 & ~mask) == 0
+                    ? fdopen(descriptor, "wb")
+                    : NULL;
+    if (out == NULL)
+    {
+        close(descriptor);
+        remove(temporary);
+        free(temporary);
+        return;
+    }
+
+    Writer writer = {.out = out, .hash = FNV_OFFSET};
+    size_t length = strlen(source);
+    write_u32(&writer, CACHE_MAGIC);
+    write_u32(&writer, CACHE_VERSION);
+    write_u32(&writer, opcode_fingerprint());
+    write_u32(&writer, cache_flags());
+    write_u64(&writer, length);
+    write_u64(&writer, hash_bytes(FNV_OFFSET, source, length));
+    // the payload hash is known once the rest is written
+    long payload_hash = ftell(out);
+    write_u64(&writer, 0);
+
+    writer.hash = FNV_OFFSET;
+    write_u32(&writer, (u32)vm.global_count);
+    for (int i = 0; i < vm.global_count; i++)
+    {
+        write_string(&writer, vm.global_names[i].name);
+        write_u8(&writer, vm.global_names[i].is_immutable);
+    }
+    write_function(&writer, script);
+
+    u64  hash = writer.hash;
+    bool failed = fseek(out, payload_hash, SEEK_SET) != 0 ||
+                  fwrite(&hash, sizeof(hash), 1, out) != 1 || ferror(out);
+    if (fclose(out) != 0 || failed || rename(temporary, path) != 0)
+        remove(temporary);
+    free(temporary);
+}
+
+static const u8* read_bytes(Reader* reader, size_t length)
+{
+    if (!reader->ok || (size_t)(reader->end - reader->at) < length)
+    {
+        reader->ok = false;
+        return NULL;
+    }
+    const u8* bytes = reader->at;
+    reader->at += length;
+    return bytes;
+}
+
+static u32 read_u32(Reader* reader)
+{
+    u32       value = 0;
+    const u8* bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static u64 read_u64(Reader* reader)
+{
+    u64       value = 0;
+    const u8* bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static u8 read_u8(Reader* reader)
+{
+    const u8* bytes = read_bytes(reader, 1);
+    return bytes == NULL ? 0 : *bytes;
+}
+
+// NULL once the file turned out short or corrupt.
+static ObjString* read_string(Reader* reader, u32 length)
+{
+    const u8* chars = read_bytes(reader, length);
+    if (chars == NULL || length > INT32_MAX)
+    {
+        reader->ok = false;
+        return NULL;
+    }
+    return copy_string((const char*)chars, (int)length);
+}
+
+static int read_operand(Chunk* chunk, int offset, int width)
+{
+    int operand = 0;
+    for (int i = 0; i < width; i++)
+        operand = (operand << 8) | chunk->code[offset + i];
+    return operand;
+}
+
+// Where the constant or global slot operand of the instruction at offset
+// is, and how many bytes it takes; false for an opcode that does not
+// exist. Both stay 0 for instructions without one.
+static bool find_operands(Chunk* chunk, bool registers, int offset,
+                          int* constant, int* global, int* width)
+{
+    u8 opcode = chunk->code[offset];
+    if (registers)
+    {
+        switch ((RegisterOp)opcode)
+        {
+        case REG_LOADK:
+        case REG_CLOSURE:
+            *constant = offset + 2;
+            *width = 2;
+            return true;
+        case REG_GET_GLOBAL:
+        case REG_DEFINE_GLOBAL:
+        case REG_SET_GLOBAL:
+            *global = offset + 2;
+            *width = 2;
+            return true;
+        case REG_ADD_K:
+        case REG_SUBSTRACT_K:
+        case REG_MULTIPLY_K:
+        case REG_DIVIDE_K:
+        case REG_EQUAL_K:
+        case REG_NOT_EQUAL_K:
+        case REG_GREATER_K:
+        case REG_LESS_K:
+            *constant = offset + 3;
+            *width = 1;
+            return true;
+        case REG_EQUAL_K_JUMP_IF_FALSE:
+        case REG_NOT_EQUAL_K_JUMP_IF_FALSE:
+        case REG_GREATER_K_JUMP_IF_FALSE:
+        case REG_LESS_K_JUMP_IF_FALSE:
+            *constant = offset + 2;
+            *width = 1;
+            return true;
+        default:
+            return opcode <= REG_RETURN;
+        }
+    }
+
+    switch ((OpCode)opcode)
+    {
+    case OP_CONSTANT:
+    case OP_CLOSURE:
+        *constant = offset + 1;
+        *width = 1;
+        return true;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        *constant = offset + 2;
+        *width = 1;
+        return true;
+    case OP_CONSTANT_LONG:
+    case OP_CLOSURE_LONG:
+        *constant = offset + 1;
+        *width = 3;
+        return true;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+        *global = offset + 1;
+        *width = 2;
+        return true;
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+        *global = offset + 1;
+        *width = 3;
+        return true;
+    default:
+        return opcode <= OP_LESS_JUMP_IF_FALSE_NUMBER;
+    }
+}
+
+// Whether run() can take the code as it is: every instruction whole, and
+// every constant and global it names there. A closure's constant must be a
+// function, the length of the instruction depends on it.
+static bool code_valid(ObjFunction* function, u32 global_count)
+{
+    Chunk* chunk = &function->chunk;
+    bool   registers = function->register_code;
+    int    offset = 0;
+    while (offset < chunk->count)
+    {
+        int constant = 0, global = 0, width = 0;
+        if (!find_operands(chunk, registers, offset, &constant, &global,
+                           &width))
+            return false;
+        if (constant + global + width > chunk->count)
+            return false;
+        if (constant != 0)
+        {
+            u8   opcode = chunk->code[offset];
+            int  index = read_operand(chunk, constant, width);
+            bool is_closure = registers ? opcode == REG_CLOSURE
+                                        : opcode == OP_CLOSURE ||
+                                              opcode == OP_CLOSURE_LONG;
+            if (index >= chunk->constants.count ||
+                (is_closure && !IS_FUNCTION(chunk->constants.values[index])))
+                return false;
+        }
+        if (global != 0 &&
+            (u32)read_operand(chunk, global, width) >= global_count)
+            return false;
+
+        offset += registers ? register_instruction_length(chunk, offset)
+                            : instruction_length(chunk, offset);
+    }
+    return offset == chunk->count;
+}
+
+// Builds the function rooted on the VM stack, like the compiler does, since
+// every allocation may collect. Pops it again before returning.
+static ObjFunction* read_function(Reader* reader, int depth)
+{
+    if (depth > CACHE_MAX_DEPTH)
+    {
+        reader->ok = false;
+        return NULL;
+    }
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+
+    function->arity = (int)read_u32(reader);
+    function->upvalue_count = (int)read_u32(reader);
+    function->slot_count = (int)read_u32(reader);
+    function->register_code = read_u8(reader) != 0;
+    u32 name_length = read_u32(reader);
+    if (name_length != NO_NAME)
+    {
+        function->name = read_string(reader, name_length);
+        if (function->name != NULL)
+            write_barrier((Obj*)function, OBJ_VAL(function->name));
+    }
+
+    u32    count = read_u32(reader);
+    size_t offset = (size_t)(reader->at - reader->start);
+    read_bytes(reader, (sizeof(int) - offset % sizeof(int)) % sizeof(int));
+    const u8* lines = read_bytes(reader, sizeof(int) * (size_t)count);
+    const u8* code = read_bytes(reader, count);
+    if (code != NULL && lines != NULL && count > 0 && count <= INT32_MAX)
+    {
+        // the mapping is read-only, QUICKEN in run() leaves it alone
+        Chunk* chunk = &function->chunk;
+        chunk->code = (u8*)code;
+        chunk->lines = (int*)lines;
+        chunk->count = (int)count;
+        chunk->mapped = true;
+    }
+    else
+    {
+        reader->ok = false;
+    }
+
+    u32 constant_count = read_u32(reader);
+    for (u32 i = 0; i < constant_count && reader->ok; i++)
+    {
+        Value constant = NIL_VAL;
+        switch (read_u8(reader))
+        {
+        case CONSTANT_NIL:
+            break;
+        case CONSTANT_FALSE:
+            constant = BOOL_VAL(false);
+            break;
+        case CONSTANT_TRUE:
+            constant = BOOL_VAL(true);
+            break;
+        case CONSTANT_NUMBER:
+        {
+            double    number = 0;
+            const u8* bytes = read_bytes(reader, sizeof(number));
+            if (bytes != NULL)
+                memcpy(&number, bytes, sizeof(number));
+            constant = NUMBER_VAL(number);
+            break;
+        }
+        case CONSTANT_STRING:
+        {
+            ObjString* string = read_string(reader, read_u32(reader));
+            if (string != NULL)
+                constant = OBJ_VAL(string);
+            break;
+        }
+        case CONSTANT_FUNCTION:
+        {
+            ObjFunction* nested = read_function(reader, depth + 1);
+            if (nested != NULL)
+                constant = OBJ_VAL(nested);
+            break;
+        }
+        default:
+            reader->ok = false;
+            break;
+        }
+        add_constant(&function->chunk, constant);
+        write_barrier((Obj*)function, constant);
+    }
+
+    if (reader->ok && !code_valid(function, reader->global_count))
+        reader->ok = false;
+    pop();
+    return reader->ok ? function : NULL;
+}
+
+// The script from the cache at path, or NULL when it is missing, stale or
+// corrupt. Its global names take the slots they had when it was written,
+// or the code would refer to the wrong ones; the VM starts out the same
+// every run, so only a different set of natives gets in the way.
+static ObjFunction* read_cache(const char* path, const char* source)
+{
+    int in = open(path, O_RDONLY);
+    if (in < 0)
+        return NULL;
+    struct stat file;
+    void*       base = MAP_FAILED;
+    if (fstat(in, &file) == 0 && file.st_size > 0)
+        base = mmap(NULL, file.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    size_t size = (size_t)file.st_size;
+    Reader reader = {.start = base,
+                     .at = base,
+                     .end = (const u8*)base + size,
+                     .ok = true};
+    size_t length = strlen(source);
+    bool   fresh =
+        read_u32(&reader) == CACHE_MAGIC &&
+        read_u32(&reader) == CACHE_VERSION &&
+        read_u32(&reader) == opcode_fingerprint() &&
+        read_u32(&reader) == cache_flags() && read_u64(&reader) == length &&
+        read_u64(&reader) == hash_bytes(FNV_OFFSET, source, length);
+    u64  payload_hash = read_u64(&reader);
+    bool intact = fresh && reader.ok &&
+                  hash_bytes(FNV_OFFSET, reader.at,
+                             (size_t)(reader.end - reader.at)) == payload_hash;
+
+    ObjFunction* script = NULL;
+    if (intact)
+    {
+        u32 global_count = read_u32(&reader);
+        for (u32 i = 0; i < global_count && reader.ok; i++)
+        {
+            ObjString* name = read_string(&reader, read_u32(&reader));
+            bool       is_immutable = read_u8(&reader) != 0;
+            if (name == NULL || global_slot(name) != (int)i)
+            {
+                reader.ok = false;
+                break;
+            }
+            vm.global_names[i].is_immutable = is_immutable;
+        }
+        reader.global_count = global_count;
+        if (reader.ok)
+            script = read_function(&reader, 0);
+        if (reader.at != reader.end)
+            script = NULL;
+    }
+
+    // functions read from a file that turned out bad are garbage, and
+    // never run, before their code goes
+    if (script == NULL)
+    {
+        munmap(base, size);
+        return NULL;
+    }
+    if (image_count + 1 > image_capacity)
+    {
+        image_capacity = image_capacity < 4 ? 4 : image_capacity * 2;
+        images = (Image*)realloc(images, sizeof(Image) * image_capacity);
+        if (images == NULL)
+            exit(1);
+    }
+    images[image_count++] = (Image){.base = base, .size = size};
+    return script;
+}
+
+void free_cache_images()
+{
+    for (int i = 0; i < image_count; i++)
+    {
+        munmap(images[i].base, images[i].size);
+    }
+    free(images);
+    images = NULL;
+    image_count = 0;
+    image_capacity = 0;
+}
+
+ObjFunction* compile_cached(const char* path, const char* source)
+{
+    if (!vm.use_cache || vm.print_code)
+        return compile(source);
+
+    char*        cache = cache_path(path);
+    ObjFunction* script = read_cache(cache, source);
+    if (script == NULL)
+    {
+        script = compile(source);
+        if (script != NULL)
+            write_cache(cache, source, script);
+    }
+    free(cache);
+    return script;
+}
@@ -0,0 +1,19 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+// Bump whenever the file layout or the bytecode it holds changes meaning.
+#define CACHE_VERSION 3
+
+// The script compiled from source, read from path's bytecode cache ("x.lox"
+// caches to "x.loxc") when that holds this very source compiled with the
+// same options, or compiled and written there for the next run. NULL when
+// source does not compile. --print-code skips the cache, so there is code
+// to print. A cache that is read is mapped rather than copied, and the
+// script's code and lines run from the mapping.
+ObjFunction* compile_cached(const char* path, const char* source);
+// Unmaps the caches read, once the functions from them are freed.
+void         free_cache_images();
+
+#endif
@@ -4,17 +4,25 @@
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void init_chunk(Chunk* chunk)
 {
-    *chunk = (Chunk){.count = 0, .capacity = 0, .code = NULL, .lines = NULL};
+    *chunk = (Chunk){.count = 0,
+                     .capacity = 0,
+                     .code = NULL,
+                     .lines = NULL,
+                     .mapped = false};
     init_value_array(&chunk->constants);
 }
 
 void free_chunk(Chunk* chunk)
 {
-    FREE_ARRAY(u8, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->mapped)
+    {
+        FREE_ARRAY(u8, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     free_value_array(&chunk->constants);
     init_chunk(chunk);
 }
@@ -35,8 +43,113 @@ void write_chunk(Chunk* chunk, u8 byte, int line)
     chunk->count++;
 }
 
+// Size in bytes of the instruction at offset, operands included.
+int instruction_length(Chunk* chunk, int offset)
+{
+    switch ((OpCode)chunk->code[offset])
+    {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBSTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_NOT_EQUAL:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_SUBSTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+        return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+    case OP_SET_GLOBAL_POP:
+    case OP_LESS_JUMP_IF_FALSE_NUMBER:
+        return 3;
+    case OP_CLOSURE:
+    {
+        ObjFunction* function =
+            AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + 2 * function->upvalue_count;
+    }
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+        return 4;
+    case OP_CLOSURE_LONG:
+    {
+        int constant = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        return 4 + 4 * function->upvalue_count;
+    }
+    }
+    return 1;
+}
+
+// The opcode a quickened one was rewritten from, for the passes that read
+// code which may have run already.
+u8 generic_opcode(u8 opcode)
+{
+    switch ((OpCode)opcode)
+    {
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        return OP_ADD;
+    case OP_SUBSTRACT_NUMBER:
+        return OP_SUBSTRACT;
+    case OP_MULTIPLY_NUMBER:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_NUMBER:
+        return OP_DIVIDE;
+    case OP_GREATER_NUMBER:
+        return OP_GREATER;
+    case OP_LESS_NUMBER:
+        return OP_LESS;
+    case OP_LESS_JUMP_IF_FALSE_NUMBER:
+        return OP_LESS_JUMP_IF_FALSE;
+    default:
+        return opcode;
+    }
+}
+
 int add_constant(Chunk* chunk, Value value)
 {
+    push(value);
     write_value_array(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 }
@@ -30,11 +30,44 @@ typedef enum
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,  // JUMP_IF_FALSE that pops the condition
     OP_LOOP,
     OP_CALL,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+
+    // Superinstructions, produced by optimize_chunk() from the opcode pairs
+    // that benchmarks/pairs.sh ranks highest, and OP_NOT_EQUAL for "!=".
+    OP_NOT_EQUAL,
+    OP_ADD_LOCAL_CONSTANT,        // GET_LOCAL, CONSTANT, ADD
+    OP_SUBSTRACT_LOCAL_CONSTANT,  // GET_LOCAL, CONSTANT, SUBSTRACT
+    OP_LESS_LOCAL_CONSTANT,       // GET_LOCAL, CONSTANT, LESS
+    OP_LESS_JUMP_IF_FALSE,        // LESS, POP_JUMP_IF_FALSE
+    OP_EQUAL_JUMP_IF_FALSE,       // EQUAL, POP_JUMP_IF_FALSE
+    OP_SET_LOCAL_POP,             // SET_LOCAL, POP
+    OP_SET_GLOBAL_POP,            // SET_GLOBAL, POP
+
+    // Three-byte operand forms for chunks past the one- and two-byte limits.
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_CLOSURE_LONG,  // upvalue indexes widened to three bytes as well
+
+    // Quickened forms: run() rewrites a generic arithmetic or comparison
+    // opcode in place into the one for the operand types it met, and a
+    // quickened opcode back into the generic one when they change.
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBSTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_LESS_JUMP_IF_FALSE_NUMBER,
 } OpCode;
 
 typedef struct
@@ -44,11 +77,14 @@ typedef struct
     u8*        code;
     int*       lines;
     ValueArray constants;
+    bool       mapped;  // code and lines are in a read-only image, cache.c
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, u8 byte, int line);
 int  add_constant(Chunk* chunk, Value value);
+int  instruction_length(Chunk* chunk, int offset);
+u8   generic_opcode(u8 opcode);
 
 #endif
@@ -6,12 +6,39 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff  // largest operand of the *_LONG opcodes
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// The trace build variant defines these to turn --print-code and --trace
+// on by default.
+// #define DEBUG_PRINT_CODE
+// #define DEBUG_TRACE_EXECUTION
+
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Counts how often each opcode follows each other one and dumps the table
+// at exit, see benchmarks/pairs.sh.
+// #define DEBUG_PROFILE_PAIRS
+
+// Direct-threaded dispatch through a table of label addresses needs the
+// GCC/Clang "labels as values" extension; everything else falls back to the
+// portable switch. Build with -DSWITCH_DISPATCH to force the fallback.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// Hot functions and loops are compiled to x86-64 machine code, see jit.c and
+// trace.c. Build with -DNO_JIT to keep everything in the interpreter, or run
+// with --no-jit. The instruction counting builds leave it out so they count
+// every instruction.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT) &&        \
+    !defined(DEBUG_COUNT_INSTRUCTIONS) && !defined(DEBUG_PROFILE_PAIRS)
+#define JIT
+#endif
 
 #endif
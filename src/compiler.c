@@ -6,14 +6,14 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "debug.h"
+#include "memory.h"
 #include "object.h"
+#include "peephole.h"
+#include "register.h"
 #include "scanner.h"
 #include "value.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
 #define PARAMETERS_MAX 255
 
 typedef struct
@@ -58,8 +58,9 @@ typedef struct
 
 typedef struct
 {
-    u8   index;
+    int  index;
     bool islocal;
+    bool is_immutable;
 } Upvalue;
 
 typedef enum
@@ -68,20 +69,32 @@ typedef enum
     TYPE_SCRIPT,
 } FunctionType;
 
+// Numbers and strings get a single constant each per chunk. Strings are
+// interned, so their pointers are compared; numbers are compared by their
+// bits, which keeps 0 and -0 apart.
+typedef struct
+{
+    int* slots;  // constant index + 1, 0 when empty
+    int  capacity;
+    int  count;
+} ConstantIndex;
+
 typedef struct Compiler
 {
     struct Compiler* enclosing;
     ObjFunction*     function;
     FunctionType     type;
 
-    Local   locals[UINT8_COUNT];
-    int     local_count;
-    Upvalue upvalues[UINT8_COUNT];
-    int     scope_depth;
+    Local*        locals;
+    int           local_count;
+    int           local_capacity;
+    Upvalue       upvalues[UINT8_COUNT];
+    int           scope_depth;
+    ConstantIndex constants;
+    int           last_literal;  // offset of the latest literal load, or -1
+    int           literal_constants;  // constant count before that load
 } Compiler;
 
-static bool immutable_globals[UINT8_MAX];
-
 Parser    parser;
 Compiler* current = NULL;
 
@@ -196,20 +209,132 @@ static void emit_return()
     emit_byte(OP_RETURN);
 }
 
-static u8 make_constant(Value value)
+static void emit_long(int operand)
+{
+    emit_byte((operand >> 16) & 0xff);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+// Emits instruction with a one-byte operand, or long_instruction with a
+// three-byte one when the operand does not fit.
+static void emit_operand(u8 instruction, u8 long_instruction, int operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emit_bytes(instruction, (u8)operand);
+        return;
+    }
+    emit_byte(long_instruction);
+    emit_long(operand);
+}
+
+static u32 hash_constant(Value value)
+{
+    if (IS_STRING(value))
+        return AS_STRING(value)->hash;
+
+    u64 bits;
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (u32)bits;
+}
+
+static bool same_constant(Value a, Value b)
+{
+    if (IS_STRING(a) || IS_STRING(b))
+        return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+// Returns the slot holding value or the empty slot it belongs in. Entries
+// left behind by constants that folding dropped again no longer match
+// anything and are skipped like any other.
+static int* find_constant(ConstantIndex* index, ValueArray* constants,
+                          Value value)
+{
+    u32 mask = (u32)index->capacity - 1;
+    for (u32 slot = hash_constant(value) & mask;; slot = (slot + 1) & mask)
+    {
+        int entry = index->slots[slot];
+        if (entry == 0 || (entry <= constants->count &&
+                           same_constant(constants->values[entry - 1], value)))
+        {
+            return &index->slots[slot];
+        }
+    }
+}
+
+static int add_unique_constant(Value value)
+{
+    Chunk*         chunk = current_chunk();
+    ConstantIndex* index = &current->constants;
+    if (!IS_NUMBER(value) && !IS_STRING(value))
+        return add_constant(chunk, value);
+
+    if (index->count + 1 > index->capacity * 3 / 4)
+    {
+        int* old_slots = index->slots;
+        int  old_capacity = index->capacity;
+        index->capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+        index->slots = (int*)calloc(index->capacity, sizeof(int));
+        if (index->slots == NULL)
+            exit(1);
+        index->count = 0;
+        for (int i = 0; i < old_capacity; i++)
+        {
+            int entry = old_slots[i];
+            if (entry == 0 || entry > chunk->constants.count)
+                continue;
+            *find_constant(index, &chunk->constants,
+                           chunk->constants.values[entry - 1]) = entry;
+            index->count++;
+        }
+        free(old_slots);
+    }
+
+    int* slot = find_constant(index, &chunk->constants, value);
+    if (*slot == 0)
+    {
+        *slot = add_constant(chunk, value) + 1;
+        index->count++;
+    }
+    return *slot - 1;
+}
+
+static int make_constant(Value value)
 {
-    int constant = add_constant(current_chunk(), value);
-    if (constant > UINT8_MAX)
+    int constant = add_unique_constant(value);
+    write_barrier((Obj*)current->function, value);
+    if (constant > UINT24_MAX)
     {
         error("Too many constants in one chunk");
         return 0;
     }
-    return (u8)constant;
+    return constant;
 }
 
 static void emit_constant(Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    current->literal_constants = current_chunk()->constants.count;
+    int constant = make_constant(value);
+    current->last_literal = current_chunk()->count;
+    emit_operand(OP_CONSTANT, OP_CONSTANT_LONG, constant);
+}
+
+static void emit_literal(u8 instruction)
+{
+    current->literal_constants = current_chunk()->constants.count;
+    current->last_literal = current_chunk()->count;
+    emit_byte(instruction);
 }
 
 static void patch_jump(int offset)
@@ -218,25 +343,56 @@ static void patch_jump(int offset)
     if (jump > UINT16_MAX)
         error("Too much code to jump over");
 
+    // a literal the jump lands after no longer stands alone
+    current->last_literal = -1;
+
     current_chunk()->code[offset] = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
 }
+
+// Locals live in a growable array: functions holding more than 256 of them
+// use the *_LOCAL_LONG opcodes. slot_count lets call() check the stack.
+static Local* push_local()
+{
+    if (current->local_capacity < current->local_count + 1)
+    {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals, old_capacity,
+                                     current->local_capacity);
+    }
+
+    Local* local = &current->locals[current->local_count++];
+    if (current->local_count > current->function->slot_count)
+        current->function->slot_count = current->local_count;
+    return local;
+}
+
 static void init_compiler(Compiler* compiler, FunctionType type)
 {
     compiler->enclosing = current;
+    compiler->function = NULL;
     compiler->function = new_function();
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
     compiler->scope_depth = 0;
+    compiler->constants.slots = NULL;
+    compiler->constants.capacity = 0;
+    compiler->constants.count = 0;
+    compiler->last_literal = -1;
     current = compiler;
 
     if (type != TYPE_SCRIPT)
     {
         current->function->name =
             copy_string(parser.previous.start, parser.previous.length);
+        write_barrier((Obj*)current->function,
+                      OBJ_VAL(current->function->name));
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = push_local();
     local->depth = 0;
     local->is_captured = false;
     local->is_immutable = false;
@@ -248,14 +404,24 @@ static ObjFunction* end_compiler()
 {
     emit_return();
     ObjFunction* function = current->function;
+    if (vm.optimize_code)
+        optimize_chunk(current_chunk());
+    // a function too large for registers keeps its stack code
+    if (vm.register_mode && !parser.had_error)
+        function->register_code = compile_registers(function);
 
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
-        disassemble_chunk(current_chunk(), function->name != NULL
-                                               ? function->name->chars
-                                               : "<script>");
-#endif
+    if (vm.print_code && !parser.had_error)
+    {
+        const char* name =
+            function->name != NULL ? function->name->chars : "<script>";
+        if (function->register_code)
+            disassemble_register_chunk(current_chunk(), name);
+        else
+            disassemble_chunk(current_chunk(), name);
+    }
 
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
+    free(current->constants.slots);
     current = current->enclosing;
     return function;
 }
@@ -287,9 +453,40 @@ static void       declaration();
 static ParseRule* get_rule(TokenType type);
 static void       parse_precedence(Precedence precedence);
 
-static u8 identifier_constant(Token* name)
+static int identifier_global(Token* name)
 {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+    int slot = global_slot(copy_string(name->start, name->length));
+    if (slot > UINT24_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
+// Global slots take two bytes, or three in the _LONG form of instruction.
+static void emit_global(u8 instruction, int slot)
+{
+    if (slot > UINT16_MAX)
+    {
+        switch (instruction)
+        {
+        case OP_GET_GLOBAL:
+            emit_byte(OP_GET_GLOBAL_LONG);
+            break;
+        case OP_SET_GLOBAL:
+            emit_byte(OP_SET_GLOBAL_LONG);
+            break;
+        default:
+            emit_byte(OP_DEFINE_GLOBAL_LONG);
+            break;
+        }
+        emit_long(slot);
+        return;
+    }
+    emit_byte(instruction);
+    emit_byte((slot >> 8) & 0xff);
+    emit_byte(slot & 0xff);
 }
 
 static bool identifiers_equal(Token* t1, Token* t2)
@@ -316,7 +513,8 @@ static int resolve_local(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int add_upvalue(Compiler* compiler, u8 index, bool islocal)
+static int add_upvalue(Compiler* compiler, int index, bool islocal,
+                       bool is_immutable)
 {
     int upvalue_count = compiler->function->upvalue_count;
     for (int i = 0; i < upvalue_count; i++)
@@ -334,6 +532,7 @@ static int add_upvalue(Compiler* compiler, u8 index, bool islocal)
 
     compiler->upvalues[upvalue_count].islocal = islocal;
     compiler->upvalues[upvalue_count].index = index;
+    compiler->upvalues[upvalue_count].is_immutable = is_immutable;
     return compiler->function->upvalue_count++;
 }
 
@@ -345,25 +544,28 @@ static int resolve_upvalue(Compiler* compiler, Token* name)
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1)
     {
-        compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (u8)local, true);
+        Local* captured = &compiler->enclosing->locals[local];
+        captured->is_captured = true;
+        return add_upvalue(compiler, local, true, captured->is_immutable);
     }
 
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1)
-        return add_upvalue(compiler, (u8)upvalue, false);
+        return add_upvalue(
+            compiler, upvalue, false,
+            compiler->enclosing->upvalues[upvalue].is_immutable);
 
     return -1;
 }
 
 static void add_local(Token name, bool is_immutable)
 {
-    if (current->local_count == UINT8_COUNT)
+    if (current->local_count == UINT24_MAX + 1)
     {
         error("Too many variables in function");
         return;
     }
-    Local* local = &current->locals[current->local_count++];
+    Local* local = push_local();
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
@@ -389,7 +591,7 @@ static void declare_variable(bool is_immutable)
     add_local(*name, is_immutable);
 }
 
-static u8 parse_variable(bool is_immutable, char* error_message)
+static int parse_variable(bool is_immutable, char* error_message)
 {
     consume(TOKEN_IDENTIFIER, error_message);
 
@@ -397,7 +599,7 @@ static u8 parse_variable(bool is_immutable, char* error_message)
     if (current->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return identifier_global(&parser.previous);
 }
 
 static void mark_initialized()
@@ -407,15 +609,15 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(u8 global, bool is_immutable)
+static void define_variable(int global, bool is_immutable)
 {
     if (current->scope_depth > 0)
     {
         mark_initialized();
         return;
     }
-    immutable_globals[global] = is_immutable;
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    vm.global_names[global].is_immutable = is_immutable;
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static u8 arguments_list()
@@ -438,6 +640,131 @@ static u8 arguments_list()
     return arg_count;
 }
 
+// ---------------------- constant folding ------------------------
+
+// Reads the literal load at offset into *value and returns the offset just
+// past it, or -1 when there is none.
+static int literal_at(int offset, Value* value)
+{
+    Chunk* chunk = current_chunk();
+    if (offset == -1)
+        return -1;
+
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[chunk->code[offset + 1]];
+        return offset + 2;
+    case OP_CONSTANT_LONG:
+        *value = chunk->constants.values[(chunk->code[offset + 1] << 16) |
+                                         (chunk->code[offset + 2] << 8) |
+                                         chunk->code[offset + 3]];
+        return offset + 4;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return offset + 1;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return offset + 1;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return offset + 1;
+    default:
+        return -1;
+    }
+}
+
+// Replaces the literal loads from offset to the end of the chunk with one
+// loading value. Constants those loads appended, from index constants on,
+// are dropped; ones they shared with earlier code stay.
+static void replace_literals(int offset, int constants, Value value)
+{
+    push(value);
+    current_chunk()->count = offset;
+    current_chunk()->constants.count = constants;
+    current->last_literal = -1;
+    if (IS_BOOL(value))
+        emit_literal(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else if (IS_NIL(value))
+        emit_literal(OP_NIL);
+    else
+        emit_constant(value);
+    pop();
+}
+
+static bool is_falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Evaluates a binary operator on two literals the way the VM would. Returns
+// false for operands the VM rejects, which are left to fail at runtime.
+static bool fold_binary(TokenType operator_type, Value a, Value b,
+                        Value* result)
+{
+    switch (operator_type)
+    {
+    case TOKEN_EQUAL_EQUAL:
+        *result = BOOL_VAL(values_equal(a, b));
+        return true;
+    case TOKEN_BANG_EQUAL:
+        *result = BOOL_VAL(!values_equal(a, b));
+        return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b))
+        {
+            ObjString* left = AS_STRING(a);
+            ObjString* right = AS_STRING(b);
+            ObjString* string = allocate_string(left->length + right->length);
+            memcpy(string->chars, left->chars, left->length);
+            memcpy(string->chars + left->length, right->chars,
+                   right->length);
+            *result = OBJ_VAL(intern_string(string));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operator_type)
+    {
+    case TOKEN_PLUS:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case TOKEN_MINUS:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case TOKEN_STAR:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case TOKEN_SLASH:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    default:
+        return false;
+    }
+}
+
+// ---------------------- expressions --------------------------
+
 static void and_(bool can_assign)
 {
     int end_jump = emit_jump(OP_JUMP_IF_FALSE);
@@ -451,17 +778,31 @@ static void and_(bool can_assign)
 static void binary(bool can_assign)
 {
     TokenType operator_type = parser.previous.type;
+    int       left = current->last_literal;
+    int       constants = current->literal_constants;
+    Value     a, b, result;
+    bool      is_literal = literal_at(left, &a) == current_chunk()->count;
+    int       right = current_chunk()->count;
 
     ParseRule* rule = get_rule(operator_type);
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    // both operands literals: compute the result now
+    if (is_literal && current->last_literal == right &&
+        literal_at(right, &b) == current_chunk()->count &&
+        fold_binary(operator_type, a, b, &result))
+    {
+        replace_literals(left, constants, result);
+        return;
+    }
+
     switch (operator_type)
     {
     case TOKEN_PLUS:
         emit_byte(OP_ADD);
         break;
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_byte(OP_NOT_EQUAL);
         break;
     case TOKEN_EQUAL_EQUAL:
         emit_byte(OP_EQUAL);
@@ -503,13 +844,13 @@ static void literal(bool can_assign)
     switch (parser.previous.type)
     {
     case TOKEN_NIL:
-        emit_byte(OP_NIL);
+        emit_literal(OP_NIL);
         break;
     case TOKEN_TRUE:
-        emit_byte(OP_TRUE);
+        emit_literal(OP_TRUE);
         break;
     case TOKEN_FALSE:
-        emit_byte(OP_FALSE);
+        emit_literal(OP_FALSE);
         break;
     default:
         return;
@@ -564,7 +905,7 @@ static void named_variable(Token name, bool can_assign)
     }
     else
     {
-        arg = identifier_constant(&name);
+        arg = identifier_global(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
@@ -579,19 +920,36 @@ static void named_variable(Token name, bool can_assign)
                 return;
             }
         }
+        else if (get_op == OP_GET_UPVALUE)
+        {
+            if (current->upvalues[arg].is_immutable)
+            {
+                error("Cannot reassign immutable variables");
+            }
+        }
         else
         {
-            if (immutable_globals[arg])
+            if (vm.global_names[arg].is_immutable)
             {
                 error("Cannot reassign immutable variables");
             }
         }
         expression();
-        emit_bytes(set_op, (u8)arg);
+        if (set_op == OP_SET_GLOBAL)
+            emit_global(set_op, arg);
+        else if (set_op == OP_SET_LOCAL)
+            emit_operand(set_op, OP_SET_LOCAL_LONG, arg);
+        else
+            emit_bytes(set_op, (u8)arg);
     }
     else
     {
-        emit_bytes(get_op, (u8)arg);
+        if (get_op == OP_GET_GLOBAL)
+            emit_global(get_op, arg);
+        else if (get_op == OP_GET_LOCAL)
+            emit_operand(get_op, OP_GET_LOCAL_LONG, arg);
+        else
+            emit_bytes(get_op, (u8)arg);
     }
 }
 
@@ -603,9 +961,29 @@ static void variable(bool can_assign)
 static void unary(bool can_assign)
 {
     TokenType operator_type = parser.previous.type;
+    int       operand = current_chunk()->count;
+    int       constants = current_chunk()->constants.count;
 
     parse_precedence(PREC_UNARY);
 
+    Value value;
+    if (current->last_literal == operand &&
+        literal_at(operand, &value) == current_chunk()->count)
+    {
+        if (operator_type == TOKEN_BANG)
+        {
+            replace_literals(operand, constants,
+                             BOOL_VAL(is_falsey(value)));
+            return;
+        }
+        if (operator_type == TOKEN_MINUS && IS_NUMBER(value))
+        {
+            replace_literals(operand, constants,
+                             NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
+
     switch (operator_type)
     {
     case TOKEN_BANG:
@@ -727,7 +1105,7 @@ static void function(FunctionType type)
                 error_at_current("Can't have more than 255 parameters");
             }
 
-            u8 param_const = parse_variable(false, "Expect parameter name");
+            int param_const = parse_variable(false, "Expect parameter name");
             define_variable(param_const, false);
 
         } while (match(TOKEN_COMMA));
@@ -738,18 +1116,32 @@ static void function(FunctionType type)
     block();
 
     ObjFunction* function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    int          constant = make_constant(OBJ_VAL(function));
+
+    // the long form widens the upvalue indexes along with the constant
+    bool is_long = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalue_count; i++)
+        is_long |= compiler.upvalues[i].index > UINT8_MAX;
+
+    emit_byte(is_long ? OP_CLOSURE_LONG : OP_CLOSURE);
+    if (is_long)
+        emit_long(constant);
+    else
+        emit_byte((u8)constant);
 
     for (int i = 0; i < function->upvalue_count; i++)
     {
-        emit_byte(compiler.upvalues[i].islocal ? 1 : 1);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte(compiler.upvalues[i].islocal ? 1 : 0);
+        if (is_long)
+            emit_long(compiler.upvalues[i].index);
+        else
+            emit_byte((u8)compiler.upvalues[i].index);
     }
 }
 
 static void fun_declaration()
 {
-    u8 global = parse_variable(false, "Expect function name");
+    int global = parse_variable(false, "Expect function name");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_variable(global, false);
@@ -758,7 +1150,7 @@ static void fun_declaration()
 static void var_declaration()
 {
     bool is_immutable = parser.previous.type == TOKEN_VAL;
-    u8   global = parse_variable(is_immutable, "Expect variable name");
+    int  global = parse_variable(is_immutable, "Expect variable name");
 
     if (is_immutable && !check(TOKEN_EQUAL))
     {
@@ -986,3 +1378,13 @@ ObjFunction* compile(const char* source)
     ObjFunction* function = end_compiler();
     return parser.had_error ? NULL : function;
 }
+
+void mark_compiler_roots()
+{
+    Compiler* compiler = current;
+    while (compiler != NULL)
+    {
+        mark_object((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
@@ -5,5 +5,6 @@
 #include "object.h"
 
 ObjFunction* compile(const char* source);
+void         mark_compiler_roots();
 
 #endif
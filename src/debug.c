@@ -3,14 +3,90 @@
 #include "chunk.h"
 #include "debug.h"
 #include "object.h"
+#include "register.h"
 #include "value.h"
+#include "vm.h"
 
 static int simple_instruction(const char* name, int offset);
 static int constant_instruction(const char* name, Chunk* chunk, int offset);
 static int byte_instruction(const char* name, Chunk* chunk, int offset);
+static int global_instruction(const char* name, Chunk* chunk, int offset);
+static int long_instruction(const char* name, Chunk* chunk, int offset);
+static int long_constant_instruction(const char* name, Chunk* chunk,
+                                     int offset);
+static int long_global_instruction(const char* name, Chunk* chunk,
+                                   int offset);
+static int closure_instruction(const char* name, bool is_long, Chunk* chunk,
+                               int offset);
+static int local_constant_instruction(const char* name, Chunk* chunk,
+                                      int offset);
 static int jump_instruction(const char* name, int sign, Chunk* chunk,
                             int offset);
 
+static const char* const opcode_names[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBSTRACT] = "OP_SUBSTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBSTRACT_LOCAL_CONSTANT] = "OP_SUBSTRACT_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT] = "OP_LESS_LOCAL_CONSTANT",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_EQUAL_JUMP_IF_FALSE] = "OP_EQUAL_JUMP_IF_FALSE",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBSTRACT_NUMBER] = "OP_SUBSTRACT_NUMBER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+    [OP_LESS_JUMP_IF_FALSE_NUMBER] = "OP_LESS_JUMP_IF_FALSE_NUMBER",
+};
+
+const char* opcode_name(u8 opcode)
+{
+    if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0]) ||
+        opcode_names[opcode] == NULL)
+        return "OP_UNKNOWN";
+    return opcode_names[opcode];
+}
+
 void disassemble_chunk(Chunk* chunk, const char* name)
 {
     printf("=== %s === \n", name);
@@ -48,11 +124,11 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
@@ -81,38 +157,200 @@ int disassemble_instruction(Chunk* chunk, int offset)
         return jump_instruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
-        return jump_instruction("OP_JUMP_IF_FALSE", -1, chunk, offset);
+        return jump_instruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byte_instruction("OP_CALL", chunk, offset);
     case OP_CLOSURE:
-    {
-        u8 constant = chunk->code[++offset];
-        printf("%-16s %4d ", "OP_CLOSURE", constant);
-        print_value(chunk->constants.values[constant]);
-        printf("\n");
-
-        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-        for (int j = 0; j < function->upvalue_count; j++)
-        {
-            int islocal = chunk->code[offset++];
-            int index = chunk->code[offset++];
-            printf("%04d     |              %s %d\n", offset - 2,
-                   islocal ? "local" : "upvalue", index);
-        }
-
-        return offset;
-    }
+        return closure_instruction("OP_CLOSURE", false, chunk, offset);
     case OP_CLOSE_UPVALUE:
         return simple_instruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
+    case OP_NOT_EQUAL:
+        return simple_instruction("OP_NOT_EQUAL", offset);
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        return local_constant_instruction(opcode_name(instruction), chunk,
+                                          offset);
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        return jump_instruction(opcode_name(instruction), 1, chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+        return global_instruction("OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return long_constant_instruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+        return long_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+        return long_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return long_global_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return long_global_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return long_global_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_CLOSURE_LONG:
+        return closure_instruction("OP_CLOSURE_LONG", true, chunk, offset);
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_SUBSTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+        return simple_instruction(opcode_name(instruction), offset);
+    case OP_LESS_JUMP_IF_FALSE_NUMBER:
+        return jump_instruction(opcode_name(instruction), 1, chunk, offset);
     default:
         printf("Uknown opcode %d \n", instruction);
         return offset + 1;
     }
 }
 
+static const char* const register_names[] = {
+    [REG_LOADK] = "REG_LOADK",
+    [REG_LOADNIL] = "REG_LOADNIL",
+    [REG_LOADTRUE] = "REG_LOADTRUE",
+    [REG_LOADFALSE] = "REG_LOADFALSE",
+    [REG_MOVE] = "REG_MOVE",
+    [REG_GET_GLOBAL] = "REG_GET_GLOBAL",
+    [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL",
+    [REG_SET_GLOBAL] = "REG_SET_GLOBAL",
+    [REG_GET_UPVALUE] = "REG_GET_UPVALUE",
+    [REG_SET_UPVALUE] = "REG_SET_UPVALUE",
+    [REG_ADD] = "REG_ADD",
+    [REG_SUBSTRACT] = "REG_SUBSTRACT",
+    [REG_MULTIPLY] = "REG_MULTIPLY",
+    [REG_DIVIDE] = "REG_DIVIDE",
+    [REG_EQUAL] = "REG_EQUAL",
+    [REG_NOT_EQUAL] = "REG_NOT_EQUAL",
+    [REG_GREATER] = "REG_GREATER",
+    [REG_LESS] = "REG_LESS",
+    [REG_ADD_K] = "REG_ADD_K",
+    [REG_SUBSTRACT_K] = "REG_SUBSTRACT_K",
+    [REG_MULTIPLY_K] = "REG_MULTIPLY_K",
+    [REG_DIVIDE_K] = "REG_DIVIDE_K",
+    [REG_EQUAL_K] = "REG_EQUAL_K",
+    [REG_NOT_EQUAL_K] = "REG_NOT_EQUAL_K",
+    [REG_GREATER_K] = "REG_GREATER_K",
+    [REG_LESS_K] = "REG_LESS_K",
+    [REG_EQUAL_JUMP_IF_FALSE] = "REG_EQUAL_JUMP_IF_FALSE",
+    [REG_NOT_EQUAL_JUMP_IF_FALSE] = "REG_NOT_EQUAL_JUMP_IF_FALSE",
+    [REG_GREATER_JUMP_IF_FALSE] = "REG_GREATER_JUMP_IF_FALSE",
+    [REG_LESS_JUMP_IF_FALSE] = "REG_LESS_JUMP_IF_FALSE",
+    [REG_EQUAL_K_JUMP_IF_FALSE] = "REG_EQUAL_K_JUMP_IF_FALSE",
+    [REG_NOT_EQUAL_K_JUMP_IF_FALSE] = "REG_NOT_EQUAL_K_JUMP_IF_FALSE",
+    [REG_GREATER_K_JUMP_IF_FALSE] = "REG_GREATER_K_JUMP_IF_FALSE",
+    [REG_LESS_K_JUMP_IF_FALSE] = "REG_LESS_K_JUMP_IF_FALSE",
+    [REG_NOT] = "REG_NOT",
+    [REG_NEGATE] = "REG_NEGATE",
+    [REG_PRINT] = "REG_PRINT",
+    [REG_JUMP] = "REG_JUMP",
+    [REG_LOOP] = "REG_LOOP",
+    [REG_JUMP_IF_FALSE] = "REG_JUMP_IF_FALSE",
+    [REG_CALL] = "REG_CALL",
+    [REG_CLOSURE] = "REG_CLOSURE",
+    [REG_CLOSE_UPVALUE] = "REG_CLOSE_UPVALUE",
+    [REG_RETURN] = "REG_RETURN",
+};
+
+void disassemble_register_chunk(Chunk* chunk, const char* name)
+{
+    printf("=== %s (registers) === \n", name);
+
+    for (int offset = 0; offset < chunk->count;)
+        offset = disassemble_register_instruction(chunk, offset);
+}
+
+// Register instructions print their operands as they are laid out, with
+// the constant or global they name and the target of jumps.
+int disassemble_register_instruction(Chunk* chunk, int offset)
+{
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+        printf("   | ");
+    else
+        printf("%4d ", chunk->lines[offset]);
+
+    u8  instruction = chunk->code[offset];
+    u8* operands = &chunk->code[offset + 1];
+    int length = register_instruction_length(chunk, offset);
+    int wide = (operands[1] << 8) | operands[2];
+    printf("%-29s", register_names[instruction]);
+
+    if (instruction == REG_JUMP || instruction == REG_LOOP)
+    {
+        int jump = (operands[0] << 8) | operands[1];
+        printf(" -> %d\n", offset + 3 + (instruction == REG_LOOP ? -jump : jump));
+        return offset + length;
+    }
+    if (instruction == REG_JUMP_IF_FALSE)
+    {
+        printf(" r%d -> %d\n", operands[0], offset + 4 + wide);
+        return offset + length;
+    }
+    if (instruction >= REG_EQUAL_JUMP_IF_FALSE &&
+        instruction <= REG_LESS_K_JUMP_IF_FALSE)
+    {
+        int jump = (operands[2] << 8) | operands[3];
+        printf(" r%d %s%d -> %d\n", operands[0],
+               instruction >= REG_EQUAL_K_JUMP_IF_FALSE ? "k" : "r",
+               operands[1], offset + 5 + jump);
+        return offset + length;
+    }
+
+    printf(" r%d", operands[0]);
+    switch (instruction)
+    {
+    case REG_LOADK:
+    case REG_CLOSURE:
+        printf(" k%d ", wide);
+        print_value(chunk->constants.values[wide]);
+        break;
+    case REG_GET_GLOBAL:
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL:
+        printf(" g%d %s", wide, vm.global_names[wide].name->chars);
+        break;
+    case REG_GET_UPVALUE:
+    case REG_SET_UPVALUE:
+        printf(" u%d", operands[1]);
+        break;
+    case REG_CALL:
+        printf(" %d", operands[1]);
+        break;
+    case REG_MOVE:
+    case REG_NOT:
+    case REG_NEGATE:
+        printf(" r%d", operands[1]);
+        break;
+    default:
+        if (instruction >= REG_ADD && instruction <= REG_LESS)
+            printf(" r%d r%d", operands[1], operands[2]);
+        else if (instruction >= REG_ADD_K && instruction <= REG_LESS_K)
+        {
+            printf(" r%d k%d ", operands[1], operands[2]);
+            print_value(chunk->constants.values[operands[2]]);
+        }
+        break;
+    }
+    printf("\n");
+
+    if (instruction == REG_CLOSURE)
+    {
+        for (int at = offset + 4; at < offset + length; at += 2)
+            printf("%04d     |              %s %d\n", at,
+                   chunk->code[at] ? "local" : "upvalue", chunk->code[at + 1]);
+    }
+    return offset + length;
+}
+
 static int simple_instruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -130,7 +368,7 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk,
                             int offset)
 {
     u16 jump = (u16)(chunk->code[offset + 1] << 8);  // n << 8 -> n * 2^8
-    jump |= chunk->code[offset];
+    jump |= chunk->code[offset + 2];
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
@@ -144,6 +382,76 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int local_constant_instruction(const char* name, Chunk* chunk,
+                                      int offset)
+{
+    u8 slot = chunk->code[offset + 1];
+    u8 constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d ", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("\n");
+    return offset + 3;
+}
+
+static int global_instruction(const char* name, Chunk* chunk, int offset)
+{
+    u16 slot = (u16)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s  %4d %s\n", name, slot, vm.global_names[slot].name->chars);
+    return offset + 3;
+}
+
+static int read_long(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+           chunk->code[offset + 2];
+}
+
+static int long_instruction(const char* name, Chunk* chunk, int offset)
+{
+    printf("%-16s %4d\n", name, read_long(chunk, offset + 1));
+    return offset + 4;
+}
+
+static int long_constant_instruction(const char* name, Chunk* chunk,
+                                     int offset)
+{
+    int constant = read_long(chunk, offset + 1);
+    printf("%-16s  %4d ", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("\n");
+    return offset + 4;
+}
+
+static int long_global_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int slot = read_long(chunk, offset + 1);
+    printf("%-16s  %4d %s\n", name, slot, vm.global_names[slot].name->chars);
+    return offset + 4;
+}
+
+static int closure_instruction(const char* name, bool is_long, Chunk* chunk,
+                               int offset)
+{
+    int constant =
+        is_long ? read_long(chunk, offset + 1) : chunk->code[offset + 1];
+    offset += is_long ? 4 : 2;
+    printf("%-16s %4d ", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalue_count; j++)
+    {
+        int start = offset;
+        int islocal = chunk->code[offset++];
+        int index = is_long ? read_long(chunk, offset) : chunk->code[offset];
+        offset += is_long ? 3 : 1;
+        printf("%04d     |              %s %d\n", start,
+               islocal ? "local" : "upvalue", index);
+    }
+    return offset;
+}
+
 static const char* token_type_to_string(TokenType type)
 {
     switch (type)
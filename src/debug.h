@@ -4,8 +4,11 @@
 #include "chunk.h"
 #include "scanner.h"
 
-void disassemble_chunk(Chunk* chunk, const char* name);
-int  disassemble_instruction(Chunk* chunk, int offset);
-void print_token(Token token);
+const char* opcode_name(u8 opcode);
+void        disassemble_chunk(Chunk* chunk, const char* name);
+int         disassemble_instruction(Chunk* chunk, int offset);
+void        disassemble_register_chunk(Chunk* chunk, const char* name);
+int         disassemble_register_instruction(Chunk* chunk, int offset);
+void        print_token(Token token);
 
 #endif
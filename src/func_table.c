@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "func_table.h"
+#include "memory.h"
+
+static FuncEntry* allocate_entries(int capacity)
+{
+    FuncEntry* entries =
+        (FuncEntry*)checked_malloc(sizeof(FuncEntry) * capacity);
+    memset(entries, 0, sizeof(FuncEntry) * capacity);
+    return entries;
+}
+
+void init_func_table(FuncTable* table, int capacity, bool fixed)
+{
+    table->entries = fixed ? allocate_entries(capacity) : NULL;
+    table->count = 0;
+    table->capacity = fixed ? capacity : 0;
+    table->fixed = fixed;
+}
+
+void free_func_table(FuncTable* table)
+{
+    free(table->entries);
+    init_func_table(table, 0, false);
+}
+
+static u32 entry_index(const void* key, int line, int capacity)
+{
+    u32 hash = (u32)((uintptr_t)key >> 3) * 2654435761u ^ (u32)line;
+    return hash & (capacity - 1);
+}
+
+static void grow_entries(FuncTable* table)
+{
+    int        capacity = table->capacity < 64 ? 64 : table->capacity * 2;
+    FuncEntry* entries = allocate_entries(capacity);
+
+    for (int i = 0; i < table->capacity; i++)
+    {
+        FuncEntry* entry = &table->entries[i];
+        if (entry->name[0] == '\0')
+            continue;
+        u32 index = entry_index(entry->key, entry->line, capacity);
+        while (entries[index].name[0] != '\0')
+            index = (index + 1) & (capacity - 1);
+        entries[index] = *entry;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+FuncEntry* func_table_find(FuncTable* table, const void* key,
+                           const char* name, int length, int line)
+{
+    if (length >= FUNC_NAME_MAX)
+        length = FUNC_NAME_MAX - 1;
+    if (table->capacity == 0)
+        grow_entries(table);
+
+    u32 index = entry_index(key, line, table->capacity);
+    for (;;)
+    {
+        FuncEntry* entry = &table->entries[index];
+        if (entry->name[0] == '\0')
+            break;
+        if (entry->key == key && entry->line == line &&
+            strncmp(entry->name, name, length) == 0 &&
+            entry->name[length] == '\0')
+            return entry;
+        index = (index + 1) & (table->capacity - 1);
+    }
+
+    // a free slot is always left, so the probing above ends
+    if (table->count + 1 > table->capacity * 3 / 4)
+    {
+        if (table->fixed)
+            return NULL;
+        grow_entries(table);
+        index = entry_index(key, line, table->capacity);
+        while (table->entries[index].name[0] != '\0')
+            index = (index + 1) & (table->capacity - 1);
+    }
+    FuncEntry* entry = &table->entries[index];
+    entry->key = key;
+    entry->line = line;
+    memcpy(entry->name, name, length);
+    entry->name[length] = '\0';
+    table->count++;
+    return entry;
+}
+
+int func_table_sort(FuncTable* table,
+                    int (*compare)(const void*, const void*))
+{
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].name[0] != '\0')
+            table->entries[count++] = table->entries[i];
+    }
+    qsort(table->entries, count, sizeof(FuncEntry), compare);
+    return count;
+}
@@ -0,0 +1,43 @@
+#ifndef clox_func_table_h
+#define clox_func_table_h
+
+#include "common.h"
+
+#define FUNC_NAME_MAX 64
+
+// Counts kept per function, or per line of one, for the reports --stats,
+// --heap-stats and --profile print. An entry is found by the address
+// standing for its function together with the name: a function freed in
+// the REPL may leave its address to a new one. Names are copied, longer
+// ones cut short, since the collector may move or free the strings.
+typedef struct
+{
+    const void* key;
+    int         line;
+    char        name[FUNC_NAME_MAX];  // empty for a free slot
+    u64         count;
+    u64         bytes;
+} FuncEntry;
+
+typedef struct
+{
+    FuncEntry* entries;
+    int        count;
+    int        capacity;  // a power of two
+    bool       fixed;     // never grows, for use in a signal handler
+} FuncTable;
+
+// A fixed table is allocated here with all its capacity, a growing one the
+// first time an entry is added.
+void       init_func_table(FuncTable* table, int capacity, bool fixed);
+void       free_func_table(FuncTable* table);
+// Finds the entry, adding it the first time; NULL once a fixed table is
+// full.
+FuncEntry* func_table_find(FuncTable* table, const void* key,
+                           const char* name, int length, int line);
+// Moves the entries to the front in the order of compare and returns how
+// many there are. Sorted in place, so nothing can be added after this.
+int        func_table_sort(FuncTable* table,
+                           int (*compare)(const void*, const void*));
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "func_table.h"
+#include "heap_stats.h"
+#include "memory.h"
+#include "vm.h"
+
+// Sites printed at exit, the ones that allocated the most bytes.
+#define HEAP_TOP_SITES 20
+
+typedef struct
+{
+    u64 count;
+    u64 bytes;
+} HeapCounter;
+
+static const char* const kind_names[HEAP_KINDS] = {
+    [OBJ_CLOSURE] = "closure", [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",   [OBJ_STRING] = "string",
+    [OBJ_UPVALUE] = "upvalue", [HEAP_ARRAYS] = "arrays",
+};
+
+static struct
+{
+    HeapCounter total;
+    HeapCounter kinds[HEAP_KINDS];
+    HeapCounter sizes[HEAP_SIZE_BUCKETS];
+    bool        record_sites;
+    FuncTable   sites;  // keyed by function and line, NULL with no frame
+} heap;
+
+void heap_stats_start()
+{
+    heap.record_sites = true;
+    atexit(print_heap_stats);
+}
+
+// The site of whatever the top frame is running.
+static FuncEntry* current_site()
+{
+    if (vm.frame_count == 0)
+        return func_table_find(&heap.sites, NULL, "[vm]", 4, 0);
+
+    CallFrame*   frame = &vm.frames[vm.frame_count - 1];
+    ObjFunction* function = frame->closure->function;
+    int          line = frame_line(frame);
+    if (function->name == NULL)
+        return func_table_find(&heap.sites, function, "script", 6, line);
+    return func_table_find(&heap.sites, function, function->name->chars,
+                           function->name->length, line);
+}
+
+static void tally(HeapCounter* counter, size_t size)
+{
+    counter->count++;
+    counter->bytes += size;
+}
+
+void heap_stats_record(int kind, size_t size)
+{
+    int bucket = 0;
+    while (bucket < HEAP_SIZE_BUCKETS - 1 && size > (16u << bucket))
+    {
+        bucket++;
+    }
+
+    tally(&heap.total, size);
+    tally(&heap.kinds[kind], size);
+    tally(&heap.sizes[bucket], size);
+    if (heap.record_sites)
+    {
+        FuncEntry* site = current_site();
+        site->count++;
+        site->bytes += size;
+    }
+}
+
+static size_t live_bytes()
+{
+    return vm.bytes_allocated + (size_t)(vm.nursery_top - vm.nursery);
+}
+
+Value heap_stats_native(int arg_count, Value* args)
+{
+    if (arg_count == 0)
+        return NUMBER_VAL((double)heap.total.bytes);
+    if (!IS_STRING(args[0]))
+        return NIL_VAL;
+
+    const char* kind = AS_CSTRING(args[0]);
+    if (strcmp(kind, "live") == 0)
+        return NUMBER_VAL((double)live_bytes());
+    for (int i = 0; i < HEAP_KINDS; i++)
+    {
+        if (strcmp(kind, kind_names[i]) == 0)
+            return NUMBER_VAL((double)heap.kinds[i].bytes);
+    }
+    return NIL_VAL;
+}
+
+static int compare_sites(const void* a, const void* b)
+{
+    u64 first = ((const FuncEntry*)a)->bytes;
+    u64 second = ((const FuncEntry*)b)->bytes;
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static void print_counter(const char* name, HeapCounter* counter)
+{
+    fprintf(stderr, "  %-32s %12llu %14llu %6.2f%%\n", name,
+            (unsigned long long)counter->count,
+            (unsigned long long)counter->bytes,
+            heap.total.bytes == 0 ? 0.0
+                                  : 100.0 * counter->bytes / heap.total.bytes);
+}
+
+void print_heap_stats()
+{
+    if (!heap.record_sites)
+        return;
+    fprintf(stderr, "heap: %llu bytes in %llu allocations, %zu live\n",
+            (unsigned long long)heap.total.bytes,
+            (unsigned long long)heap.total.count, live_bytes());
+
+    fprintf(stderr, "by kind: %37s %14s\n", "allocations", "bytes");
+    for (int i = 0; i < HEAP_KINDS; i++)
+    {
+        if (heap.kinds[i].count > 0)
+            print_counter(kind_names[i], &heap.kinds[i]);
+    }
+
+    fprintf(stderr, "by size:\n");
+    for (int i = 0; i < HEAP_SIZE_BUCKETS; i++)
+    {
+        if (heap.sizes[i].count == 0)
+            continue;
+        char label[32];
+        if (i == HEAP_SIZE_BUCKETS - 1)
+            snprintf(label, sizeof(label), "> %u", 16u << (i - 1));
+        else
+            snprintf(label, sizeof(label), "<= %u", 16u << i);
+        print_counter(label, &heap.sizes[i]);
+    }
+
+    int count = func_table_sort(&heap.sites, compare_sites);
+    fprintf(stderr, "by site:\n");
+    for (int i = 0; i < count && i < HEAP_TOP_SITES; i++)
+    {
+        FuncEntry* site = &heap.sites.entries[i];
+        char       label[FUNC_NAME_MAX + 16];
+        if (site->line == 0)
+            snprintf(label, sizeof(label), "%s", site->name);
+        else
+            snprintf(label, sizeof(label), "%s:%d", site->name, site->line);
+        print_counter(label, &(HeapCounter){site->count, site->bytes});
+    }
+    if (count > HEAP_TOP_SITES)
+        fprintf(stderr, "  ... %d more\n", count - HEAP_TOP_SITES);
+    free_func_table(&heap.sites);
+    heap.record_sites = false;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_heap_stats_h
+#define clox_heap_stats_h
+
+#include "object.h"
+#include "value.h"
+
+// Memory that is not an object of its own: chunks, tables, the gray stack,
+// everything else that grows through reallocate(). Counted next to the
+// ObjTypes.
+#define HEAP_ARRAYS (OBJ_UPVALUE + 1)
+#define HEAP_KINDS (HEAP_ARRAYS + 1)
+// Powers of two from 16 bytes up, the last one taking everything larger.
+#define HEAP_SIZE_BUCKETS 12
+
+// Every allocation is counted by kind and size. With --heap-stats it is
+// also counted by site, the function and line run() is at, and a summary is
+// printed once the program is done. Growing an array counts its new bytes
+// only; frees are not counted, nursery objects die without one.
+void  heap_stats_start();
+void  heap_stats_record(int kind, size_t size);
+// Called once the program is done and again at exit, for runs that stopped
+// on an error; prints the first time, and only with --heap-stats.
+void  print_heap_stats();
+// heapStats() gives the bytes allocated so far, heapStats("string") and
+// the like those of one kind, and heapStats("live") the heap in use now.
+Value heap_stats_native(int arg_count, Value* args);
+
+#endif
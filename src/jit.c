@@ -0,0 +1,1258 @@
+// MAP_ANONYMOUS is not POSIX
+#define _DEFAULT_SOURCE
+
+#include "common.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "trace.h"
+
+// A baseline compiler: every instruction of the chunk becomes a fixed
+// template of x86-64 code working on the VM's own stack, so the machine
+// code and the interpreter can hand a frame back and forth at any
+// instruction. Templates inline the number cases of arithmetic and
+// comparisons and call the slow paths in vm.c for everything else. Calls
+// to other compiled functions nest on the C stack, at most FRAMES_MAX
+// deep; a call to an interpreted one unwinds them all back to run(), which
+// re-enters the machine code as the interpreted callee returns.
+//
+// While the code runs, rbx holds frame->slots, r12 the stack top, r13 the
+// frame and r14 &vm. The stack top is written back to vm.stack_top before
+// any call into C, so the collector sees the whole stack.
+
+enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+enum
+{
+    CC_BELOW_OR_EQUAL = 0x6,
+    CC_EQUAL = 0x4,
+    CC_NOT_EQUAL = 0x5,
+    CC_ALWAYS = -1,
+};
+
+typedef int (*JitEntry)(CallFrame* frame, u8* target);
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int)offsetof(Value, as))
+#endif
+
+typedef struct
+{
+    int at;      // offset of a rel32 to fill in
+    int target;  // bytecode offset it jumps to
+} Patch;
+
+typedef struct
+{
+    ObjFunction* function;
+    u8*          code;
+    int          count;
+    int          capacity;
+    int*         entries;
+    Patch*       patches;
+    int          patch_count;
+    int          patch_capacity;
+    int*         errors;  // rel32s jumping to the error exit
+    int          error_count;
+    int          error_capacity;
+    int          error_exit;
+    int          epilogue;
+} Assembler;
+
+// ---------------------- encoding --------------------------
+
+static void emit_byte(Assembler* as, u8 byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        int old_capacity = as->capacity;
+        as->capacity = GROW_CAPACITY(old_capacity);
+        as->code = (u8*)realloc(as->code, as->capacity);
+        if (as->code == NULL)
+            exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit_u32(Assembler* as, u32 value)
+{
+    for (int i = 0; i < 4; i++)
+        emit_byte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit_u64(Assembler* as, u64 value)
+{
+    emit_u32(as, (u32)value);
+    emit_u32(as, (u32)(value >> 32));
+}
+
+static void emit_rex(Assembler* as, bool wide, int reg, int base)
+{
+    u8 rex = 0x40 | (wide << 3) | ((reg >= 8) << 2) | (base >= 8);
+    if (rex != 0x40)
+        emit_byte(as, rex);
+}
+
+// ModRM for [base + disp32], always in the disp32 form so r13 needs no
+// special case; rsp and r12 as base need a SIB byte.
+static void emit_memory(Assembler* as, int reg, int base, int disp)
+{
+    emit_byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit_byte(as, 0x24);
+    emit_u32(as, (u32)disp);
+}
+
+static void emit_registers(Assembler* as, u8 op, int reg, int rm)
+{
+    emit_rex(as, true, reg, rm);
+    emit_byte(as, op);
+    emit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, [base + disp]
+static void load(Assembler* as, int reg, int base, int disp)
+{
+    emit_rex(as, true, reg, base);
+    emit_byte(as, 0x8b);
+    emit_memory(as, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void store(Assembler* as, int base, int disp, int reg)
+{
+    emit_rex(as, true, reg, base);
+    emit_byte(as, 0x89);
+    emit_memory(as, reg, base, disp);
+}
+
+// lea reg, [base + disp], which unlike add leaves the flags alone
+static void load_address(Assembler* as, int reg, int base, int disp)
+{
+    emit_rex(as, true, reg, base);
+    emit_byte(as, 0x8d);
+    emit_memory(as, reg, base, disp);
+}
+
+static void add_immediate(Assembler* as, int reg, int value)
+{
+    emit_rex(as, true, 0, reg);
+    emit_byte(as, 0x81);
+    emit_byte(as, 0xc0 | (reg & 7));
+    emit_u32(as, (u32)value);
+}
+
+static void load_immediate(Assembler* as, int reg, u64 value)
+{
+    emit_rex(as, true, 0, reg);
+    emit_byte(as, 0xb8 + (reg & 7));
+    emit_u64(as, value);
+}
+
+static void load_immediate32(Assembler* as, int reg, u32 value)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0xb8 + (reg & 7));
+    emit_u32(as, value);
+}
+
+// SSE2 scalar double ops, xmm with [base + disp]
+static void emit_sse(Assembler* as, u8 prefix, u8 op, int xmm, int base,
+                     int disp)
+{
+    if (prefix != 0)
+        emit_byte(as, prefix);
+    emit_rex(as, false, xmm, base);
+    emit_byte(as, 0x0f);
+    emit_byte(as, op);
+    emit_memory(as, xmm, base, disp);
+}
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+
+static void compare_memory8(Assembler* as, int base, int disp, u8 value)
+{
+    emit_rex(as, false, 0, base);
+    emit_byte(as, 0x80);
+    emit_memory(as, 7, base, disp);
+    emit_byte(as, value);
+}
+
+#ifndef NAN_BOXING
+// For the type word of a tagged Value; NaN-boxed ones have none.
+// cmp dword [base + disp], value
+static void compare_memory32(Assembler* as, int base, int disp, u32 value)
+{
+    emit_rex(as, false, 0, base);
+    emit_byte(as, 0x81);
+    emit_memory(as, 7, base, disp);
+    emit_u32(as, value);
+}
+
+static void store_immediate32(Assembler* as, int base, int disp, u32 value)
+{
+    emit_rex(as, false, 0, base);
+    emit_byte(as, 0xc7);
+    emit_memory(as, 0, base, disp);
+    emit_u32(as, value);
+}
+#endif
+
+static void push_register(Assembler* as, int reg)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0x50 + (reg & 7));
+}
+
+static void pop_register(Assembler* as, int reg)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0x58 + (reg & 7));
+}
+
+// Emits a jump with an empty rel32 and returns where the rel32 is.
+static int jump_forward(Assembler* as, int condition)
+{
+    if (condition == CC_ALWAYS)
+        emit_byte(as, 0xe9);
+    else
+    {
+        emit_byte(as, 0x0f);
+        emit_byte(as, 0x80 | condition);
+    }
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+static void patch_rel32(Assembler* as, int at, int destination)
+{
+    u32 rel = (u32)(destination - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+// Points a jump_forward() at the code emitted next.
+static void land(Assembler* as, int at)
+{
+    if (at >= 0)
+        patch_rel32(as, at, as->count);
+}
+
+static void jump_to(Assembler* as, int condition, int target)
+{
+    int at = jump_forward(as, condition);
+    if (as->patch_capacity < as->patch_count + 1)
+    {
+        int old_capacity = as->patch_capacity;
+        as->patch_capacity = GROW_CAPACITY(old_capacity);
+        as->patches = (Patch*)realloc(as->patches,
+                                      sizeof(Patch) * as->patch_capacity);
+        if (as->patches == NULL)
+            exit(1);
+    }
+    as->patches[as->patch_count++] = (Patch){.at = at, .target = target};
+}
+
+// ---------------------- value templates --------------------------
+
+static void copy_value(Assembler* as, int to, int to_disp, int from,
+                       int from_disp)
+{
+#ifdef NAN_BOXING
+    load(as, RCX, from, from_disp);
+    store(as, to, to_disp, RCX);
+#else
+    emit_sse(as, 0, 0x10, 0, from, from_disp);  // movups
+    emit_sse(as, 0, 0x11, 0, to, to_disp);
+#endif
+}
+
+static void move_stack(Assembler* as, int values)
+{
+    load_address(as, R12, R12, values * VALUE_SIZE);
+}
+
+static void store_literal(Assembler* as, int base, int disp, Value value)
+{
+#ifdef NAN_BOXING
+    load_immediate(as, RAX, value);
+    store(as, base, disp, RAX);
+#else
+    u64 payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+    store_immediate32(as, base, disp, value.type);
+    load_immediate(as, RAX, payload);
+    store(as, base, disp + 8, RAX);
+#endif
+}
+
+static void push_literal(Assembler* as, Value value)
+{
+    store_literal(as, R12, 0, value);
+    move_stack(as, 1);
+}
+
+// Jumps to the returned rel32 unless the value at [base + disp] is a
+// number.
+static int guard_number(Assembler* as, int base, int disp)
+{
+#ifdef NAN_BOXING
+    load(as, RAX, base, disp);
+    load_immediate(as, RCX, QNAN);
+    emit_registers(as, 0x21, RCX, RAX);  // and rax, rcx
+    emit_registers(as, 0x39, RCX, RAX);  // cmp rax, rcx
+    return jump_forward(as, CC_EQUAL);
+#else
+    compare_memory32(as, base, disp, VAL_NUMBER);
+    return jump_forward(as, CC_NOT_EQUAL);
+#endif
+}
+
+// Jumps to the returned rel32 if the value at [base + disp] is undefined.
+static int guard_undefined(Assembler* as, int base, int disp)
+{
+#ifdef NAN_BOXING
+    load(as, RCX, base, disp);
+    load_immediate(as, RDX, UNDEFINED_VAL);
+    emit_registers(as, 0x39, RDX, RCX);
+    return jump_forward(as, CC_EQUAL);
+#else
+    compare_memory32(as, base, disp, VAL_UNDEFINED);
+    return jump_forward(as, CC_EQUAL);
+#endif
+}
+
+// Stores BOOL_VAL(al) at [r12 + disp].
+static void store_bool(Assembler* as, int disp)
+{
+    emit_byte(as, 0x0f);  // movzx eax, al
+    emit_byte(as, 0xb6);
+    emit_byte(as, 0xc0);
+#ifdef NAN_BOXING
+    load_immediate(as, RCX, FALSE_VAL);
+    emit_registers(as, 0x09, RAX, RCX);  // or rcx, rax
+    store(as, R12, disp, RCX);
+#else
+    store_immediate32(as, R12, disp, VAL_BOOL);
+    store(as, R12, disp + 8, RAX);
+#endif
+}
+
+static void jump_if_falsey(Assembler* as, int disp, int target)
+{
+#ifdef NAN_BOXING
+    load(as, RAX, R12, disp);
+    load_immediate(as, RCX, NIL_VAL);
+    emit_registers(as, 0x39, RCX, RAX);
+    jump_to(as, CC_EQUAL, target);
+    load_immediate(as, RCX, FALSE_VAL);
+    emit_registers(as, 0x39, RCX, RAX);
+    jump_to(as, CC_EQUAL, target);
+#else
+    compare_memory32(as, R12, disp, VAL_NIL);
+    jump_to(as, CC_EQUAL, target);
+    compare_memory32(as, R12, disp, VAL_BOOL);
+    int not_bool = jump_forward(as, CC_NOT_EQUAL);
+    compare_memory8(as, R12, disp + 8, 0);
+    jump_to(as, CC_EQUAL, target);
+    land(as, not_bool);
+#endif
+}
+
+// ---------------------- calls into the VM --------------------------
+
+static void set_ip(Assembler* as, int offset)
+{
+    load_immediate(as, RAX, (u64)(uintptr_t)(as->function->chunk.code + offset));
+    store(as, R13, offsetof(CallFrame, ip), RAX);
+}
+
+static void call_helper(Assembler* as, void* helper)
+{
+    store(as, R14, offsetof(VM, stack_top), R12);
+    load_immediate(as, RAX, (u64)(uintptr_t)helper);
+    emit_byte(as, 0xff);  // call rax
+    emit_byte(as, 0xd0);
+    load(as, R12, R14, offsetof(VM, stack_top));
+}
+
+static void jump_on_error(Assembler* as)
+{
+    emit_byte(as, 0x84);  // test al, al
+    emit_byte(as, 0xc0);
+    int at = jump_forward(as, CC_EQUAL);
+    if (as->error_capacity < as->error_count + 1)
+    {
+        int old_capacity = as->error_capacity;
+        as->error_capacity = GROW_CAPACITY(old_capacity);
+        as->errors = (int*)realloc(as->errors,
+                                   sizeof(int) * as->error_capacity);
+        if (as->errors == NULL)
+            exit(1);
+    }
+    as->errors[as->error_count++] = at;
+}
+
+static void exit_to_interpreter(Assembler* as, int offset)
+{
+    set_ip(as, offset);
+    load_immediate32(as, RAX, JIT_EXIT);
+    patch_rel32(as, jump_forward(as, CC_ALWAYS), as->epilogue);
+}
+
+// ---------------------- instruction templates --------------------------
+
+static void arithmetic(Assembler* as, int offset, u8 instruction)
+{
+    int a = -2 * VALUE_SIZE;
+    int b = -VALUE_SIZE;
+    int not_a = guard_number(as, R12, a);
+    int not_b = guard_number(as, R12, b);
+
+    emit_sse(as, 0xf2, MOVSD_LOAD, 0, R12, a + NUMBER_OFFSET);
+    u8 op = instruction == OP_ADD         ? 0x58
+            : instruction == OP_SUBSTRACT ? 0x5c
+            : instruction == OP_MULTIPLY  ? 0x59
+                                          : 0x5e;
+    emit_sse(as, 0xf2, op, 0, R12, b + NUMBER_OFFSET);
+    emit_sse(as, 0xf2, MOVSD_STORE, 0, R12, a + NUMBER_OFFSET);
+    move_stack(as, -1);
+    int done = jump_forward(as, CC_ALWAYS);
+
+    land(as, not_a);
+    land(as, not_b);
+    set_ip(as, offset + 1);
+    load_immediate32(as, RDI, instruction);
+    call_helper(as, (void*)jit_arithmetic);
+    jump_on_error(as);
+    land(as, done);
+}
+
+// Sets the flags so that "above" means a < b for OP_LESS and a > b for
+// OP_GREATER; NaN operands compare unordered, which is never above.
+static void compare_numbers(Assembler* as, u8 instruction)
+{
+    int a = -2 * VALUE_SIZE + NUMBER_OFFSET;
+    int b = -VALUE_SIZE + NUMBER_OFFSET;
+    if (instruction == OP_LESS)
+    {
+        int swap = a;
+        a = b;
+        b = swap;
+    }
+    emit_sse(as, 0xf2, MOVSD_LOAD, 0, R12, a);
+    emit_sse(as, 0x66, 0x2e, 0, R12, b);  // ucomisd
+}
+
+static void comparison(Assembler* as, int offset, u8 instruction)
+{
+    int not_a = guard_number(as, R12, -2 * VALUE_SIZE);
+    int not_b = guard_number(as, R12, -VALUE_SIZE);
+
+    compare_numbers(as, instruction);
+    emit_byte(as, 0x0f);  // seta al
+    emit_byte(as, 0x97);
+    emit_byte(as, 0xc0);
+    store_bool(as, -2 * VALUE_SIZE);
+    move_stack(as, -1);
+    int done = jump_forward(as, CC_ALWAYS);
+
+    land(as, not_a);
+    land(as, not_b);
+    set_ip(as, offset + 1);
+    load_immediate32(as, RDI, instruction);
+    call_helper(as, (void*)jit_arithmetic);
+    jump_on_error(as);
+    land(as, done);
+}
+
+static void less_jump_if_false(Assembler* as, int offset, int target)
+{
+    int not_a = guard_number(as, R12, -2 * VALUE_SIZE);
+    int not_b = guard_number(as, R12, -VALUE_SIZE);
+
+    compare_numbers(as, OP_LESS);
+    move_stack(as, -2);
+    jump_to(as, CC_BELOW_OR_EQUAL, target);
+    int done = jump_forward(as, CC_ALWAYS);
+
+    land(as, not_a);
+    land(as, not_b);
+    set_ip(as, offset + 1);
+    load_immediate32(as, RDI, OP_LESS);
+    call_helper(as, (void*)jit_arithmetic);
+    jump_on_error(as);
+    move_stack(as, -1);
+    jump_if_falsey(as, 0, target);
+    land(as, done);
+}
+
+static void push_constant(Assembler* as, int index)
+{
+    Value* constant = &as->function->chunk.constants.values[index];
+    load_immediate(as, RDX, (u64)(uintptr_t)constant);
+    copy_value(as, R12, 0, RDX, 0);
+    move_stack(as, 1);
+}
+
+static void get_global(Assembler* as, int offset, int slot)
+{
+    load(as, RAX, R14, offsetof(VM, global_values));
+    int undefined = guard_undefined(as, RAX, slot * VALUE_SIZE);
+    copy_value(as, R12, 0, RAX, slot * VALUE_SIZE);
+    move_stack(as, 1);
+    int done = jump_forward(as, CC_ALWAYS);
+
+    land(as, undefined);
+    set_ip(as, offset + 1);
+    load_immediate32(as, RDI, slot);
+    call_helper(as, (void*)jit_undefined_global);
+    jump_on_error(as);
+    land(as, done);
+}
+
+static void set_global(Assembler* as, int offset, int slot, bool pop)
+{
+    load(as, RAX, R14, offsetof(VM, global_values));
+    int undefined = guard_undefined(as, RAX, slot * VALUE_SIZE);
+    copy_value(as, RAX, slot * VALUE_SIZE, R12, -VALUE_SIZE);
+    if (pop)
+        move_stack(as, -1);
+    int done = jump_forward(as, CC_ALWAYS);
+
+    land(as, undefined);
+    set_ip(as, offset + 1);
+    load_immediate32(as, RDI, slot);
+    call_helper(as, (void*)jit_undefined_global);
+    jump_on_error(as);
+    land(as, done);
+}
+
+static void define_global(Assembler* as, int slot)
+{
+    load(as, RAX, R14, offsetof(VM, global_values));
+    copy_value(as, RAX, slot * VALUE_SIZE, R12, -VALUE_SIZE);
+    move_stack(as, -1);
+}
+
+static int read_operand(Chunk* chunk, int offset, int width)
+{
+    int operand = 0;
+    for (int i = 1; i <= width; i++)
+        operand = (operand << 8) | chunk->code[offset + i];
+    return operand;
+}
+
+static int jump_target(Chunk* chunk, int offset)
+{
+    int jump = read_operand(chunk, offset, 2);
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump
+                                          : offset + 3 + jump;
+}
+
+static void compile_instruction(Assembler* as, int offset)
+{
+    Chunk* chunk = &as->function->chunk;
+    // the templates check operand types themselves
+    u8     instruction = generic_opcode(chunk->code[offset]);
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        push_constant(as, read_operand(chunk, offset, 1));
+        break;
+    case OP_CONSTANT_LONG:
+        push_constant(as, read_operand(chunk, offset, 3));
+        break;
+    case OP_NIL:
+        push_literal(as, NIL_VAL);
+        break;
+    case OP_TRUE:
+        push_literal(as, BOOL_VAL(true));
+        break;
+    case OP_FALSE:
+        push_literal(as, BOOL_VAL(false));
+        break;
+    case OP_POP:
+        move_stack(as, -1);
+        break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    {
+        int slot =
+            read_operand(chunk, offset, instruction == OP_GET_LOCAL ? 1 : 3);
+        copy_value(as, R12, 0, RBX, slot * VALUE_SIZE);
+        move_stack(as, 1);
+        break;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+    case OP_SET_LOCAL_POP:
+    {
+        int slot =
+            read_operand(chunk, offset, instruction == OP_SET_LOCAL_LONG ? 3 : 1);
+        copy_value(as, RBX, slot * VALUE_SIZE, R12, -VALUE_SIZE);
+        if (instruction == OP_SET_LOCAL_POP)
+            move_stack(as, -1);
+        break;
+    }
+    case OP_GET_GLOBAL:
+        get_global(as, offset, read_operand(chunk, offset, 2));
+        break;
+    case OP_GET_GLOBAL_LONG:
+        get_global(as, offset, read_operand(chunk, offset, 3));
+        break;
+    case OP_DEFINE_GLOBAL:
+        define_global(as, read_operand(chunk, offset, 2));
+        break;
+    case OP_DEFINE_GLOBAL_LONG:
+        define_global(as, read_operand(chunk, offset, 3));
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+        set_global(as, offset, read_operand(chunk, offset, 2),
+                   instruction == OP_SET_GLOBAL_POP);
+        break;
+    case OP_SET_GLOBAL_LONG:
+        set_global(as, offset, read_operand(chunk, offset, 3), false);
+        break;
+    case OP_GET_UPVALUE:
+        load(as, RAX, R13, offsetof(CallFrame, closure));
+        load(as, RAX, RAX,
+             offsetof(ObjClosure, upvalues) +
+                 sizeof(ObjUpvalue*) * chunk->code[offset + 1]);
+        load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+        copy_value(as, R12, 0, RAX, 0);
+        move_stack(as, 1);
+        break;
+    case OP_SET_UPVALUE:
+        emit_registers(as, 0x89, R13, RDI);  // mov rdi, r13
+        load_immediate32(as, RSI, chunk->code[offset + 1]);
+        call_helper(as, (void*)jit_set_upvalue);
+        break;
+    case OP_ADD:
+    case OP_SUBSTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        arithmetic(as, offset, instruction);
+        break;
+    case OP_LESS:
+    case OP_GREATER:
+        comparison(as, offset, instruction);
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        copy_value(as, R12, 0, RBX, chunk->code[offset + 1] * VALUE_SIZE);
+        move_stack(as, 1);
+        push_constant(as, chunk->code[offset + 2]);
+        if (instruction == OP_LESS_LOCAL_CONSTANT)
+            comparison(as, offset, OP_LESS);
+        else
+            arithmetic(as, offset,
+                       instruction == OP_ADD_LOCAL_CONSTANT ? OP_ADD
+                                                            : OP_SUBSTRACT);
+        break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        load_immediate32(as, RDI, instruction == OP_NOT_EQUAL);
+        call_helper(as, (void*)jit_equal);
+        break;
+    case OP_NOT:
+        call_helper(as, (void*)jit_not);
+        break;
+    case OP_NEGATE:
+        set_ip(as, offset + 1);
+        load_immediate32(as, RDI, OP_NEGATE);
+        call_helper(as, (void*)jit_arithmetic);
+        jump_on_error(as);
+        break;
+    case OP_PRINT:
+        call_helper(as, (void*)jit_print);
+        break;
+    case OP_JUMP:
+        jump_to(as, CC_ALWAYS, jump_target(chunk, offset));
+        break;
+    case OP_JUMP_IF_FALSE:
+        jump_if_falsey(as, -VALUE_SIZE, jump_target(chunk, offset));
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        move_stack(as, -1);
+        jump_if_falsey(as, 0, jump_target(chunk, offset));
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+        less_jump_if_false(as, offset, jump_target(chunk, offset));
+        break;
+    case OP_EQUAL_JUMP_IF_FALSE:
+        load_immediate32(as, RDI, false);
+        call_helper(as, (void*)jit_equal);
+        move_stack(as, -1);
+        jump_if_falsey(as, 0, jump_target(chunk, offset));
+        break;
+    case OP_LOOP:
+    {
+        // the same safepoint as run() takes on a backward jump
+#ifndef DEBUG_STRESS_GC
+        compare_memory8(as, R14, offsetof(VM, minor_gc_pending), 0);
+        int no_collection = jump_forward(as, CC_EQUAL);
+#endif
+        call_helper(as, (void*)collect_nursery);
+#ifndef DEBUG_STRESS_GC
+        land(as, no_collection);
+#endif
+        // and the hot counter of run()'s back-edges, see trace.c
+        int  target = jump_target(chunk, offset);
+        u16* count = &trace_hot_counts[HOTCOUNT_INDEX(chunk->code + target)];
+        load_immediate(as, RDI, (u64)(uintptr_t)count);
+        emit_byte(as, 0x66);  // dec word [rdi]
+        emit_byte(as, 0xff);
+        emit_byte(as, 0x0f);
+        jump_to(as, CC_NOT_EQUAL, target);
+        set_ip(as, target);
+        call_helper(as, (void*)jit_hot_loop);
+        emit_registers(as, 0x85, RAX, RAX);  // test rax, rax
+        int record = jump_forward(as, CC_EQUAL);
+        emit_byte(as, 0xff);  // jmp rax
+        emit_byte(as, 0xe0);
+        land(as, record);
+        load_immediate32(as, RAX, JIT_EXIT);
+        patch_rel32(as, jump_forward(as, CC_ALWAYS), as->epilogue);
+        break;
+    }
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+        emit_registers(as, 0x89, R13, RDI);
+        load_immediate(as, RSI, (u64)(uintptr_t)(chunk->code + offset));
+        call_helper(as, (void*)jit_closure);
+        break;
+    case OP_CLOSE_UPVALUE:
+        call_helper(as, (void*)jit_close_upvalue);
+        break;
+    case OP_CALL:
+        // ip as run() leaves it, in case the callee is interpreted
+        set_ip(as, offset + 2);
+        load_immediate32(as, RDI, chunk->code[offset + 1]);
+        call_helper(as, (void*)jit_call);
+        emit_byte(as, 0x83);  // cmp eax, JIT_RETURN
+        emit_byte(as, 0xf8);
+        emit_byte(as, JIT_RETURN);
+        patch_rel32(as, jump_forward(as, CC_NOT_EQUAL), as->epilogue);
+        break;
+    case OP_RETURN:
+    {
+        set_ip(as, offset);
+        call_helper(as, (void*)jit_return);
+        emit_byte(as, 0x84);  // test al, al
+        emit_byte(as, 0xc0);
+        int last_frame = jump_forward(as, CC_EQUAL);
+        load_immediate32(as, RAX, JIT_RETURN);
+        patch_rel32(as, jump_forward(as, CC_ALWAYS), as->epilogue);
+        land(as, last_frame);
+        exit_to_interpreter(as, offset);
+        break;
+    }
+    default:
+        exit_to_interpreter(as, offset);
+        break;
+    }
+}
+
+// The entry takes the frame in rdi and the native address to start at in
+// rsi, and returns JIT_EXIT or JIT_ERROR in eax. The error exit and the
+// epilogue follow it, ahead of the templates that jump back to them.
+static void compile_prologue(Assembler* as)
+{
+    push_register(as, RBX);
+    push_register(as, R12);
+    push_register(as, R13);
+    push_register(as, R14);
+    add_immediate(as, RSP, -8);  // keep rsp 16-byte aligned for the helpers
+    emit_registers(as, 0x89, RDI, R13);  // mov r13, rdi
+    load(as, RBX, R13, offsetof(CallFrame, slots));
+    load_immediate(as, R14, (u64)(uintptr_t)&vm);
+    load(as, R12, R14, offsetof(VM, stack_top));
+    emit_byte(as, 0xff);  // jmp rsi
+    emit_byte(as, 0xe6);
+
+    as->error_exit = as->count;
+    load_immediate32(as, RAX, JIT_ERROR);
+    as->epilogue = as->count;
+    store(as, R14, offsetof(VM, stack_top), R12);
+    add_immediate(as, RSP, 8);
+    pop_register(as, R14);
+    pop_register(as, R13);
+    pop_register(as, R12);
+    pop_register(as, RBX);
+    emit_byte(as, 0xc3);  // ret
+}
+
+// Copies the assembled code into pages of its own, written while writable
+// and then flipped to executable, and frees the buffer. Returns NULL if the
+// pages cannot be had.
+static u8* map_code(Assembler* as, size_t* size)
+{
+    size_t page = 4096;
+    *size = ((size_t)as->count + page - 1) / page * page;
+    u8* code = (u8*)mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        free(as->code);
+        return NULL;
+    }
+    memcpy(code, as->code, as->count);
+    free(as->code);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, *size);
+        return NULL;
+    }
+    return code;
+}
+
+void jit_compile(ObjFunction* function)
+{
+    Chunk*    chunk = &function->chunk;
+    Assembler as = {.function = function};
+    as.entries = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    if (as.entries == NULL)
+        exit(1);
+
+    compile_prologue(&as);
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+    {
+        as.entries[offset] = as.count;
+        compile_instruction(&as, offset);
+    }
+
+    for (int i = 0; i < as.patch_count; i++)
+        patch_rel32(&as, as.patches[i].at, as.entries[as.patches[i].target]);
+    for (int i = 0; i < as.error_count; i++)
+        patch_rel32(&as, as.errors[i], as.error_exit);
+    free(as.patches);
+    free(as.errors);
+
+    size_t size;
+    u8*    code = map_code(&as, &size);
+    if (code == NULL)
+    {
+        // no machine code, the function stays interpreted
+        free(as.entries);
+        return;
+    }
+
+    JitCode* jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL)
+        exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = as.entries;
+    function->jit = jit;
+}
+
+void jit_free(ObjFunction* function)
+{
+    JitCode* jit = function->jit;
+    if (jit == NULL)
+        return;
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+    function->jit = NULL;
+}
+
+int jit_run(CallFrame* frame)
+{
+    ObjFunction* function = frame->closure->function;
+    JitCode*     jit = function->jit;
+    int          offset = (int)(frame->ip - function->chunk.code);
+    JitEntry     entry = (JitEntry)(void*)jit->code;
+    return entry(frame, jit->code + jit->entries[offset]);
+}
+
+// ---------------------- traces --------------------------
+
+// A trace, see trace.c, is compiled as a loop over its IR. Homes live in
+// xmm2 to xmm15 as long as those last and in the spill area after the IR
+// values, which each have an 8-byte slot at [rsp + 8 * ref]: numbers as
+// doubles, booleans as a byte. xmm0 and xmm1 are scratch. rbx holds
+// frame->slots, r13 the frame, r14 &vm and r15 vm.global_values.
+
+#define FIRST_HOME_XMM 2
+#define HOME_XMMS 14
+
+typedef struct
+{
+    int xmm;   // or -1 for a spill slot
+    int disp;  // from rsp
+} Location;
+
+typedef struct
+{
+    int at;
+    int snapshot;
+} ExitJump;
+
+// xmm op xmm
+static void emit_sse_registers(Assembler* as, u8 prefix, u8 op, int xmm,
+                               int rm)
+{
+    if (prefix != 0)
+        emit_byte(as, prefix);
+    emit_rex(as, false, xmm, rm);
+    emit_byte(as, 0x0f);
+    emit_byte(as, op);
+    emit_byte(as, 0xc0 | ((xmm & 7) << 3) | (rm & 7));
+}
+
+// setcc on the low byte of a register below rsp
+static void set_condition(Assembler* as, u8 condition, int reg)
+{
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x90 | condition);
+    emit_byte(as, 0xc0 | reg);
+}
+
+#define CC_PARITY 0xa
+#define CC_NOT_PARITY 0xb
+#define CC_ABOVE 0x7
+
+static Location home_location(TraceIr* ir, int home)
+{
+    if (home < HOME_XMMS)
+        return (Location){.xmm = FIRST_HOME_XMM + home};
+    return (Location){.xmm = -1, .disp = 8 * (ir->ir_count + home)};
+}
+
+static Location value_location(TraceIr* ir, int ref)
+{
+    IrIns* ins = &ir->ir[ref];
+    if (ins->op == IR_HOME && ins->in_place)
+        return home_location(ir, ins->a);
+    return (Location){.xmm = -1, .disp = 8 * ref};
+}
+
+static void load_number(Assembler* as, TraceIr* ir, int xmm, int ref)
+{
+    if (ir->ir[ref].op == IR_NUMBER)
+    {
+        u64 bits;
+        memcpy(&bits, &ir->ir[ref].number, sizeof(bits));
+        load_immediate(as, RAX, bits);
+        emit_byte(as, 0x66);  // movq xmm, rax
+        emit_rex(as, true, xmm, RAX);
+        emit_byte(as, 0x0f);
+        emit_byte(as, 0x6e);
+        emit_byte(as, 0xc0 | ((xmm & 7) << 3));
+        return;
+    }
+    Location from = value_location(ir, ref);
+    if (from.xmm < 0)
+        emit_sse(as, 0xf2, MOVSD_LOAD, xmm, RSP, from.disp);
+    else if (from.xmm != xmm)
+        emit_sse_registers(as, 0xf2, MOVSD_LOAD, xmm, from.xmm);
+}
+
+// xmm0 op the number ref stands for; ucomisd is 66 0f 2e
+static void number_operation(Assembler* as, TraceIr* ir, u8 prefix, u8 op,
+                             int ref)
+{
+    Location from = value_location(ir, ref);
+    if (ir->ir[ref].op == IR_NUMBER)
+    {
+        load_number(as, ir, 1, ref);
+        emit_sse_registers(as, prefix, op, 0, 1);
+    }
+    else if (from.xmm < 0)
+        emit_sse(as, prefix, op, 0, RSP, from.disp);
+    else
+        emit_sse_registers(as, prefix, op, 0, from.xmm);
+}
+
+static void store_number(Assembler* as, int disp)
+{
+    emit_sse(as, 0xf2, MOVSD_STORE, 0, RSP, disp);
+}
+
+// mov [rsp + disp], al
+static void store_byte(Assembler* as, int disp)
+{
+    emit_byte(as, 0x88);
+    emit_memory(as, RAX, RSP, disp);
+}
+
+// movzx eax, byte [rsp + disp]
+static void load_byte(Assembler* as, int disp)
+{
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0xb6);
+    emit_memory(as, RAX, RSP, disp);
+}
+
+static void compile_trace_ins(Assembler* as, TraceIr* ir, int ref)
+{
+    IrIns* ins = &ir->ir[ref];
+    int    disp = 8 * ref;
+    switch (ins->op)
+    {
+    case IR_HOME:
+        if (!ins->in_place)
+        {
+            load_number(as, ir, 0, ref);
+            store_number(as, disp);
+        }
+        break;
+    case IR_ADD:
+    case IR_SUBSTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE:
+    {
+        static const u8 ops[] = {0x58, 0x5c, 0x59, 0x5e};
+        load_number(as, ir, 0, ins->a);
+        number_operation(as, ir, 0xf2, ops[ins->op - IR_ADD], ins->b);
+        store_number(as, disp);
+        break;
+    }
+    case IR_NEGATE:
+        load_number(as, ir, 0, ins->a);
+        load_immediate(as, RAX, 0x8000000000000000);
+        emit_byte(as, 0x66);  // movq xmm1, rax
+        emit_rex(as, true, 1, RAX);
+        emit_byte(as, 0x0f);
+        emit_byte(as, 0x6e);
+        emit_byte(as, 0xc8);
+        emit_sse_registers(as, 0x66, 0x57, 0, 1);  // xorpd xmm0, xmm1
+        store_number(as, disp);
+        break;
+    case IR_LESS:
+        // a < b as b > a, so NaN compares unordered and false either way
+        load_number(as, ir, 0, ins->b);
+        number_operation(as, ir, 0x66, 0x2e, ins->a);
+        set_condition(as, CC_ABOVE, RAX);
+        store_byte(as, disp);
+        break;
+    case IR_GREATER:
+        load_number(as, ir, 0, ins->a);
+        number_operation(as, ir, 0x66, 0x2e, ins->b);
+        set_condition(as, CC_ABOVE, RAX);
+        store_byte(as, disp);
+        break;
+    case IR_EQUAL:
+    case IR_NOT_EQUAL:
+    {
+        bool equal = ins->op == IR_EQUAL;
+        load_number(as, ir, 0, ins->a);
+        number_operation(as, ir, 0x66, 0x2e, ins->b);
+        set_condition(as, equal ? CC_EQUAL : CC_NOT_EQUAL, RAX);
+        set_condition(as, equal ? CC_NOT_PARITY : CC_PARITY, RCX);
+        emit_byte(as, equal ? 0x20 : 0x08);  // and/or al, cl
+        emit_byte(as, 0xc8);
+        store_byte(as, disp);
+        break;
+    }
+    case IR_NOT:
+        load_byte(as, 8 * ins->a);
+        emit_byte(as, 0x34);  // xor al, 1
+        emit_byte(as, 0x01);
+        store_byte(as, disp);
+        break;
+    case IR_STORE:
+    {
+        Location home = home_location(ir, ins->a);
+        if (home.xmm >= 0)
+            load_number(as, ir, home.xmm, ins->b);
+        else
+        {
+            load_number(as, ir, 0, ins->b);
+            store_number(as, home.disp);
+        }
+        break;
+    }
+    }
+}
+
+// Boxes a number in xmm into the Value at [base + disp].
+static void box_number(Assembler* as, int base, int disp, int xmm)
+{
+#ifndef NAN_BOXING
+    store_immediate32(as, base, disp, VAL_NUMBER);
+#endif
+    emit_sse(as, 0xf2, MOVSD_STORE, xmm, base, disp + NUMBER_OFFSET);
+}
+
+static void box_value(Assembler* as, TraceIr* ir, int ref, int base,
+                      int disp)
+{
+    switch (ir->ir[ref].op)
+    {
+    case IR_NIL:
+        store_literal(as, base, disp, NIL_VAL);
+        return;
+    case IR_TRUE:
+    case IR_FALSE:
+        store_literal(as, base, disp, BOOL_VAL(ir->ir[ref].op == IR_TRUE));
+        return;
+    }
+    if (ir->ir[ref].type == IR_TYPE_NUMBER)
+    {
+        load_number(as, ir, 0, ref);
+        box_number(as, base, disp, 0);
+        return;
+    }
+    load_byte(as, 8 * ref);
+#ifdef NAN_BOXING
+    load_immediate(as, RCX, FALSE_VAL);
+    emit_registers(as, 0x09, RAX, RCX);  // or rcx, rax
+    store(as, base, disp, RCX);
+#else
+    store_immediate32(as, base, disp, VAL_BOOL);
+    store(as, base, disp + 8, RAX);
+#endif
+}
+
+static void home_address(Home* home, int* base, int* disp)
+{
+    *base = home->is_global ? R15 : RBX;
+    *disp = home->index * VALUE_SIZE;
+}
+
+// Writes back what the interpreter needs to resume as the snapshot says.
+static void compile_exit(Assembler* as, TraceIr* ir, Snapshot* snapshot)
+{
+    for (int h = 0; h < ir->home_count; h++)
+    {
+        if (!ir->homes[h].stored)
+            continue;
+        int      base, disp;
+        Location home = home_location(ir, h);
+        home_address(&ir->homes[h], &base, &disp);
+        if (home.xmm < 0)
+            emit_sse(as, 0xf2, MOVSD_LOAD, 0, RSP, home.disp);
+        box_number(as, base, disp, home.xmm < 0 ? 0 : home.xmm);
+    }
+    for (int slot = ir->entry_depth; slot < snapshot->depth; slot++)
+        box_value(as, ir,
+                  ir->snapshot_refs[snapshot->first + slot - ir->entry_depth],
+                  RBX, slot * VALUE_SIZE);
+    load_address(as, RAX, RBX, snapshot->depth * VALUE_SIZE);
+    store(as, R14, offsetof(VM, stack_top), RAX);
+    set_ip(as, snapshot->ip);
+}
+
+Trace* jit_compile_trace(TraceIr* ir)
+{
+    Assembler as = {.function = ir->function};
+    // the four pushes leave rsp 8 bytes off 16-byte alignment
+    int frame_size = (8 * (ir->ir_count + ir->home_count) + 15) / 16 * 16 + 8;
+
+    push_register(&as, RBX);
+    push_register(&as, R13);
+    push_register(&as, R14);
+    push_register(&as, R15);
+    add_immediate(&as, RSP, -frame_size);
+    emit_registers(&as, 0x89, RDI, R13);  // mov r13, rdi
+    load(&as, RBX, R13, offsetof(CallFrame, slots));
+    load_immediate(&as, R14, (u64)(uintptr_t)&vm);
+    load(&as, R15, R14, offsetof(VM, global_values));
+
+    // load the homes, leaving at once unless they all hold numbers
+    int* not_numbers = (int*)malloc(sizeof(int) * (ir->home_count + 1));
+    if (not_numbers == NULL)
+        exit(1);
+    for (int h = 0; h < ir->home_count; h++)
+    {
+        int      base, disp;
+        Location home = home_location(ir, h);
+        home_address(&ir->homes[h], &base, &disp);
+        not_numbers[h] = guard_number(&as, base, disp);
+        emit_sse(&as, 0xf2, MOVSD_LOAD, home.xmm < 0 ? 0 : home.xmm, base,
+                 disp + NUMBER_OFFSET);
+        if (home.xmm < 0)
+            store_number(&as, home.disp);
+    }
+
+    int       loop = as.count;
+    ExitJump* exits = (ExitJump*)malloc(sizeof(ExitJump) * (ir->ir_count + 1));
+    if (exits == NULL)
+        exit(1);
+    int exit_count = 0;
+    for (int ref = 0; ref < ir->ir_count; ref++)
+    {
+        IrIns* ins = &ir->ir[ref];
+        if (ins->op == IR_GUARD_TRUE || ins->op == IR_GUARD_FALSE)
+        {
+            compare_memory8(&as, RSP, 8 * ins->a, 0);
+            int at = jump_forward(&as, ins->op == IR_GUARD_TRUE
+                                           ? CC_EQUAL
+                                           : CC_NOT_EQUAL);
+            exits[exit_count++] = (ExitJump){.at = at, .snapshot = ins->b};
+        }
+        else if (ins->op == IR_STORE || ins->uses > 0)
+            compile_trace_ins(&as, ir, ref);
+    }
+    patch_rel32(&as, jump_forward(&as, CC_ALWAYS), loop);
+
+    // the entry checks failed: nothing has changed, frame->ip is the header
+    for (int h = 0; h < ir->home_count; h++)
+        land(&as, not_numbers[h]);
+    free(not_numbers);
+    int epilogue = as.count;
+    add_immediate(&as, RSP, frame_size);
+    pop_register(&as, R15);
+    pop_register(&as, R14);
+    pop_register(&as, R13);
+    pop_register(&as, RBX);
+    emit_byte(&as, 0xc3);  // ret
+
+    for (int i = 0; i < exit_count; i++)
+    {
+        land(&as, exits[i].at);
+        compile_exit(&as, ir, &ir->snapshots[exits[i].snapshot]);
+        patch_rel32(&as, jump_forward(&as, CC_ALWAYS), epilogue);
+    }
+    free(exits);
+
+    size_t size;
+    u8*    code = map_code(&as, &size);
+    if (code == NULL)
+        return NULL;
+    Trace* trace = (Trace*)malloc(sizeof(Trace));
+    if (trace == NULL)
+        exit(1);
+    trace->next = NULL;
+    trace->header = ir->header;
+    trace->entry = (TraceEntry)(void*)code;
+    trace->size = size;
+    return trace;
+}
+
+void jit_free_trace(Trace* trace)
+{
+    munmap((void*)trace->entry, trace->size);
+    free(trace);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+// Calls a function needs before call() compiles it to machine code.
+#define JIT_CALL_THRESHOLD 100
+
+// How machine code hands control back: after a runtime error, with the top
+// frame to be carried on by the interpreter, or after the frame returned.
+enum
+{
+    JIT_ERROR,
+    JIT_EXIT,
+    JIT_RETURN,
+};
+
+// Machine code for one function, which can be entered at any instruction.
+struct JitCode
+{
+    u8*    code;
+    size_t size;     // bytes mapped at code
+    int*   entries;  // native offset of each bytecode instruction
+};
+
+void jit_compile(ObjFunction* function);
+void jit_free(ObjFunction* function);
+// Runs frame from frame->ip on and returns one of the JIT_ results.
+int  jit_run(CallFrame* frame);
+
+// The slow paths the compiled code calls into, defined in vm.c. Those
+// returning bool have reported a runtime error when they return false.
+int  jit_call(int arg_count);
+bool jit_return();
+bool jit_arithmetic(u8 instruction);
+bool jit_undefined_global(int slot);
+void jit_set_upvalue(CallFrame* frame, int index);
+void jit_equal(bool negate);
+void jit_not();
+void jit_print();
+void jit_closure(CallFrame* frame, u8* ip);
+void jit_close_upvalue();
+u8*  jit_hot_loop(u16* count);
+
+#endif
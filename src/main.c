@@ -2,25 +2,92 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
+#include "heap_stats.h"
+#include "memory.h"
+#include "profiler.h"
+#include "stats.h"
 #include "vm.h"
 
 static void repl();
 static char* read_file(const char* path);
 static void run_file(const char* path);
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [options] [path]\n"
+                    "  --gc-pause=<us>  incremental GC, max pause per step\n"
+                    "  --gc-stats       print GC pauses and pool usage at exit\n"
+                    "  --heap-stats     print allocations by kind, size and\n"
+                    "                   site at exit\n"
+                    "  --gc-sync-sweep  sweep on the interpreter thread\n"
+                    "  --trace          trace every instruction\n"
+                    "  --print-code     disassemble compiled functions\n"
+                    "  --no-optimize    skip the peephole pass\n"
+                    "  --registers      run on the register-based backend\n"
+                    "  --no-jit         never compile hot functions or loops\n"
+                    "  --no-cache       never read or write .loxc bytecode\n"
+                    "  --profile=<file> write sampled call stacks, folded\n"
+                    "  --stats          count opcodes, branches and calls,\n"
+                    "                   with the JIT off\n");
+    exit(64);
+}
 
 int main(int argc, const char* argv[])
 {
     init_VM();
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        run_file(argv[1]);
-    else
+
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        if (strncmp(argv[i], "--gc-pause=", 11) == 0)
+        {
+            char*  end;
+            double micros = strtod(argv[i] + 11, &end);
+            if (*end != '\0' || micros <= 0)
+                usage();
+            vm.gc_incremental = true;
+            vm.gc_max_pause_ns = (u64)(micros * 1000);
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+            atexit(print_gc_stats);
+        else if (strcmp(argv[i], "--heap-stats") == 0)
+            heap_stats_start();
+        else if (strcmp(argv[i], "--gc-sync-sweep") == 0)
+            vm.gc_concurrent_sweep = false;
+        else if (strcmp(argv[i], "--trace") == 0)
+            vm.trace_execution = true;
+        else if (strcmp(argv[i], "--print-code") == 0)
+            vm.print_code = true;
+        else if (strcmp(argv[i], "--no-optimize") == 0)
+            vm.optimize_code = false;
+        else if (strcmp(argv[i], "--registers") == 0)
+            vm.register_mode = true;
+        else if (strcmp(argv[i], "--no-jit") == 0)
+            vm.jit_enabled = false;
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            vm.use_cache = false;
+        else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10] != '\0')
+            profiler_start(argv[i] + 10);
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats_start();
+        else if (argv[i][0] == '-' || path != NULL)
+            usage();
+        else
+            path = argv[i];
     }
+
+    // only run() counts
+    if (vm.collect_stats && vm.register_mode)
+        usage();
+
+    if (path == NULL)
+        repl();
+    else
+        run_file(path);
+
+    profiler_stop();
+    print_heap_stats();
     free_VM();
     return 0;
 }
@@ -72,7 +139,7 @@ static char* read_file(const char* path)
 static void run_file(const char* path)
 {
   char*           source = read_file(path);
-  InterpretResult result = interpret(source);
+  InterpretResult result = interpret_function(compile_cached(path, source));
   free(source);
 
   if (result == INTERPRET_COMPILE_ERROR)
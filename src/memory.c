@@ -1,40 +1,505 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "chunk.h"
+#include "compiler.h"
+#include "heap_stats.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size)
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+// bytes the mutator may allocate between two incremental mark steps
+#define GC_STEP_SIZE (64 * 1024)
+// objects blackened between two looks at the clock during a mark step
+#define GC_STEP_CHECK 64
+// dead objects the sweeper frees before handing their blocks back to the
+// pool depot
+#define SWEEP_BATCH 256
+
+// The background sweeper owns a detached copy of the object list from the
+// end of a mark until the main thread joins it. It only ever touches that
+// list, so the mutator can keep allocating onto a fresh vm.objects.
+typedef struct
+{
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_cond_t  done;
+    bool            started;
+    bool            busy;
+    bool            shutdown;
+    Obj*            pending;
+    Obj*            survivors;
+    Obj*            survivors_tail;
+    size_t          freed_bytes;
+} Sweeper;
+
+static Sweeper sweeper = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                          .wake = PTHREAD_COND_INITIALIZER,
+                          .done = PTHREAD_COND_INITIALIZER};
+
+// memory released on the sweeper thread is tallied here rather than in
+// vm.bytes_allocated, which belongs to the main thread
+static __thread bool on_sweeper_thread = false;
+
+static u64 gc_clock()
 {
-    if (new_size == 0)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000u + (u64)now.tv_nsec;
+}
+
+static void record_pause(PauseHistogram* pauses, u64 start)
+{
+    u64 ns = gc_clock() - start;
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && ns >= (1000ull << bucket))
     {
-        free(pointer);
-        return NULL;
+        bucket++;
     }
 
-    void* result = realloc(pointer, new_size);
+    pauses->buckets[bucket]++;
+    pauses->count++;
+    pauses->total_ns += ns;
+    if (ns > pauses->max_ns)
+        pauses->max_ns = ns;
+}
+
+// reallocate() without counting the allocation, for allocate_object(), which
+// counts it as an object
+void* reallocate_object(void* pointer, size_t old_size, size_t new_size)
+{
+    if (on_sweeper_thread)
+        sweeper.freed_bytes += old_size - new_size;
+    else
+        vm.bytes_allocated += new_size - old_size;
+
+    if (new_size > old_size)
+    {
+#ifdef DEBUG_STRESS_GC
+        collect_garbage();
+#endif
+        if (vm.bytes_allocated > vm.next_gc)
+            collect_garbage();
+    }
+
+    return pool_reallocate(pointer, old_size, new_size);
+}
+
+void* reallocate(void* pointer, size_t old_size, size_t new_size)
+{
+    // frees run on the sweeper thread as well, growth only on this one
+    if (new_size > old_size)
+        heap_stats_record(HEAP_ARRAYS, new_size - old_size);
+    return reallocate_object(pointer, old_size, new_size);
+}
+
+void* checked_malloc(size_t size)
+{
+    void* result = malloc(size);
     if (result == NULL)
         exit(1);
     return result;
 }
 
+void init_nursery()
+{
+    vm.nursery = (u8*)malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL)
+        exit(1);
+    vm.nursery_top = vm.nursery;
+    vm.nursery_end = vm.nursery + NURSERY_SIZE;
+    vm.minor_gc_pending = false;
+
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
+}
+
+void* nursery_allocate(size_t size)
+{
+    size = NURSERY_ALIGN(size);
+    if (size > NURSERY_MAX_OBJECT)
+        return NULL;
+    if (size > (size_t)(vm.nursery_end - vm.nursery_top))
+    {
+        // the caller may be holding unrooted young pointers, so the copy is
+        // deferred to the next safepoint in run()
+        vm.minor_gc_pending = true;
+        return NULL;
+    }
+
+    void* result = vm.nursery_top;
+    vm.nursery_top += size;
+    return result;
+}
+
+// Frees the object allocated last, before anything else can have seen it.
+void discard_object(Obj* object, size_t size)
+{
+    if (is_young(object))
+    {
+        if ((u8*)object + NURSERY_ALIGN(size) == vm.nursery_top)
+            vm.nursery_top = (u8*)object;
+        return;
+    }
+
+    if (vm.objects == object)
+    {
+        vm.objects = object->next;
+        reallocate(object, size, 0);
+    }
+}
+
+void remember_object(Obj* object)
+{
+    if (vm.remembered_capacity < vm.remembered_count + 1)
+    {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (Obj**)realloc(
+            vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+        if (vm.remembered == NULL)
+            exit(1);
+    }
+
+    object->is_remembered = true;
+    vm.remembered[vm.remembered_count++] = object;
+}
+
+static size_t object_size(Obj* object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure) +
+               sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalue_count;
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction);
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_STRING:
+        return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+// Copies a young object into the old heap, leaving a forwarding pointer in
+// its nursery slot. Old objects are returned unchanged.
+static Obj* promote(Obj* object)
+{
+    if (object == NULL || !is_young(object))
+        return object;
+    if (object->is_forwarded)
+        return object->next;
+
+    // promotion must not start a major collection half-way through a minor
+    // one, so this bypasses reallocate() and only does the accounting
+    size_t size = object_size(object);
+    Obj*   copy = (Obj*)pool_allocate(size);
+    vm.bytes_allocated += size;
+
+    memcpy(copy, object, size);
+    copy->next = vm.objects;
+    vm.objects = copy;
+
+    // the marker may not have reached the young original yet; graying the
+    // copy keeps it and whatever old objects it points to alive
+    if (vm.gc_marking)
+        mark_object(copy);
+
+    if (object->type == OBJ_UPVALUE)
+    {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed)
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+    }
+
+    object->is_forwarded = true;
+    object->next = copy;
+    return copy;
+}
+
+static void promote_value(Value* slot)
+{
+    if (IS_OBJ(*slot) && is_young(AS_OBJ(*slot)))
+        *slot = OBJ_VAL(promote(AS_OBJ(*slot)));
+}
+
+static void promote_fields(Obj* object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure* closure = (ObjClosure*)object;
+        for (int i = 0; i < closure->upvalue_count; i++)
+        {
+            closure->upvalues[i] =
+                (ObjUpvalue*)promote((Obj*)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction* function = (ObjFunction*)object;
+        function->name = (ObjString*)promote((Obj*)function->name);
+        for (int i = 0; i < function->chunk.constants.count; i++)
+        {
+            promote_value(&function->chunk.constants.values[i]);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+    {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        promote_value(&upvalue->closed);
+        upvalue->next = (ObjUpvalue*)promote((Obj*)upvalue->next);
+        break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+static void promote_table(Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)promote((Obj*)entry->key);
+        promote_value(&entry->value);
+    }
+    table->has_young = false;
+}
+
+void collect_nursery()
+{
+    u64  start = gc_clock();
+    bool collecting = vm.collecting;
+    vm.collecting = true;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t used = (size_t)(vm.nursery_top - vm.nursery);
+#endif
+
+    Obj* scanned = vm.objects;
+
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
+    {
+        promote_value(slot);
+    }
+
+    for (ObjUpvalue** upvalue = &vm.open_upvalues; *upvalue != NULL;
+         upvalue = &(*upvalue)->next)
+    {
+        *upvalue = (ObjUpvalue*)promote((Obj*)*upvalue);
+    }
+
+    if (vm.global_slots.has_young)
+        promote_table(&vm.global_slots);
+    // global stores skip the write barrier, the array is scanned instead
+    for (int i = 0; i < vm.global_count; i++)
+    {
+        promote_value(&vm.global_values[i]);
+        vm.global_names[i].name =
+            (ObjString*)promote((Obj*)vm.global_names[i].name);
+    }
+
+    for (int i = 0; i < vm.remembered_count; i++)
+    {
+        vm.remembered[i]->is_remembered = false;
+        promote_fields(vm.remembered[i]);
+    }
+    vm.remembered_count = 0;
+
+    // promoted objects are pushed onto the front of vm.objects, so keep
+    // scanning the newly added prefix until a pass promotes nothing more
+    while (vm.objects != scanned)
+    {
+        Obj* top = vm.objects;
+        for (Obj* object = top; object != scanned; object = object->next)
+        {
+            promote_fields(object);
+        }
+        scanned = top;
+    }
+
+    // the intern table only holds young strings weakly: survivors get their
+    // new address, the rest are dropped
+    size_t promoted = 0;
+    for (u8* cursor = vm.nursery; cursor < vm.nursery_top;)
+    {
+        Obj* object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(object_size(object));
+
+        if (object->is_forwarded)
+            promoted += object_size(object);
+
+        if (object->type != OBJ_STRING)
+            continue;
+
+        ObjString* string = (ObjString*)object;
+        if (object->is_forwarded)
+            table_move_key(&vm.strings, string, (ObjString*)object->next);
+        else
+            table_delete(&vm.strings, string);
+    }
+    vm.strings.has_young = false;
+
+    // an incremental mark in progress may still have young objects on its
+    // gray stack: follow the survivors and forget the dead
+    if (vm.gc_marking)
+    {
+        int gray = 0;
+        for (int i = 0; i < vm.gray_count; i++)
+        {
+            Obj* object = vm.gray_stack[i];
+            if (!is_young(object))
+                vm.gray_stack[gray++] = object;
+            else if (object->is_forwarded)
+                vm.gray_stack[gray++] = object->next;
+        }
+        vm.gray_count = gray;
+    }
+
+    vm.nursery_top = vm.nursery;
+    vm.minor_gc_pending = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu of %zu nursery bytes\n", promoted, used);
+#else
+    (void)promoted;
+#endif
+
+    record_pause(&vm.minor_pauses, start);
+    vm.collecting = collecting;
+}
+
+void mark_object(Obj* object)
+{
+    if (object == NULL || object->is_marked)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->is_marked = true;
+
+    if (vm.gray_capacity < vm.gray_count + 1)
+    {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        // the gray stack is owned by the collector itself, so it goes
+        // straight to the system allocator and never triggers a collection
+        vm.gray_stack =
+            (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+        if (vm.gray_stack == NULL)
+            exit(1);
+    }
+
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_value(Value value)
+{
+    if (IS_OBJ(value))
+        mark_object(AS_OBJ(value));
+}
+
+static void mark_array(ValueArray* array)
+{
+    for (int i = 0; i < array->count; i++)
+    {
+        mark_value(array->values[i]);
+    }
+}
+
+static void blacken_object(Obj* object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure* closure = (ObjClosure*)object;
+        mark_object((Obj*)closure->function);
+        for (int i = 0; i < closure->upvalue_count; i++)
+        {
+            mark_object((Obj*)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction* function = (ObjFunction*)object;
+        mark_object((Obj*)function->name);
+        mark_array(&function->chunk.constants);
+        break;
+    }
+    case OBJ_UPVALUE:
+        mark_value(((ObjUpvalue*)object)->closed);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
 static void free_object(Obj* object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type)
     {
     case OBJ_CLOSURE:
     {
         ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-        FREE(ObjClosure, object);
+        reallocate(object,
+                   sizeof(ObjClosure) +
+                       sizeof(ObjUpvalue*) * closure->upvalue_count,
+                   0);
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction* function = (ObjFunction*)object;
         free_chunk(&function->chunk);
+#ifdef JIT
+        jit_free(function);
+        trace_free(function);
+#endif
         FREE(ObjFunction, object);
         break;
     }
@@ -46,8 +511,7 @@ static void free_object(Obj* object)
     case OBJ_STRING:
     {
         ObjString* string = (ObjString*)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        reallocate(object, sizeof(ObjString) + string->length + 1, 0);
         break;
     }
     case OBJ_UPVALUE:
@@ -57,8 +521,359 @@ static void free_object(Obj* object)
     }
     }
 }
+
+static void mark_roots()
+{
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
+    {
+        mark_value(*slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++)
+    {
+        mark_object((Obj*)vm.frames[i].closure);
+    }
+
+    for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue != NULL;
+         upvalue = upvalue->next)
+    {
+        mark_object((Obj*)upvalue);
+    }
+
+    mark_table(&vm.global_slots);
+    for (int i = 0; i < vm.global_count; i++)
+    {
+        mark_value(vm.global_values[i]);
+    }
+    mark_compiler_roots();
+}
+
+static void trace_references()
+{
+    while (vm.gray_count > 0)
+    {
+        Obj* object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+    }
+}
+
+static void sweep()
+{
+    Obj* previous = NULL;
+    Obj* object = vm.objects;
+
+    while (object != NULL)
+    {
+        if (object->is_marked)
+        {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        Obj* unreached = object;
+        object = object->next;
+        if (previous != NULL)
+            previous->next = object;
+        else
+            vm.objects = object;
+
+        free_object(unreached);
+    }
+}
+
+static void free_batch(Obj** batch, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free_object(batch[i]);
+    }
+    pool_flush();
+}
+
+static void* sweeper_main(void* arg)
+{
+    on_sweeper_thread = true;
+
+    pthread_mutex_lock(&sweeper.lock);
+    for (;;)
+    {
+        while (!sweeper.busy && !sweeper.shutdown)
+            pthread_cond_wait(&sweeper.wake, &sweeper.lock);
+        if (sweeper.shutdown)
+            break;
+
+        Obj* object = sweeper.pending;
+        pthread_mutex_unlock(&sweeper.lock);
+
+        Obj*   survivors = NULL;
+        Obj*   survivors_tail = NULL;
+        Obj*   batch[SWEEP_BATCH];
+        int    batch_count = 0;
+
+        while (object != NULL)
+        {
+            Obj* next = object->next;
+            if (object->is_marked)
+            {
+                object->is_marked = false;
+                object->next = survivors;
+                if (survivors == NULL)
+                    survivors_tail = object;
+                survivors = object;
+            }
+            else
+            {
+                batch[batch_count++] = object;
+                if (batch_count == SWEEP_BATCH)
+                {
+                    free_batch(batch, batch_count);
+                    batch_count = 0;
+                }
+            }
+            object = next;
+        }
+        free_batch(batch, batch_count);
+
+        pthread_mutex_lock(&sweeper.lock);
+        sweeper.survivors = survivors;
+        sweeper.survivors_tail = survivors_tail;
+        sweeper.busy = false;
+        pthread_cond_signal(&sweeper.done);
+    }
+    pthread_mutex_unlock(&sweeper.lock);
+    return NULL;
+}
+
+static void start_background_sweep()
+{
+    if (!sweeper.started)
+    {
+        // signals are meant for the interpreter thread, never the sweeper
+        sigset_t blocked, previous;
+        sigfillset(&blocked);
+        pthread_sigmask(SIG_SETMASK, &blocked, &previous);
+        if (pthread_create(&sweeper.thread, NULL, sweeper_main, NULL) != 0)
+            exit(1);
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        sweeper.started = true;
+    }
+
+    pthread_mutex_lock(&sweeper.lock);
+    sweeper.pending = vm.objects;
+    sweeper.freed_bytes = 0;
+    sweeper.busy = true;
+    vm.sweeping = true;
+    vm.objects = NULL;
+    pthread_cond_signal(&sweeper.wake);
+    pthread_mutex_unlock(&sweeper.lock);
+}
+
+// Waits for an outstanding background sweep, splices its survivors back
+// into vm.objects and settles the heap accounting.
+static void join_sweep()
+{
+    if (!vm.sweeping)
+        return;
+
+    pthread_mutex_lock(&sweeper.lock);
+    while (sweeper.busy)
+        pthread_cond_wait(&sweeper.done, &sweeper.lock);
+
+    if (sweeper.survivors != NULL)
+    {
+        sweeper.survivors_tail->next = vm.objects;
+        vm.objects = sweeper.survivors;
+    }
+    vm.bytes_allocated -= sweeper.freed_bytes;
+    sweeper.survivors = NULL;
+    sweeper.survivors_tail = NULL;
+    pthread_mutex_unlock(&sweeper.lock);
+
+    vm.sweeping = false;
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+}
+
+static void stop_sweeper()
+{
+    join_sweep();
+    if (!sweeper.started)
+        return;
+
+    pthread_mutex_lock(&sweeper.lock);
+    sweeper.shutdown = true;
+    pthread_cond_signal(&sweeper.wake);
+    pthread_mutex_unlock(&sweeper.lock);
+    pthread_join(sweeper.thread, NULL);
+    sweeper.started = false;
+    sweeper.shutdown = false;
+}
+
+// Blackens gray objects until the gray stack is empty or the deadline has
+// passed.
+static void mark_step(u64 deadline)
+{
+    int work = 0;
+    while (vm.gray_count > 0)
+    {
+        Obj* object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+
+        if (++work % GC_STEP_CHECK == 0 && gc_clock() >= deadline)
+            return;
+    }
+}
+
+// The atomic end of a cycle: roots are not covered by the write barrier, so
+// they are scanned again before the white objects are reclaimed.
+static void finish_collection()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    mark_roots();
+    trace_references();
+    // interned strings are weak: drop the ones nothing else reached before
+    // sweep() frees them
+    table_remove_white(&vm.strings);
+
+    int remembered = 0;
+    for (int i = 0; i < vm.remembered_count; i++)
+    {
+        if (vm.remembered[i]->is_marked)
+            vm.remembered[remembered++] = vm.remembered[i];
+    }
+    vm.remembered_count = remembered;
+
+    if (vm.gc_concurrent_sweep)
+        start_background_sweep();
+    else
+        sweep();
+
+    // young objects are traced like any other but never swept; their marks
+    // are cleared here instead
+    for (u8* cursor = vm.nursery; cursor < vm.nursery_top;)
+    {
+        Obj* object = (Obj*)cursor;
+        object->is_marked = false;
+        cursor += NURSERY_ALIGN(object_size(object));
+    }
+
+    vm.gc_marking = false;
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    if (vm.sweeping)
+        printf("   sweeping in the background\n");
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytes_allocated, before, vm.bytes_allocated,
+           vm.next_gc);
+#endif
+}
+
+// In incremental mode each call is one bounded slice of work: the first
+// grays the roots, later ones mark until vm.gc_max_pause_ns is used up, and
+// the one after the gray stack runs dry finishes the cycle. In between,
+// next_gc is only pushed GC_STEP_SIZE ahead so allocation paces marking.
+void collect_garbage()
+{
+    u64  start = gc_clock();
+    bool collecting = vm.collecting;
+    vm.collecting = true;
+
+    // a cycle cannot start before the previous sweep is done with the mark
+    // bits; once it is, the freed memory may already put us under budget
+    if (vm.sweeping)
+    {
+        join_sweep();
+        if (vm.bytes_allocated <= vm.next_gc)
+        {
+            record_pause(&vm.gc_pauses, start);
+            vm.collecting = collecting;
+            return;
+        }
+    }
+
+    if (!vm.gc_incremental)
+    {
+        finish_collection();
+    }
+    else if (!vm.gc_marking)
+    {
+#ifdef DEBUG_LOG_GC
+        printf("-- gc mark begin\n");
+#endif
+        vm.gc_marking = true;
+        mark_roots();
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+    }
+    else if (vm.gray_count > 0)
+    {
+        mark_step(start + vm.gc_max_pause_ns);
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+    }
+    else
+    {
+        finish_collection();
+    }
+
+    record_pause(&vm.gc_pauses, start);
+    vm.collecting = collecting;
+}
+
+static u64 pause_percentile(PauseHistogram* pauses, double fraction)
+{
+    u64 target = (u64)(pauses->count * fraction);
+    u64             seen = 0;
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        seen += pauses->buckets[i];
+        if (seen > target)
+            return 1ull << i;
+    }
+    return 1ull << (GC_PAUSE_BUCKETS - 1);
+}
+
+static void print_pauses(const char* name, PauseHistogram* pauses)
+{
+    fprintf(stderr, "%s pauses: %llu, total %.3f ms, max %.3f ms\n", name,
+            (unsigned long long)pauses->count, pauses->total_ns / 1e6,
+            pauses->max_ns / 1e6);
+    if (pauses->count == 0)
+        return;
+
+    fprintf(stderr, "  p50 < %llu us, p99 < %llu us\n",
+            (unsigned long long)pause_percentile(pauses, 0.50),
+            (unsigned long long)pause_percentile(pauses, 0.99));
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        if (pauses->buckets[i] == 0)
+            continue;
+        fprintf(stderr, "  < %8llu us  %llu\n", 1ull << i,
+                (unsigned long long)pauses->buckets[i]);
+    }
+}
+
+void print_gc_stats()
+{
+    fprintf(stderr, "gc: %s, max pause %.3f ms\n",
+            vm.gc_incremental ? "incremental" : "stop-the-world",
+            vm.gc_max_pause_ns / 1e6);
+    print_pauses("major", &vm.gc_pauses);
+    print_pauses("minor", &vm.minor_pauses);
+    print_pool_stats();
+}
+
 void free_objects()
 {
+    stop_sweeper();
+
     Obj* object = vm.objects;
     while (object != NULL)
     {
@@ -66,4 +881,9 @@ void free_objects()
         free_object(object);
         object = next;
     }
+
+    free(vm.nursery);
+    free(vm.remembered);
+    free(vm.gray_stack);
+    free_pools();
 }
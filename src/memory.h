@@ -2,6 +2,9 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -16,7 +19,46 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#define NURSERY_SIZE (512 * 1024)
+// larger objects go straight to the old heap rather than being copied
+#define NURSERY_MAX_OBJECT (8 * 1024)
+#define GC_DEFAULT_MAX_PAUSE_NS (500 * 1000)
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void* reallocate_object(void* pointer, size_t old_size, size_t new_size);
+// malloc() for the bookkeeping the collector does not count
+void* checked_malloc(size_t size);
+void  init_nursery();
+void* nursery_allocate(size_t size);
+void  discard_object(Obj* object, size_t size);
+void  collect_nursery();
+void  remember_object(Obj* object);
+void  mark_object(Obj* object);
+void  mark_value(Value value);
+void  collect_garbage();
 void  free_objects();
+void  print_gc_stats();
+
+static inline bool is_young(Obj* object)
+{
+    return (u8*)object >= vm.nursery && (u8*)object < vm.nursery_end;
+}
+
+// Every store of a reference into a heap object must go through here. It
+// keeps an incremental mark from leaving a white object behind a black one,
+// and lets a minor collection find old-to-young pointers without scanning
+// the whole old heap.
+static inline void write_barrier(Obj* owner, Value value)
+{
+    if (!IS_OBJ(value))
+        return;
+
+    Obj* target = AS_OBJ(value);
+    if (vm.gc_marking && owner->is_marked)
+        mark_object(target);
+
+    if (is_young(target) && !is_young(owner) && !owner->is_remembered)
+        remember_object(owner);
+}
 
 #endif
@@ -5,6 +5,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "heap_stats.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -15,26 +16,50 @@
 
 static Obj* allocate_object(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    // strings and upvalues mostly die young, so they start out in the
+    // nursery; everything else, and anything that does not fit, goes
+    // straight to the old heap
+    Obj* object = NULL;
+    if (type == OBJ_STRING || type == OBJ_UPVALUE)
+        object = (Obj*)nursery_allocate(size);
+
+    if (object == NULL)
+    {
+        object = (Obj*)reallocate_object(NULL, 0, size);
+        object->next = vm.objects;
+        vm.objects = object;
+    }
+    else
+    {
+        object->next = NULL;
+    }
+
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    // objects born during an incremental mark are black, the marker has
+    // already moved past anything that could point to them
+    object->is_marked = vm.gc_marking;
+    object->is_remembered = false;
+    object->is_forwarded = false;
+    heap_stats_record(type, size);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
 
     return object;
 }
 
 ObjClosure* new_closure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
+    ObjClosure* closure = (ObjClosure*)allocate_object(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalue_count,
+        OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalue_count = function->upvalue_count;
     for (int i = 0; i < function->upvalue_count; i++)
     {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalue_count = function->upvalue_count;
     return closure;
 }
 
@@ -44,7 +69,12 @@ ObjFunction* new_function()
 
     function->arity = 0;
     function->upvalue_count = 0;
+    function->slot_count = 0;
+    function->register_code = false;
     function->name = NULL;
+    function->call_count = 0;
+    function->jit = NULL;
+    function->traces = NULL;
     init_chunk(&function->chunk);
     return function;
 }
@@ -56,18 +86,6 @@ ObjNative* new_native(NativeFn function)
     return native;
 }
 
-static ObjString* allocate_string(char* chars, int length, u32 hash)
-{
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-
-    table_set(&vm.strings, string, NIL_VAL);
-
-    return string;
-}
-
 static u32 hash_string(const char* key, int length)
 {
     u32 hash = 2166136261u;
@@ -80,18 +98,37 @@ static u32 hash_string(const char* key, int length)
     return hash;
 }
 
-ObjString* take_string(char* chars, int length)
+// Allocates an uninterned string with room for length characters. The
+// caller fills in chars and must pass the result to intern_string() before
+// allocating anything else.
+ObjString* allocate_string(int length)
 {
-    u32 hash = hash_string(chars, length);
+    ObjString* string = (ObjString*)allocate_object(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+// Returns the canonical copy of a freshly built string. A duplicate is
+// released again on the spot, it was the last object allocated.
+ObjString* intern_string(ObjString* string)
+{
+    string->hash = hash_string(string->chars, string->length);
+
+    ObjString* interned = table_find_string(&vm.strings, string->chars,
+                                            string->length, string->hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        discard_object((Obj*)string, sizeof(ObjString) + string->length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
 }
 
 ObjString* copy_string(const char* chars, int length)
@@ -102,11 +139,15 @@ ObjString* copy_string(const char* chars, int length)
     if (interned != NULL)
         return interned;
 
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
+    ObjString* string = allocate_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
 
-    return allocate_string(heap_chars, length, hash);
+    return string;
 }
 
 ObjUpvalue* new_upvalue(Value* slot)
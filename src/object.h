@@ -10,10 +10,10 @@
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 
-#define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION);
+#define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value) (((ObjFunction*)AS_OBJ(value)))
 
-#define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE);
+#define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
@@ -32,16 +32,27 @@ typedef enum
 struct Obj
 {
     ObjType     type;
+    bool        is_marked;
+    bool        is_remembered;  // old object in the nursery remembered set
+    bool        is_forwarded;   // young object already promoted, see next
     struct Obj* next;
 };
 
+typedef struct JitCode JitCode;
+typedef struct Trace   Trace;
+
 typedef struct
 {
     Obj        obj;
     int        arity;
     int        upvalue_count;
+    int        slot_count;     // most locals live at once, checked by call()
+    bool       register_code;  // chunk holds register code, see register.h
     Chunk      chunk;
     ObjString* name;
+    int        call_count;  // counts up to JIT_CALL_THRESHOLD
+    JitCode*   jit;         // machine code once hot, see jit.c
+    Trace*     traces;      // compiled hot loops, see trace.c
 } ObjFunction;
 
 typedef Value (*NativeFn)(int arg_count, Value* args);
@@ -55,10 +66,10 @@ typedef struct
 
 struct ObjString
 {
-    Obj   obj;
-    int   length;
-    char* chars;
-    u32   hash;
+    Obj  obj;
+    int  length;
+    u32  hash;
+    char chars[];  // length bytes plus a terminating '\0'
 };
 
 typedef struct ObjUpvalue
@@ -73,14 +84,16 @@ typedef struct
 {
     Obj          obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int          upvalue_count;
+    // stored inline so a closure costs a single allocation
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
 ObjClosure*  new_closure(ObjFunction* function);
 ObjFunction* new_function();
 ObjNative*   new_native(NativeFn function);
-ObjString*   take_string(char* chars, int length);
+ObjString*   allocate_string(int length);
+ObjString*   intern_string(ObjString* string);
 ObjString*   copy_string(const char* chars, int length);
 ObjUpvalue*  new_upvalue(Value* slot);
 void         print_object(Value value);
@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "peephole.h"
+
+// The pass decodes a chunk into a list of instructions, rewrites the list
+// and encodes it back. A jump refers to the instruction it lands on rather
+// than to a distance, so instructions can be removed or shrunk freely and
+// every distance is recomputed once at the end. Nothing ever grows, which
+// keeps every new distance within the old one and lets the encoding reuse
+// the chunk's arrays.
+typedef struct
+{
+    const u8* bytes;      // original encoding
+    u8        code[4];    // encoding once rewritten
+    bool      rewritten;
+    bool      removed;
+    int       length;
+    int       line;
+    int       offset;     // original offset, the new one when encoding
+    int       target;     // instruction a jump lands on, -1 otherwise
+} Instruction;
+
+typedef struct
+{
+    Chunk*       chunk;
+    u8*          old_code;
+    Instruction* instructions;  // followed by an end-of-code sentinel
+    int          count;
+    int*         jumps_to;      // live jumps landing on each instruction
+} Code;
+
+static bool is_jump(u8 instruction)
+{
+    switch (instruction)
+    {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static u8 opcode(Code* code, int i)
+{
+    if (i == code->count)
+        return OP_RETURN;  // falling off the end behaves like leaving
+
+    Instruction* instruction = &code->instructions[i];
+    return instruction->rewritten ? instruction->code[0]
+                                  : instruction->bytes[0];
+}
+
+static u8 operand(Code* code, int i, int n)
+{
+    Instruction* instruction = &code->instructions[i];
+    return instruction->rewritten ? instruction->code[n]
+                                  : instruction->bytes[n];
+}
+
+static int next_live(Code* code, int i)
+{
+    do
+        i++;
+    while (i < code->count && code->instructions[i].removed);
+    return i;
+}
+
+// First live instruction at or after i, where a jump to i now lands.
+static int resolve(Code* code, int i)
+{
+    while (i < code->count && code->instructions[i].removed)
+        i++;
+    return i;
+}
+
+static void rewrite(Code* code, int i, u8 op, u8 a, u8 b, int length)
+{
+    Instruction* instruction = &code->instructions[i];
+    instruction->code[0] = op;
+    instruction->code[1] = a;
+    instruction->code[2] = b;
+    instruction->length = length;
+    instruction->rewritten = true;
+}
+
+static void retarget(Code* code, int i, int target)
+{
+    Instruction* instruction = &code->instructions[i];
+    code->jumps_to[resolve(code, instruction->target)]--;
+    instruction->target = target;
+    code->jumps_to[resolve(code, target)]++;
+}
+
+// Jumps that landed on a removed instruction land on the next live one.
+static void remove_instruction(Code* code, int i)
+{
+    if (is_jump(opcode(code, i)))
+        code->jumps_to[resolve(code, code->instructions[i].target)]--;
+    code->instructions[i].removed = true;
+    code->jumps_to[resolve(code, i)] += code->jumps_to[i];
+    code->jumps_to[i] = 0;
+}
+
+// Recounts the jumps landing on every live instruction, after removals
+// have moved landing points forward.
+static void count_jumps(Code* code)
+{
+    memset(code->jumps_to, 0, sizeof(int) * (code->count + 1));
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        if (!code->instructions[i].removed && is_jump(opcode(code, i)))
+            code->jumps_to[resolve(code, code->instructions[i].target)]++;
+    }
+}
+
+static void decode(Code* code, Chunk* chunk)
+{
+    code->chunk = chunk;
+    code->old_code = (u8*)malloc(chunk->count);
+    code->instructions =
+        (Instruction*)malloc(sizeof(Instruction) * (chunk->count + 1));
+    code->jumps_to = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    int* index_of = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    if (code->old_code == NULL || code->instructions == NULL ||
+        code->jumps_to == NULL || index_of == NULL)
+    {
+        exit(1);
+    }
+    memcpy(code->old_code, chunk->code, chunk->count);
+
+    code->count = 0;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        Instruction* instruction = &code->instructions[code->count];
+        instruction->bytes = &code->old_code[offset];
+        instruction->rewritten = false;
+        instruction->removed = false;
+        instruction->length = instruction_length(chunk, offset);
+        instruction->line = chunk->lines[offset];
+        instruction->offset = offset;
+        instruction->target = -1;
+        index_of[offset] = code->count++;
+        offset += instruction->length;
+    }
+    Instruction* end = &code->instructions[code->count];
+    end->removed = false;
+    end->length = 0;
+    end->offset = chunk->count;
+    index_of[chunk->count] = code->count;
+
+    for (int i = 0; i < code->count; i++)
+    {
+        Instruction* instruction = &code->instructions[i];
+        if (!is_jump(instruction->bytes[0]))
+            continue;
+        int jump = (instruction->bytes[1] << 8) | instruction->bytes[2];
+        int after = instruction->offset + 3;
+        instruction->target =
+            index_of[instruction->bytes[0] == OP_LOOP ? after - jump
+                                                      : after + jump];
+    }
+    free(index_of);
+    count_jumps(code);
+}
+
+static void encode(Code* code)
+{
+    Chunk* chunk = code->chunk;
+    int    offset = 0;
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        if (code->instructions[i].removed)
+            continue;
+        code->instructions[i].offset = offset;
+        offset += code->instructions[i].length;
+    }
+    code->instructions[code->count].offset = offset;
+
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        Instruction* instruction = &code->instructions[i];
+        if (instruction->removed)
+            continue;
+
+        int at = instruction->offset;
+        for (int n = 0; n < instruction->length; n++)
+        {
+            chunk->code[at + n] = operand(code, i, n);
+            chunk->lines[at + n] = instruction->line;
+        }
+        if (is_jump(chunk->code[at]))
+        {
+            int target =
+                code->instructions[resolve(code, instruction->target)].offset;
+            int jump = chunk->code[at] == OP_LOOP ? at + 3 - target
+                                                  : target - (at + 3);
+            chunk->code[at + 1] = (jump >> 8) & 0xff;
+            chunk->code[at + 2] = jump & 0xff;
+        }
+    }
+    chunk->count = offset;
+
+    free(code->old_code);
+    free(code->instructions);
+    free(code->jumps_to);
+}
+
+// ---------------------- passes --------------------------
+
+// JUMP_IF_FALSE leaves the condition on the stack, so both of its successors
+// usually start with a POP. When they do, a single POP_JUMP_IF_FALSE landing
+// past the target's POP does the same work. Going backwards lets an `and`
+// chain jump straight to the popping jump it ends in.
+static void pop_conditions(Code* code)
+{
+    for (int i = code->count - 1; i >= 0; i--)
+    {
+        if (code->instructions[i].removed || opcode(code, i) != OP_JUMP_IF_FALSE)
+            continue;
+
+        int next = next_live(code, i);
+        int target = resolve(code, code->instructions[i].target);
+        if (opcode(code, next) != OP_POP || code->jumps_to[next] > 0)
+            continue;
+
+        if (opcode(code, target) == OP_POP)
+            target = next_live(code, target);
+        else if (opcode(code, target) == OP_POP_JUMP_IF_FALSE)
+            target = code->instructions[target].target;  // still falsey there
+        else
+            continue;
+
+        rewrite(code, i, OP_POP_JUMP_IF_FALSE, 0, 0, 3);
+        retarget(code, i, target);
+        remove_instruction(code, next);
+    }
+}
+
+static bool pushes_only(u8 instruction)
+{
+    return instruction == OP_CONSTANT || instruction == OP_CONSTANT_LONG ||
+           instruction == OP_NIL || instruction == OP_TRUE ||
+           instruction == OP_FALSE || instruction == OP_GET_LOCAL ||
+           instruction == OP_GET_LOCAL_LONG || instruction == OP_GET_UPVALUE;
+}
+
+// Whether the literal instruction i pushes is falsey, or -1 when it does
+// not push a literal.
+static int literal_falsey(Code* code, int i)
+{
+    switch (opcode(code, i))
+    {
+    case OP_NIL:
+    case OP_FALSE:
+        return 1;
+    case OP_TRUE:
+        return 0;
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    {
+        int index = opcode(code, i) == OP_CONSTANT
+                        ? operand(code, i, 1)
+                        : (operand(code, i, 1) << 16) |
+                              (operand(code, i, 2) << 8) | operand(code, i, 3);
+        Value value = code->chunk->constants.values[index];
+        return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    }
+    default:
+        return -1;
+    }
+}
+
+// Drops values that are pushed only to be popped, and branches on literals
+// such as the `true` of `while (true)`.
+static void drop_pushes(Code* code)
+{
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        int next = next_live(code, i);
+        u8  first = opcode(code, i);
+        u8  second = opcode(code, next);
+        if (code->instructions[i].removed || !pushes_only(first) ||
+            next == code->count || code->jumps_to[next] > 0)
+        {
+            continue;
+        }
+
+        if (second == OP_POP)
+        {
+            remove_instruction(code, next);
+            remove_instruction(code, i);
+        }
+        else if (second == OP_POP_JUMP_IF_FALSE &&
+                 literal_falsey(code, i) == 0)
+        {
+            remove_instruction(code, next);
+            remove_instruction(code, i);
+        }
+        else if (second == OP_POP_JUMP_IF_FALSE &&
+                 literal_falsey(code, i) == 1)
+        {
+            rewrite(code, i, OP_JUMP, 0, 0, 3);
+            code->instructions[i].target = code->instructions[next].target;
+            code->jumps_to[resolve(code, code->instructions[i].target)]++;
+            remove_instruction(code, next);
+        }
+    }
+}
+
+// Points jumps that land on an unconditional jump at its destination, and
+// a JUMP_IF_FALSE landing on another JUMP_IF_FALSE at that one's, since the
+// same falsey value is still on top of the stack there.
+static void thread_jumps(Code* code)
+{
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        u8 instruction = opcode(code, i);
+        if (code->instructions[i].removed || !is_jump(instruction))
+            continue;
+
+        bool conditional = instruction != OP_JUMP && instruction != OP_LOOP;
+        int  from = code->instructions[i].offset + 3;
+        int  target = resolve(code, code->instructions[i].target);
+        for (int hops = 0; hops < 8; hops++)
+        {
+            u8 there = opcode(code, target);
+            if (target == code->count ||
+                !(there == OP_JUMP || there == OP_LOOP ||
+                  (there == OP_JUMP_IF_FALSE &&
+                   instruction == OP_JUMP_IF_FALSE)))
+            {
+                break;
+            }
+
+            int next = resolve(code, code->instructions[target].target);
+            int distance = code->instructions[next].offset - from;
+            if (next == target || distance > UINT16_MAX ||
+                -distance > UINT16_MAX || (conditional && distance < 0))
+            {
+                break;
+            }
+            target = next;
+        }
+
+        if (target == resolve(code, code->instructions[i].target))
+            continue;
+        if (!conditional)
+        {
+            u8 direction =
+                code->instructions[target].offset < from ? OP_LOOP : OP_JUMP;
+            rewrite(code, i, direction, 0, 0, 3);
+        }
+        retarget(code, i, target);
+    }
+}
+
+static bool falls_through(u8 instruction)
+{
+    return instruction != OP_JUMP && instruction != OP_LOOP &&
+           instruction != OP_RETURN;
+}
+
+// Removes whatever no path from the entry reaches: code after a return, and
+// the POPs the branches above stopped landing on.
+static void drop_unreachable(Code* code)
+{
+    bool* reached = (bool*)calloc(code->count + 1, sizeof(bool));
+    int*  pending = (int*)malloc(sizeof(int) * (code->count + 1));
+    if (reached == NULL || pending == NULL)
+        exit(1);
+
+    int pending_count = 0;
+    pending[pending_count++] = resolve(code, 0);
+    reached[pending[0]] = true;
+    while (pending_count > 0)
+    {
+        int i = pending[--pending_count];
+        if (i == code->count)
+            continue;
+
+        u8  instruction = opcode(code, i);
+        int successors[2];
+        int successor_count = 0;
+        if (falls_through(instruction))
+            successors[successor_count++] = next_live(code, i);
+        if (is_jump(instruction))
+        {
+            successors[successor_count++] =
+                resolve(code, code->instructions[i].target);
+        }
+
+        for (int n = 0; n < successor_count; n++)
+        {
+            if (!reached[successors[n]])
+            {
+                reached[successors[n]] = true;
+                pending[pending_count++] = successors[n];
+            }
+        }
+    }
+
+    for (int i = 0; i < code->count; i++)
+    {
+        if (!code->instructions[i].removed && !reached[i])
+            remove_instruction(code, i);
+    }
+    free(pending);
+    free(reached);
+
+    // a jump to the very next instruction is left once the code it jumped
+    // over has gone
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        if (!code->instructions[i].removed && opcode(code, i) == OP_JUMP &&
+            resolve(code, code->instructions[i].target) == next_live(code, i))
+        {
+            remove_instruction(code, i);
+        }
+    }
+}
+
+// Fuses the sequences benchmarks/pairs.sh found hottest into the
+// superinstructions of chunk.h. No instruction but the first of a sequence
+// may be a jump target.
+static void fuse(Code* code)
+{
+    for (int i = 0; i < code->count; i = next_live(code, i))
+    {
+        if (code->instructions[i].removed)
+            continue;
+
+        int second = next_live(code, i);
+        int third = next_live(code, second);
+        u8  first_op = opcode(code, i);
+        u8  second_op = opcode(code, second);
+        if (second == code->count || code->jumps_to[second] > 0)
+            continue;
+
+        if (first_op == OP_GET_LOCAL && second_op == OP_CONSTANT &&
+            third < code->count && code->jumps_to[third] == 0)
+        {
+            u8 fused;
+            switch (opcode(code, third))
+            {
+            case OP_ADD:
+                fused = OP_ADD_LOCAL_CONSTANT;
+                break;
+            case OP_SUBSTRACT:
+                fused = OP_SUBSTRACT_LOCAL_CONSTANT;
+                break;
+            case OP_LESS:
+                fused = OP_LESS_LOCAL_CONSTANT;
+                break;
+            default:
+                continue;
+            }
+            rewrite(code, i, fused, operand(code, i, 1),
+                    operand(code, second, 1), 3);
+            remove_instruction(code, second);
+            remove_instruction(code, third);
+        }
+        else if ((first_op == OP_LESS || first_op == OP_EQUAL) &&
+                 second_op == OP_POP_JUMP_IF_FALSE)
+        {
+            rewrite(code, i,
+                    first_op == OP_LESS ? OP_LESS_JUMP_IF_FALSE
+                                        : OP_EQUAL_JUMP_IF_FALSE,
+                    0, 0, 3);
+            code->instructions[i].target = code->instructions[second].target;
+            code->jumps_to[resolve(code, code->instructions[i].target)]++;
+            remove_instruction(code, second);
+        }
+        else if (first_op == OP_SET_LOCAL && second_op == OP_POP)
+        {
+            rewrite(code, i, OP_SET_LOCAL_POP, operand(code, i, 1), 0, 2);
+            remove_instruction(code, second);
+        }
+        else if (first_op == OP_SET_GLOBAL && second_op == OP_POP)
+        {
+            rewrite(code, i, OP_SET_GLOBAL_POP, operand(code, i, 1),
+                    operand(code, i, 2), 3);
+            remove_instruction(code, second);
+        }
+    }
+}
+
+void optimize_chunk(Chunk* chunk)
+{
+    if (chunk->count == 0)
+        return;
+
+    Code code;
+    decode(&code, chunk);
+    pop_conditions(&code);
+    drop_pushes(&code);
+    thread_jumps(&code);
+    drop_unreachable(&code);
+    fuse(&code);
+    encode(&code);
+}
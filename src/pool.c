@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "pool.h"
+
+#define SIZE_CLASS(size) (((size) - 1) / POOL_GRANULE)
+
+typedef struct Block
+{
+    struct Block* next;
+} Block;
+
+typedef struct Slab
+{
+    struct Slab* next;
+    size_t       block_size;
+} Slab;
+
+// Each thread allocates from and frees to its own lists without locking.
+// Threads that only free, like the background sweeper, hand their lists
+// back to the shared depot with pool_flush().
+typedef struct
+{
+    Block* free[POOL_CLASSES];
+    Block* tail[POOL_CLASSES];
+    u64    allocations[POOL_CLASSES];
+    u64    frees[POOL_CLASSES];
+    u64    large_allocations;
+} PoolCache;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Block*          free[POOL_CLASSES];
+    Block*          tail[POOL_CLASSES];
+    Slab*           slabs;
+    u64             slab_count[POOL_CLASSES];
+    u64             allocations[POOL_CLASSES];
+    u64             frees[POOL_CLASSES];
+    u64             large_allocations;
+} PoolDepot;
+
+static __thread PoolCache cache;
+static PoolDepot          depot = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void refill(int size_class)
+{
+    pthread_mutex_lock(&depot.lock);
+
+    if (depot.free[size_class] != NULL)
+    {
+        cache.free[size_class] = depot.free[size_class];
+        cache.tail[size_class] = depot.tail[size_class];
+        depot.free[size_class] = NULL;
+        depot.tail[size_class] = NULL;
+        pthread_mutex_unlock(&depot.lock);
+        return;
+    }
+
+    size_t block_size = (size_t)(size_class + 1) * POOL_GRANULE;
+    Slab*  slab = (Slab*)checked_malloc(POOL_SLAB_SIZE);
+    slab->block_size = block_size;
+    slab->next = depot.slabs;
+    depot.slabs = slab;
+    depot.slab_count[size_class]++;
+    pthread_mutex_unlock(&depot.lock);
+
+    u8*    start = (u8*)slab + sizeof(Slab);
+    size_t count = (POOL_SLAB_SIZE - sizeof(Slab)) / block_size;
+    Block* head = NULL;
+    for (size_t i = count; i > 0; i--)
+    {
+        Block* block = (Block*)(start + (i - 1) * block_size);
+        block->next = head;
+        head = block;
+    }
+    cache.free[size_class] = head;
+    cache.tail[size_class] = (Block*)(start + (count - 1) * block_size);
+}
+
+void* pool_allocate(size_t size)
+{
+    if (size > POOL_MAX_SIZE)
+    {
+        cache.large_allocations++;
+        return checked_malloc(size);
+    }
+
+    int size_class = SIZE_CLASS(size);
+    if (cache.free[size_class] == NULL)
+        refill(size_class);
+
+    Block* block = cache.free[size_class];
+    cache.free[size_class] = block->next;
+    if (cache.free[size_class] == NULL)
+        cache.tail[size_class] = NULL;
+    cache.allocations[size_class]++;
+    return block;
+}
+
+void pool_free(void* pointer, size_t size)
+{
+    if (pointer == NULL)
+        return;
+
+    if (size > POOL_MAX_SIZE)
+    {
+        free(pointer);
+        return;
+    }
+
+    int    size_class = SIZE_CLASS(size);
+    Block* block = (Block*)pointer;
+    block->next = cache.free[size_class];
+    if (cache.free[size_class] == NULL)
+        cache.tail[size_class] = block;
+    cache.free[size_class] = block;
+    cache.frees[size_class]++;
+}
+
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size)
+{
+    if (new_size == 0)
+    {
+        pool_free(pointer, old_size);
+        return NULL;
+    }
+    if (pointer == NULL)
+        return pool_allocate(new_size);
+
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE)
+    {
+        void* result = realloc(pointer, new_size);
+        if (result == NULL)
+            exit(1);
+        return result;
+    }
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE &&
+        SIZE_CLASS(old_size) == SIZE_CLASS(new_size))
+        return pointer;
+
+    void* result = pool_allocate(new_size);
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    pool_free(pointer, old_size);
+    return result;
+}
+
+// Gives every block freed on this thread back to the depot in one go.
+void pool_flush()
+{
+    pthread_mutex_lock(&depot.lock);
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        if (cache.free[i] != NULL)
+        {
+            cache.tail[i]->next = depot.free[i];
+            if (depot.free[i] == NULL)
+                depot.tail[i] = cache.tail[i];
+            depot.free[i] = cache.free[i];
+            cache.free[i] = NULL;
+            cache.tail[i] = NULL;
+        }
+        depot.allocations[i] += cache.allocations[i];
+        depot.frees[i] += cache.frees[i];
+        cache.allocations[i] = 0;
+        cache.frees[i] = 0;
+    }
+    depot.large_allocations += cache.large_allocations;
+    cache.large_allocations = 0;
+    pthread_mutex_unlock(&depot.lock);
+}
+
+void free_pools()
+{
+    Slab* slab = depot.slabs;
+    while (slab != NULL)
+    {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    depot.slabs = NULL;
+
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        depot.free[i] = NULL;
+        depot.tail[i] = NULL;
+        cache.free[i] = NULL;
+        cache.tail[i] = NULL;
+    }
+}
+
+void print_pool_stats()
+{
+    fprintf(stderr, "%6s %12s %12s %10s %6s\n", "size", "allocs", "frees",
+            "live", "slabs");
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        u64 allocations = depot.allocations[i] + cache.allocations[i];
+        u64 frees = depot.frees[i] + cache.frees[i];
+        if (allocations == 0 && frees == 0)
+            continue;
+
+        fprintf(stderr, "%6d %12llu %12llu %10lld %6llu\n",
+                (i + 1) * POOL_GRANULE, (unsigned long long)allocations,
+                (unsigned long long)frees,
+                (long long)allocations - (long long)frees,
+                (unsigned long long)depot.slab_count[i]);
+    }
+    fprintf(stderr, "%6s %12llu\n", ">128",
+            (unsigned long long)(depot.large_allocations +
+                                 cache.large_allocations));
+}
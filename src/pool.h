@@ -0,0 +1,21 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+// Small blocks are served from per-size-class free lists carved out of
+// slabs. Object headers in object.h are all a few words long, so 8-byte
+// classes up to POOL_MAX_SIZE give every one of them an exact fit.
+#define POOL_GRANULE 8
+#define POOL_MAX_SIZE 128
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+void* pool_allocate(size_t size);
+void  pool_free(void* pointer, size_t size);
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size);
+void  pool_flush();
+void  free_pools();
+void  print_pool_stats();
+
+#endif
@@ -0,0 +1,204 @@
+// sigaction and setitimer are not C99
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "func_table.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+// The SIGPROF handler walks vm.frames and counts the stack it finds in
+// tables set aside up front, so it never allocates or calls anything that
+// is not async-signal-safe. Functions are told apart by their code array,
+// which stays put while they live. Frames of code the JIT compiled report
+// the line of the last instruction that handed control to the VM.
+
+#define PROFILE_MAX_FUNCTIONS 2048  // a power of two
+#define PROFILE_MAX_STACKS 8192     // a power of two
+#define PROFILE_MAX_FRAMES (1 << 18)
+
+typedef struct
+{
+    int function;  // into profiler.functions.entries
+    int line;      // 0 for the pseudo frames
+} ProfiledFrame;
+
+typedef struct
+{
+    u32 hash;
+    int depth;
+    int first;  // into profiler.frames
+    u64 count;  // 0 for a free slot
+} ProfiledStack;
+
+static struct
+{
+    const char*   path;
+    bool          running;
+    FuncTable     functions;  // fixed, keyed by code array
+    ProfiledStack stacks[PROFILE_MAX_STACKS];
+    int           stack_count;
+    ProfiledFrame frames[PROFILE_MAX_FRAMES];
+    int           frame_count;
+    ProfiledFrame sample[FRAMES_MAX + 1];
+    u64           dropped;
+} profiler;
+
+// pseudo functions, for samples outside Lox code
+static u8 gc_marker;
+static u8 vm_marker;
+
+static int intern_function(u8* code, const char* name, int length)
+{
+    FuncEntry* entry =
+        func_table_find(&profiler.functions, code, name, length, 0);
+    return entry == NULL ? -1 : (int)(entry - profiler.functions.entries);
+}
+
+static bool count_stack(int depth)
+{
+    u32 hash = 2166136261u;
+    for (int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (u32)profiler.sample[i].function) * 16777619u;
+        hash = (hash ^ (u32)profiler.sample[i].line) * 16777619u;
+    }
+
+    u32 index = hash & (PROFILE_MAX_STACKS - 1);
+    for (;;)
+    {
+        ProfiledStack* stack = &profiler.stacks[index];
+        if (stack->count == 0)
+        {
+            if (profiler.stack_count == PROFILE_MAX_STACKS * 3 / 4 ||
+                profiler.frame_count + depth > PROFILE_MAX_FRAMES)
+                return false;
+            profiler.stack_count++;
+            memcpy(profiler.frames + profiler.frame_count, profiler.sample,
+                   sizeof(ProfiledFrame) * depth);
+            *stack = (ProfiledStack){.hash = hash,
+                                     .depth = depth,
+                                     .first = profiler.frame_count,
+                                     .count = 1};
+            profiler.frame_count += depth;
+            return true;
+        }
+        if (stack->hash == hash && stack->depth == depth &&
+            memcmp(profiler.frames + stack->first, profiler.sample,
+                   sizeof(ProfiledFrame) * depth) == 0)
+        {
+            stack->count++;
+            return true;
+        }
+        index = (index + 1) & (PROFILE_MAX_STACKS - 1);
+    }
+}
+
+static void take_sample(int signal)
+{
+    int depth = 0;
+    for (int i = 0; i < vm.frame_count; i++)
+    {
+        CallFrame*   frame = &vm.frames[i];
+        ObjFunction* function = frame->closure->function;
+        Chunk*       chunk = &function->chunk;
+
+        int index = function->name == NULL
+                        ? intern_function(chunk->code, "script", 6)
+                        : intern_function(chunk->code, function->name->chars,
+                                          function->name->length);
+        if (index < 0)
+        {
+            profiler.dropped++;
+            return;
+        }
+        profiler.sample[depth++] =
+            (ProfiledFrame){.function = index, .line = frame_line(frame)};
+    }
+    if (vm.collecting || depth == 0)
+    {
+        // the collector's time on top of the stack that allocated, and time
+        // outside any frame, compiling or starting up, on its own
+        int index = vm.collecting ? intern_function(&gc_marker, "[gc]", 4)
+                                  : intern_function(&vm_marker, "[vm]", 4);
+        if (index < 0)
+        {
+            profiler.dropped++;
+            return;
+        }
+        profiler.sample[depth++] = (ProfiledFrame){.function = index};
+    }
+    if (!count_stack(depth))
+        profiler.dropped++;
+}
+
+static void write_profile()
+{
+    FILE* out = fopen(profiler.path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not write profile %s \n", profiler.path);
+        return;
+    }
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++)
+    {
+        ProfiledStack* stack = &profiler.stacks[i];
+        if (stack->count == 0)
+            continue;
+        for (int j = 0; j < stack->depth; j++)
+        {
+            ProfiledFrame* frame = &profiler.frames[stack->first + j];
+            fputs(profiler.functions.entries[frame->function].name, out);
+            if (frame->line != 0)
+                fprintf(out, ":%d", frame->line);
+            fputc(j == stack->depth - 1 ? ' ' : ';', out);
+        }
+        fprintf(out, "%llu\n", (unsigned long long)stack->count);
+    }
+    fclose(out);
+    if (profiler.dropped > 0)
+        fprintf(stderr, "profile: %llu samples dropped, tables full\n",
+                (unsigned long long)profiler.dropped);
+}
+
+void profiler_start(const char* path)
+{
+    profiler.path = path;
+    profiler.running = true;
+    init_func_table(&profiler.functions, PROFILE_MAX_FUNCTIONS, true);
+    atexit(profiler_stop);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Called once the program is done and again at exit, which is how a run
+// that stopped on an error gets its profile written.
+void profiler_stop()
+{
+    if (!profiler.running)
+        return;
+    profiler.running = false;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    write_profile();
+    free_func_table(&profiler.functions);
+}
@@ -0,0 +1,24 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+
+// Samples per second of CPU time.
+#define PROFILE_HZ 100
+
+// Keeps the compiler from moving stores across it, for state the sampling
+// signal handler reads.
+#if defined(__GNUC__)
+#define SIGNAL_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#else
+#define SIGNAL_FENCE() ((void)0)
+#endif
+
+// --profile=<path>: samples the Lox call stack on SIGPROF until
+// profiler_stop(), which writes the samples to path as folded stacks, one
+// "script:12;outer:4;inner:7 <samples>" line per distinct stack with the
+// line each frame is at. flamegraph.pl and speedscope read the format.
+void profiler_start(const char* path);
+void profiler_stop();
+
+#endif
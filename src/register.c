@@ -0,0 +1,742 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "register.h"
+
+// The register code is translated from the finished stack code, one stack
+// instruction at a time, while a model of the stack tracks where each
+// value lives. Loads of locals and constants are not emitted when pushed:
+// the model remembers them, and the instruction that consumes the value
+// names the local's register or the constant directly. That turns
+// GET_LOCAL, GET_LOCAL, ADD, SET_LOCAL, POP into a single ADD. The model
+// is written back to the registers (flushed) wherever another path or
+// another frame may look at them: jumps and their targets, calls, closures
+// and returns.
+typedef enum
+{
+    VALUE_REGISTER,  // in the register of its own stack position
+    VALUE_COPY,      // equal to register index, not copied yet
+    VALUE_CONSTANT,  // constant index, not loaded yet
+    VALUE_NIL,
+    VALUE_TRUE,
+    VALUE_FALSE,
+} ValueKind;
+
+typedef struct
+{
+    ValueKind kind;
+    int       index;
+} StackValue;
+
+typedef struct
+{
+    int operand;  // offset of the two offset bytes in the register code
+    int target;   // stack code offset jumped to
+} Patch;
+
+typedef struct
+{
+    ObjFunction* function;
+    Chunk*       in;
+    Chunk        out;
+    int*         depths;     // stack depth before each instruction, or -1
+    bool*        is_label;
+    int*         offsets;    // register code offset of each instruction
+    StackValue*  stack;
+    int          count;
+    int          line;
+    int          last;       // offset of the latest instruction emitted
+    int          last_dst;   // register it wrote, -1 if it may not be moved
+    Patch*       patches;
+    int          patch_count;
+    bool         failed;
+} Translator;
+
+static int read_operand(Chunk* chunk, int offset, int width)
+{
+    int operand = 0;
+    for (int i = 1; i <= width; i++)
+        operand = (operand << 8) | chunk->code[offset + i];
+    return operand;
+}
+
+static int stack_effect(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBSTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+        return -1;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        return -2;
+    case OP_CALL:
+        return -chunk->code[offset + 1];
+    default:
+        return 0;
+    }
+}
+
+static bool is_jump(u8 instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+           instruction == OP_POP_JUMP_IF_FALSE || instruction == OP_LOOP ||
+           instruction == OP_LESS_JUMP_IF_FALSE ||
+           instruction == OP_EQUAL_JUMP_IF_FALSE;
+}
+
+static int jump_target(Chunk* chunk, int offset)
+{
+    int jump = read_operand(chunk, offset, 2);
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump
+                                          : offset + 3 + jump;
+}
+
+static bool falls_through(u8 instruction)
+{
+    return instruction != OP_JUMP && instruction != OP_LOOP &&
+           instruction != OP_RETURN;
+}
+
+// Finds the stack depth before every reachable instruction and the deepest
+// the stack gets, which is the number of registers needed.
+static int find_depths(Translator* t)
+{
+    Chunk* in = t->in;
+    int*   pending = (int*)malloc(sizeof(int) * in->count);
+    if (pending == NULL)
+        exit(1);
+
+    int pending_count = 0;
+    int max_depth = t->function->arity + 1;
+    t->depths[0] = max_depth;
+    pending[pending_count++] = 0;
+    while (pending_count > 0 && !t->failed)
+    {
+        int offset = pending[--pending_count];
+        u8  instruction = in->code[offset];
+        int after = t->depths[offset] + stack_effect(in, offset);
+        // the fused local-constant forms briefly hold both operands
+        int peak = t->depths[offset] + 2;
+        if (peak > max_depth)
+            max_depth = peak;
+
+        int successors[2];
+        int successor_count = 0;
+        if (falls_through(instruction))
+            successors[successor_count++] =
+                offset + instruction_length(in, offset);
+        if (is_jump(instruction))
+        {
+            successors[successor_count++] = jump_target(in, offset);
+            t->is_label[jump_target(in, offset)] = true;
+        }
+
+        for (int i = 0; i < successor_count; i++)
+        {
+            int next = successors[i];
+            if (next >= in->count || (t->depths[next] != -1 &&
+                                      t->depths[next] != after))
+            {
+                t->failed = true;
+            }
+            else if (t->depths[next] == -1)
+            {
+                t->depths[next] = after;
+                pending[pending_count++] = next;
+            }
+        }
+    }
+    free(pending);
+    return max_depth;
+}
+
+// ---------------------- emitting --------------------------
+
+static void emit_byte(Translator* t, u8 byte)
+{
+    write_chunk(&t->out, byte, t->line);
+}
+
+static void emit_op(Translator* t, u8 op)
+{
+    t->last = t->out.count;
+    t->last_dst = -1;
+    emit_byte(t, op);
+}
+
+static void emit_short(Translator* t, int operand)
+{
+    if (operand > UINT16_MAX)
+        t->failed = true;
+    emit_byte(t, (operand >> 8) & 0xff);
+    emit_byte(t, operand & 0xff);
+}
+
+// Emits an instruction writing register a, with the operands that follow a
+// still to be emitted by the caller.
+static void emit_producer(Translator* t, u8 op, int a)
+{
+    emit_op(t, op);
+    emit_byte(t, (u8)a);
+    t->last_dst = a;
+}
+
+static void emit_jump(Translator* t, int target)
+{
+    Patch patch = {.operand = t->out.count, .target = target};
+    t->patches = (Patch*)realloc(t->patches,
+                                 sizeof(Patch) * (t->patch_count + 1));
+    if (t->patches == NULL)
+        exit(1);
+    t->patches[t->patch_count++] = patch;
+    emit_byte(t, 0xff);
+    emit_byte(t, 0xff);
+}
+
+// ---------------------- the stack model --------------------------
+
+static void push_value(Translator* t, ValueKind kind, int index)
+{
+    t->stack[t->count++] = (StackValue){.kind = kind, .index = index};
+}
+
+// The value register i holds, as seen by a GET_LOCAL of it.
+static StackValue read_register(Translator* t, int i)
+{
+    if (t->stack[i].kind == VALUE_REGISTER)
+        return (StackValue){.kind = VALUE_COPY, .index = i};
+    return t->stack[i];
+}
+
+static void materialize(Translator* t, int i)
+{
+    StackValue* value = &t->stack[i];
+    switch (value->kind)
+    {
+    case VALUE_REGISTER:
+        return;
+    case VALUE_COPY:
+        emit_producer(t, REG_MOVE, i);
+        emit_byte(t, (u8)value->index);
+        break;
+    case VALUE_CONSTANT:
+        emit_producer(t, REG_LOADK, i);
+        emit_short(t, value->index);
+        break;
+    case VALUE_NIL:
+        emit_producer(t, REG_LOADNIL, i);
+        break;
+    case VALUE_TRUE:
+        emit_producer(t, REG_LOADTRUE, i);
+        break;
+    case VALUE_FALSE:
+        emit_producer(t, REG_LOADFALSE, i);
+        break;
+    }
+    value->kind = VALUE_REGISTER;
+}
+
+static void flush(Translator* t, int count)
+{
+    for (int i = 0; i < count; i++)
+        materialize(t, i);
+}
+
+// Register holding the value at stack position i, loading it if needed.
+static int operand_register(Translator* t, int i)
+{
+    StackValue value = t->stack[i];
+    if (value.kind == VALUE_COPY)
+        return value.index;
+    materialize(t, i);
+    return i;
+}
+
+// Index of a binary stack opcode in the REG_ADD ... REG_LESS group.
+static int binary_index(u8 instruction)
+{
+    switch (instruction)
+    {
+    case OP_ADD:
+        return 0;
+    case OP_SUBSTRACT:
+        return 1;
+    case OP_MULTIPLY:
+        return 2;
+    case OP_DIVIDE:
+        return 3;
+    case OP_EQUAL:
+        return 4;
+    case OP_NOT_EQUAL:
+        return 5;
+    case OP_GREATER:
+        return 6;
+    default:
+        return 7;
+    }
+}
+
+static void binary(Translator* t, int index)
+{
+    int        a = t->count - 2;
+    StackValue right = t->stack[t->count - 1];
+    int        b = operand_register(t, a);
+
+    if (right.kind == VALUE_CONSTANT && right.index <= UINT8_MAX)
+    {
+        emit_producer(t, REG_ADD_K + index, a);
+        emit_byte(t, (u8)b);
+        emit_byte(t, (u8)right.index);
+    }
+    else
+    {
+        int c = operand_register(t, t->count - 1);
+        emit_producer(t, REG_ADD + index, a);
+        emit_byte(t, (u8)b);
+        emit_byte(t, (u8)c);
+    }
+    t->count--;
+    t->stack[a] = (StackValue){.kind = VALUE_REGISTER, .index = a};
+}
+
+static void unary(Translator* t, u8 op)
+{
+    int a = t->count - 1;
+    int b = operand_register(t, a);
+    emit_producer(t, op, a);
+    emit_byte(t, (u8)b);
+    t->stack[a].kind = VALUE_REGISTER;
+}
+
+// SET_LOCAL: the local takes the value on top, which stays there.
+static void set_local(Translator* t, int slot)
+{
+    int        top = t->count - 1;
+    StackValue value = t->stack[top];
+    if (value.kind == VALUE_COPY && value.index == slot)
+        return;
+
+    // values still reading the local's register need its old content
+    bool emitted = false;
+    for (int i = 0; i < t->count; i++)
+    {
+        if (t->stack[i].kind == VALUE_COPY && t->stack[i].index == slot)
+        {
+            materialize(t, i);
+            emitted = true;
+        }
+    }
+
+    if (value.kind != VALUE_REGISTER)
+    {
+        t->stack[slot] = value;
+        return;
+    }
+
+    if (!emitted && t->last_dst == top)
+    {
+        // the instruction computing the value writes the local instead
+        t->out.code[t->last + 1] = (u8)slot;
+        t->last_dst = slot;
+        t->stack[top] = (StackValue){.kind = VALUE_COPY, .index = slot};
+    }
+    else
+    {
+        emit_producer(t, REG_MOVE, slot);
+        emit_byte(t, (u8)top);
+    }
+    t->stack[slot] = (StackValue){.kind = VALUE_REGISTER, .index = slot};
+}
+
+static void global(Translator* t, u8 op, int slot)
+{
+    int a = op == REG_GET_GLOBAL ? t->count : operand_register(t, t->count - 1);
+    if (op == REG_GET_GLOBAL)
+    {
+        emit_producer(t, op, a);
+        push_value(t, VALUE_REGISTER, a);
+    }
+    else
+    {
+        emit_op(t, op);
+        emit_byte(t, (u8)a);
+    }
+    emit_short(t, slot);
+}
+
+// POP_JUMP_IF_FALSE, folded into the comparison computing the condition
+// when there is one right before it.
+static void pop_jump_if_false(Translator* t, int target)
+{
+    int top = t->count - 1;
+    flush(t, t->count);
+
+    u8 last = t->last_dst == top ? t->out.code[t->last] : REG_JUMP;
+    if (last >= REG_EQUAL && last <= REG_LESS_K &&
+        (last <= REG_LESS || last >= REG_EQUAL_K))
+    {
+        u8 b = t->out.code[t->last + 2];
+        u8 c = t->out.code[t->last + 3];
+        u8 op = last <= REG_LESS
+                    ? REG_EQUAL_JUMP_IF_FALSE + (last - REG_EQUAL)
+                    : REG_EQUAL_K_JUMP_IF_FALSE + (last - REG_EQUAL_K);
+        t->out.count = t->last;
+        emit_op(t, op);
+        emit_byte(t, b);
+        emit_byte(t, c);
+    }
+    else
+    {
+        emit_op(t, REG_JUMP_IF_FALSE);
+        emit_byte(t, (u8)top);
+    }
+    emit_jump(t, target);
+    t->count--;
+}
+
+static void closure(Translator* t, int offset, bool is_long)
+{
+    Chunk* in = t->in;
+    int    constant = read_operand(in, offset, is_long ? 3 : 1);
+    int    upvalue_count = AS_FUNCTION(in->constants.values[constant])
+                            ->upvalue_count;
+    int    at = offset + (is_long ? 4 : 2);
+
+    flush(t, t->count);
+    emit_op(t, REG_CLOSURE);
+    emit_byte(t, (u8)t->count);
+    emit_short(t, constant);
+    for (int i = 0; i < upvalue_count; i++)
+    {
+        int index = read_operand(in, at, is_long ? 3 : 1);
+        if (index > UINT8_MAX)
+            t->failed = true;
+        emit_byte(t, in->code[at]);
+        emit_byte(t, (u8)index);
+        at += is_long ? 4 : 2;
+    }
+    push_value(t, VALUE_REGISTER, t->count);
+}
+
+static void translate(Translator* t, int offset)
+{
+    Chunk* in = t->in;
+    u8     instruction = in->code[offset];
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        push_value(t, VALUE_CONSTANT, read_operand(in, offset, 1));
+        break;
+    case OP_CONSTANT_LONG:
+        push_value(t, VALUE_CONSTANT, read_operand(in, offset, 3));
+        break;
+    case OP_NIL:
+        push_value(t, VALUE_NIL, 0);
+        break;
+    case OP_TRUE:
+        push_value(t, VALUE_TRUE, 0);
+        break;
+    case OP_FALSE:
+        push_value(t, VALUE_FALSE, 0);
+        break;
+    case OP_POP:
+        t->count--;
+        break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    {
+        int slot = read_operand(in, offset, instruction == OP_GET_LOCAL ? 1 : 3);
+        t->stack[t->count++] = read_register(t, slot);
+        break;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+        set_local(t, read_operand(in, offset, instruction == OP_SET_LOCAL ? 1 : 3));
+        break;
+    case OP_SET_LOCAL_POP:
+        set_local(t, read_operand(in, offset, 1));
+        t->count--;
+        break;
+    case OP_GET_GLOBAL:
+        global(t, REG_GET_GLOBAL, read_operand(in, offset, 2));
+        break;
+    case OP_GET_GLOBAL_LONG:
+        global(t, REG_GET_GLOBAL, read_operand(in, offset, 3));
+        break;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+        global(t, REG_DEFINE_GLOBAL,
+               read_operand(in, offset, instruction == OP_DEFINE_GLOBAL ? 2 : 3));
+        t->count--;
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+        global(t, REG_SET_GLOBAL,
+               read_operand(in, offset, instruction == OP_SET_GLOBAL ? 2 : 3));
+        break;
+    case OP_SET_GLOBAL_POP:
+        global(t, REG_SET_GLOBAL, read_operand(in, offset, 2));
+        t->count--;
+        break;
+    case OP_GET_UPVALUE:
+        emit_producer(t, REG_GET_UPVALUE, t->count);
+        emit_byte(t, in->code[offset + 1]);
+        push_value(t, VALUE_REGISTER, t->count);
+        break;
+    case OP_SET_UPVALUE:
+    {
+        int a = operand_register(t, t->count - 1);
+        emit_op(t, REG_SET_UPVALUE);
+        emit_byte(t, (u8)a);
+        emit_byte(t, in->code[offset + 1]);
+        break;
+    }
+    case OP_ADD:
+    case OP_SUBSTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+        binary(t, binary_index(instruction));
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        t->stack[t->count++] = read_register(t, in->code[offset + 1]);
+        push_value(t, VALUE_CONSTANT, in->code[offset + 2]);
+        binary(t, instruction == OP_ADD_LOCAL_CONSTANT ? 0
+                  : instruction == OP_SUBSTRACT_LOCAL_CONSTANT ? 1
+                                                               : 7);
+        break;
+    case OP_NOT:
+        unary(t, REG_NOT);
+        break;
+    case OP_NEGATE:
+        unary(t, REG_NEGATE);
+        break;
+    case OP_PRINT:
+    {
+        int a = operand_register(t, t->count - 1);
+        emit_op(t, REG_PRINT);
+        emit_byte(t, (u8)a);
+        t->count--;
+        break;
+    }
+    case OP_JUMP:
+        flush(t, t->count);
+        emit_op(t, REG_JUMP);
+        emit_jump(t, jump_target(in, offset));
+        break;
+    case OP_LOOP:
+    {
+        flush(t, t->count);
+        int jump = t->out.count + 3 - t->offsets[jump_target(in, offset)];
+        emit_op(t, REG_LOOP);
+        emit_short(t, jump);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+        flush(t, t->count);
+        emit_op(t, REG_JUMP_IF_FALSE);
+        emit_byte(t, (u8)(t->count - 1));
+        emit_jump(t, jump_target(in, offset));
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        pop_jump_if_false(t, jump_target(in, offset));
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        binary(t, instruction == OP_LESS_JUMP_IF_FALSE ? 7 : 4);
+        pop_jump_if_false(t, jump_target(in, offset));
+        break;
+    case OP_CALL:
+    {
+        int arg_count = in->code[offset + 1];
+        flush(t, t->count);
+        t->count -= arg_count;
+        emit_op(t, REG_CALL);
+        emit_byte(t, (u8)(t->count - 1));
+        emit_byte(t, (u8)arg_count);
+        break;
+    }
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+        closure(t, offset, instruction == OP_CLOSURE_LONG);
+        break;
+    case OP_CLOSE_UPVALUE:
+        flush(t, t->count);
+        emit_op(t, REG_CLOSE_UPVALUE);
+        emit_byte(t, (u8)(t->count - 1));
+        t->count--;
+        break;
+    case OP_RETURN:
+    {
+        // the frame's captured locals are closed over on the way out
+        flush(t, t->count - 1);
+        int a = operand_register(t, t->count - 1);
+        emit_op(t, REG_RETURN);
+        emit_byte(t, (u8)a);
+        break;
+    }
+    default:
+        t->failed = true;
+        break;
+    }
+}
+
+bool compile_registers(ObjFunction* function)
+{
+    Chunk*     in = &function->chunk;
+    Translator t = {.function = function, .in = in, .last = 0,
+                    .last_dst = -1};
+    init_chunk(&t.out);
+    t.depths = (int*)malloc(sizeof(int) * (in->count + 1));
+    t.is_label = (bool*)calloc(in->count + 1, sizeof(bool));
+    t.offsets = (int*)malloc(sizeof(int) * (in->count + 1));
+    if (t.depths == NULL || t.is_label == NULL || t.offsets == NULL)
+        exit(1);
+    for (int i = 0; i <= in->count; i++)
+        t.depths[i] = -1;
+
+    int register_count = find_depths(&t);
+    if (register_count > UINT8_COUNT)
+        t.failed = true;
+    t.stack = (StackValue*)malloc(sizeof(StackValue) * register_count);
+    if (t.stack == NULL)
+        exit(1);
+    t.count = function->arity + 1;
+    for (int i = 0; i < t.count; i++)
+        t.stack[i] = (StackValue){.kind = VALUE_REGISTER, .index = i};
+
+    bool reachable = true;
+    for (int offset = 0; offset < in->count && !t.failed;
+         offset += instruction_length(in, offset))
+    {
+        if (t.depths[offset] == -1)
+        {
+            reachable = false;
+            continue;
+        }
+        if (t.is_label[offset])
+        {
+            // every path into a jump target leaves all values in registers
+            if (reachable)
+                flush(&t, t.count);
+            t.count = t.depths[offset];
+            for (int i = 0; i < t.count; i++)
+                t.stack[i] = (StackValue){.kind = VALUE_REGISTER, .index = i};
+            t.last_dst = -1;
+        }
+        t.line = in->lines[offset];
+        t.offsets[offset] = t.out.count;
+        translate(&t, offset);
+        reachable = falls_through(in->code[offset]);
+    }
+
+    for (int i = 0; i < t.patch_count && !t.failed; i++)
+    {
+        Patch* patch = &t.patches[i];
+        int    jump = t.offsets[patch->target] - (patch->operand + 2);
+        if (jump > UINT16_MAX)
+            t.failed = true;
+        t.out.code[patch->operand] = (jump >> 8) & 0xff;
+        t.out.code[patch->operand + 1] = jump & 0xff;
+    }
+
+    free(t.depths);
+    free(t.is_label);
+    free(t.offsets);
+    free(t.stack);
+    free(t.patches);
+    if (t.failed)
+    {
+        FREE_ARRAY(u8, t.out.code, t.out.capacity);
+        FREE_ARRAY(int, t.out.lines, t.out.capacity);
+        return false;
+    }
+
+    FREE_ARRAY(u8, in->code, in->capacity);
+    FREE_ARRAY(int, in->lines, in->capacity);
+    in->code = t.out.code;
+    in->lines = t.out.lines;
+    in->count = t.out.count;
+    in->capacity = t.out.capacity;
+    // one spare slot for the value helpers like intern_string() push
+    function->slot_count = register_count + 1;
+    return true;
+}
+
+int register_instruction_length(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case REG_LOADNIL:
+    case REG_LOADTRUE:
+    case REG_LOADFALSE:
+    case REG_PRINT:
+    case REG_CLOSE_UPVALUE:
+    case REG_RETURN:
+        return 2;
+    case REG_MOVE:
+    case REG_GET_UPVALUE:
+    case REG_SET_UPVALUE:
+    case REG_NOT:
+    case REG_NEGATE:
+    case REG_JUMP:
+    case REG_LOOP:
+    case REG_CALL:
+        return 3;
+    case REG_EQUAL_JUMP_IF_FALSE:
+    case REG_NOT_EQUAL_JUMP_IF_FALSE:
+    case REG_GREATER_JUMP_IF_FALSE:
+    case REG_LESS_JUMP_IF_FALSE:
+    case REG_EQUAL_K_JUMP_IF_FALSE:
+    case REG_NOT_EQUAL_K_JUMP_IF_FALSE:
+    case REG_GREATER_K_JUMP_IF_FALSE:
+    case REG_LESS_K_JUMP_IF_FALSE:
+        return 5;
+    case REG_CLOSURE:
+    {
+        int          constant = read_operand(chunk, offset + 1, 2);
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        return 4 + 2 * function->upvalue_count;
+    }
+    default:
+        return 4;
+    }
+}
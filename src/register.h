@@ -0,0 +1,73 @@
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "object.h"
+
+// Register instruction set, used instead of the stack one with --registers.
+// A register is a slot of the frame, numbered like the stack position the
+// stack VM would have pushed the value to, so frames, calls and upvalues
+// keep the stack VM's layout. a, b and c are one-byte registers, k a
+// constant and g a global slot; k and g take two bytes, except in the _K
+// forms where k is a one-byte constant standing in for c.
+typedef enum
+{
+    REG_LOADK,          // a k      r[a] = k
+    REG_LOADNIL,        // a
+    REG_LOADTRUE,       // a
+    REG_LOADFALSE,      // a
+    REG_MOVE,           // a b      r[a] = r[b]
+    REG_GET_GLOBAL,     // a g
+    REG_DEFINE_GLOBAL,  // a g
+    REG_SET_GLOBAL,     // a g
+    REG_GET_UPVALUE,    // a u
+    REG_SET_UPVALUE,    // a u
+
+    // r[a] = r[b] op r[c], in the order binary_index() relies on
+    REG_ADD,
+    REG_SUBSTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_EQUAL,
+    REG_NOT_EQUAL,
+    REG_GREATER,
+    REG_LESS,
+    // r[a] = r[b] op k
+    REG_ADD_K,
+    REG_SUBSTRACT_K,
+    REG_MULTIPLY_K,
+    REG_DIVIDE_K,
+    REG_EQUAL_K,
+    REG_NOT_EQUAL_K,
+    REG_GREATER_K,
+    REG_LESS_K,
+    // jump by offset unless r[b] op r[c], then unless r[b] op k
+    REG_EQUAL_JUMP_IF_FALSE,
+    REG_NOT_EQUAL_JUMP_IF_FALSE,
+    REG_GREATER_JUMP_IF_FALSE,
+    REG_LESS_JUMP_IF_FALSE,
+    REG_EQUAL_K_JUMP_IF_FALSE,
+    REG_NOT_EQUAL_K_JUMP_IF_FALSE,
+    REG_GREATER_K_JUMP_IF_FALSE,
+    REG_LESS_K_JUMP_IF_FALSE,
+
+    REG_NOT,            // a b
+    REG_NEGATE,         // a b
+    REG_PRINT,          // a
+    REG_JUMP,           // offset
+    REG_LOOP,           // offset
+    REG_JUMP_IF_FALSE,  // a offset
+    REG_CALL,           // a n      r[a] = r[a](r[a + 1] ... r[a + n])
+    REG_CLOSURE,        // a k, then an (is_local, index) pair per upvalue
+    REG_CLOSE_UPVALUE,  // a        close the upvalues of r[a] and above
+    REG_RETURN,         // a
+} RegisterOp;
+
+// Replaces the stack code of a finished function with register code and
+// sets its slot_count to the registers it uses. Returns false, and leaves
+// the stack code alone, when the function needs more registers, constants
+// or globals than the operands can name; the VM runs such a function on
+// the stack and calls between the two kinds of code.
+bool compile_registers(ObjFunction* function);
+int  register_instruction_length(Chunk* chunk, int offset);
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "func_table.h"
+#include "stats.h"
+
+// Branches are told apart by where the next instruction starts: not taken
+// when it is the one right after the branch. Calls by the frame count going
+// up between two instructions, which catches every call since a callee
+// runs at least its RETURN. Both only look at what run() is about to do,
+// so the opcode handlers stay as they are.
+
+static struct
+{
+    u64       opcodes[UINT8_COUNT];
+    u64       taken[UINT8_COUNT];
+    u64       not_taken[UINT8_COUNT];
+    u8*       previous;     // ip of the last instruction counted
+    int       frame_count;  // vm.frame_count when it was
+    u8        branch;       // the last one, while it is a branch
+    u8*       fallthrough;  // where that branch goes when not taken
+    FuncTable functions;    // calls, keyed by function and first line
+} stats;
+
+static void print_stats();
+
+void stats_start()
+{
+    vm.collect_stats = true;
+    vm.jit_enabled = false;
+    atexit(print_stats);
+}
+
+static void count_call(ObjFunction* function)
+{
+    Chunk*     chunk = &function->chunk;
+    int        line = chunk->count > 0 ? chunk->lines[0] : 0;
+    FuncEntry* entry =
+        function->name == NULL
+            ? func_table_find(&stats.functions, function, "script", 6, line)
+            : func_table_find(&stats.functions, function,
+                              function->name->chars, function->name->length,
+                              line);
+    entry->count++;
+}
+
+void stats_count(CallFrame* frame)
+{
+    // run() dispatches a quickened instruction it had to take back once
+    // more, as the generic one
+    if (frame->ip == stats.previous && vm.frame_count == stats.frame_count)
+        return;
+
+    if (stats.fallthrough != NULL)
+    {
+        if (frame->ip == stats.fallthrough)
+            stats.not_taken[stats.branch]++;
+        else
+            stats.taken[stats.branch]++;
+        stats.fallthrough = NULL;
+    }
+    if (vm.frame_count > stats.frame_count)
+        count_call(frame->closure->function);
+
+    Chunk* chunk = &frame->closure->function->chunk;
+    int    offset = (int)(frame->ip - chunk->code);
+    u8     opcode = *frame->ip;
+    stats.opcodes[opcode]++;
+    switch (generic_opcode(opcode))
+    {
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        stats.branch = opcode;
+        stats.fallthrough = frame->ip + instruction_length(chunk, offset);
+        break;
+    default:
+        break;
+    }
+    stats.previous = frame->ip;
+    stats.frame_count = vm.frame_count;
+}
+
+static int compare_opcodes(const void* a, const void* b)
+{
+    u64 first = stats.opcodes[*(const u8*)a];
+    u64 second = stats.opcodes[*(const u8*)b];
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static int compare_functions(const void* a, const void* b)
+{
+    u64 first = ((const FuncEntry*)a)->count;
+    u64 second = ((const FuncEntry*)b)->count;
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static void print_stats()
+{
+    u8  order[UINT8_COUNT];
+    u64 total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        order[i] = (u8)i;
+        total += stats.opcodes[i];
+    }
+    qsort(order, UINT8_COUNT, sizeof(u8), compare_opcodes);
+
+    fprintf(stderr, "opcodes: %llu executed\n", (unsigned long long)total);
+    for (int i = 0; i < UINT8_COUNT && stats.opcodes[order[i]] > 0; i++)
+    {
+        fprintf(stderr, "  %-32s %12llu %6.2f%%\n", opcode_name(order[i]),
+                (unsigned long long)stats.opcodes[order[i]],
+                100.0 * stats.opcodes[order[i]] / total);
+    }
+
+    fprintf(stderr, "branches: %28s %12s\n", "taken", "not taken");
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        u8 opcode = order[i];
+        if (stats.taken[opcode] + stats.not_taken[opcode] == 0)
+            continue;
+        fprintf(stderr, "  %-32s %12llu %12llu\n", opcode_name(opcode),
+                (unsigned long long)stats.taken[opcode],
+                (unsigned long long)stats.not_taken[opcode]);
+    }
+
+    int count = func_table_sort(&stats.functions, compare_functions);
+    fprintf(stderr, "calls:\n");
+    for (int i = 0; i < count; i++)
+    {
+        FuncEntry* entry = &stats.functions.entries[i];
+        char       label[FUNC_NAME_MAX + 16];
+        snprintf(label, sizeof(label), "%s:%d", entry->name, entry->line);
+        fprintf(stderr, "  %-32s %12llu\n", label,
+                (unsigned long long)entry->count);
+    }
+    free_func_table(&stats.functions);
+}
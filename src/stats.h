@@ -0,0 +1,15 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include "object.h"
+#include "vm.h"
+
+// --stats: run() hands every instruction to stats_count() before executing
+// it, through a dispatch table of its own so a run without --stats never
+// looks at it. Counts executions of each opcode, how often each conditional
+// branch was taken, and calls of each function, and prints them sorted at
+// exit. The counts are of the interpreter alone: --stats turns the JIT off.
+void stats_start();
+void stats_count(CallFrame* frame);
+
+#endif
@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "memory.h"
 #include "object.h"
@@ -10,82 +14,182 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((u8)0x80)
+#define CTRL_DELETED ((u8)0xFE)
+
+// the low seven hash bits go to the control byte, the rest pick the group
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((u8)((hash) & 0x7F))
+// where in its group a key goes when that slot is free
+#define HASH_SLOT(hash) ((hash) & (GROUP_WIDTH - 1))
+
+#define TABLE_BYTES(capacity) ((size_t)(capacity) * (sizeof(Entry) + 1))
+
+// Bit i of the result is set when control byte i of the group equals tag.
+static inline u32 match_tag(const u8* group, u8 tag)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (u32)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+    u32 mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] == tag)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted control bytes are the only ones with the top bit set.
+static inline u32 match_free(const u8* group)
+{
+#ifdef __SSE2__
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    u32 mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] & 0x80)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline bool has_empty(const u8* group)
+{
+    return match_tag(group, CTRL_EMPTY) != 0;
+}
+
 void init_table(Table* table)
 {
-    *table = (Table){.count = 0, .capacity = 0, .entries = NULL};
+    *table = (Table){.count = 0,
+                     .tombstones = 0,
+                     .capacity = 0,
+                     .has_young = false,
+                     .ctrl = NULL,
+                     .entries = NULL};
 }
 
 void free_table(Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(u8, table->entries, TABLE_BYTES(table->capacity));
     init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, ObjString* key)
+// Groups are visited in triangular steps, which reaches every group of a
+// power-of-two table exactly once.
+static Entry* find_entry(Table* table, ObjString* key)
 {
-    u32    index = key->hash % capacity;
-    Entry* tombstone = NULL;
+    u32 group_mask = (u32)table->capacity / GROUP_WIDTH - 1;
+    u32 group = HASH_GROUP(key->hash) & group_mask;
+    u8  tag = HASH_TAG(key->hash);
 
-    for (;;)
+    for (u32 stride = 1;; stride++)
     {
-        Entry* entry = &entries[index];
+        u32       base = group * GROUP_WIDTH;
+        const u8* ctrl = table->ctrl + base;
 
-        if (entry->key == NULL)
+        // overlap the likely entry miss with the control byte miss
+        __builtin_prefetch(&table->entries[base + HASH_SLOT(key->hash)]);
+        for (u32 match = match_tag(ctrl, tag); match != 0; match &= match - 1)
         {
-            if (IS_NIL(entry->value))
-            {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
+            Entry* entry = &table->entries[base + __builtin_ctz(match)];
+            if (entry->key == key)
+                return entry;
         }
-        else if (entry->key == key)
+        if (has_empty(ctrl))
+            return NULL;
+
+        group = (group + stride) & group_mask;
+    }
+}
+
+static int find_free_slot(u8* ctrl, int capacity, u32 hash)
+{
+    u32 group_mask = (u32)capacity / GROUP_WIDTH - 1;
+    u32 group = HASH_GROUP(hash) & group_mask;
+
+    for (u32 stride = 1;; stride++)
+    {
+        u32 base = group * GROUP_WIDTH;
+        u32 match = match_free(ctrl + base);
+        if (match != 0)
         {
-            return entry;
+            // prefer the slot find_entry() prefetches
+            u32 preferred = match & (~0u << HASH_SLOT(hash));
+            if (preferred != 0)
+                match = preferred;
+            return (int)(base + __builtin_ctz(match));
         }
 
-        index = (index + 1) % capacity;
+        group = (group + stride) & group_mask;
     }
 }
 
+// Rebuilds the table at the given capacity, which also drops every
+// tombstone.
 static void adjust_capacity(Table* table, int capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = (Entry*)ALLOCATE(u8, TABLE_BYTES(capacity));
+    u8*    ctrl = (u8*)(entries + capacity);
 
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    memset(ctrl, CTRL_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL)
             continue;
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int slot = find_free_slot(ctrl, capacity, entry->key->hash);
+        ctrl[slot] = HASH_TAG(entry->key->hash);
+        entries[slot] = *entry;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(u8, table->entries, TABLE_BYTES(table->capacity));
     table->entries = entries;
+    table->ctrl = ctrl;
     table->capacity = capacity;
+    table->tombstones = 0;
+}
+
+static void delete_slot(Table* table, int slot)
+{
+    // a lookup that reaches this group stops at its empty slot anyway, so
+    // the freed slot can become empty too instead of a tombstone
+    const u8* group = table->ctrl + (slot & ~(GROUP_WIDTH - 1));
+    if (has_empty(group))
+    {
+        table->ctrl[slot] = CTRL_EMPTY;
+    }
+    else
+    {
+        table->ctrl[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
+
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
 }
 
 bool table_get(Table* table, ObjString* key, Value* value)
 {
-    if (table->capacity == 0)
+    if (table->count == 0)
         return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    Entry* entry = find_entry(table, key);
+    if (entry == NULL)
         return false;
 
     *value = entry->value;
@@ -94,34 +198,50 @@ bool table_get(Table* table, ObjString* key, Value* value)
 
 bool table_set(Table* table, ObjString* key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    Entry* entry = table->count == 0 ? NULL : find_entry(table, key);
+    bool   is_new_key = entry == NULL;
+
+    if (is_new_key)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
-    }
-    Entry* entry = find_entry(table->entries, table->capacity, key);
+        if (table->count + table->tombstones + 1 >
+            table->capacity * TABLE_MAX_LOAD)
+        {
+            // when tombstones make up most of the load, rehashing at the
+            // same size is enough
+            int capacity = table->capacity;
+            if (capacity < GROUP_WIDTH)
+                capacity = GROUP_WIDTH;
+            else if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+                capacity *= 2;
+            adjust_capacity(table, capacity);
+        }
 
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value))
+        int slot = find_free_slot(table->ctrl, table->capacity, key->hash);
+        if (table->ctrl[slot] == CTRL_DELETED)
+            table->tombstones--;
+        table->ctrl[slot] = HASH_TAG(key->hash);
+        entry = &table->entries[slot];
+        entry->key = key;
         table->count++;
-
-    entry->key = key;
+    }
     entry->value = value;
+
+    if (is_young((Obj*)key) || (IS_OBJ(value) && is_young(AS_OBJ(value))))
+        table->has_young = true;
+
     return is_new_key;
 }
 
 bool table_delete(Table* table, ObjString* key)
 {
-    if (table->capacity == 0)
+    if (table->count == 0)
         return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    Entry* entry = find_entry(table, key);
+    if (entry == NULL)
         return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
-
+    delete_slot(table, (int)(entry - table->entries));
     return true;
 }
 
@@ -142,22 +262,56 @@ ObjString* table_find_string(Table* table, const char* chars, int length,
     if (table->count == 0)
         return NULL;
 
-    u32 index = hash % table->capacity;
-    for (;;)
+    u32 group_mask = (u32)table->capacity / GROUP_WIDTH - 1;
+    u32 group = HASH_GROUP(hash) & group_mask;
+    u8  tag = HASH_TAG(hash);
+
+    for (u32 stride = 1;; stride++)
     {
-        Entry* entry = &table->entries[index];
+        u32       base = group * GROUP_WIDTH;
+        const u8* ctrl = table->ctrl + base;
 
-        if (entry->key == NULL)
+        __builtin_prefetch(&table->entries[base + HASH_SLOT(hash)]);
+        for (u32 match = match_tag(ctrl, tag); match != 0; match &= match - 1)
         {
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length && entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
-        {
-            return entry->key;
+            ObjString* key = table->entries[base + __builtin_ctz(match)].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0)
+                return key;
         }
+        if (has_empty(ctrl))
+            return NULL;
+
+        group = (group + stride) & group_mask;
+    }
+}
 
-        index = (index + 1) % table->capacity;
+void table_move_key(Table* table, ObjString* from, ObjString* to)
+{
+    if (table->count == 0)
+        return;
+
+    Entry* entry = find_entry(table, from);
+    if (entry != NULL)
+        entry->key = to;
+}
+
+void table_remove_white(Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL && !entry->key->obj.is_marked)
+            delete_slot(table, i);
+    }
+}
+
+void mark_table(Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry* entry = &table->entries[i];
+        mark_object((Obj*)entry->key);
+        mark_value(entry->value);
     }
 }
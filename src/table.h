@@ -10,10 +10,17 @@ typedef struct
     Value      value;
 } Entry;
 
+// Slots are grouped sixteen to a control-byte group. A control byte is
+// CTRL_EMPTY, CTRL_DELETED or, for a live slot, the low seven bits of the
+// key's hash, so most probes are settled without touching an Entry.
+// Entries of empty and deleted slots always have a NULL key.
 typedef struct
 {
-    int    count;
-    int    capacity;
+    int    count;       // live entries
+    int    tombstones;  // CTRL_DELETED slots
+    int    capacity;    // zero or a power of two, at least one group
+    bool   has_young;   // set by the write barrier in table_set()
+    u8*    ctrl;        // capacity control bytes, stored after entries
     Entry* entries;
 } Table;
 
@@ -25,5 +32,8 @@ bool       table_delete(Table* table, ObjString* key);
 void       table_add_all(Table* from, Table* to);
 ObjString* table_find_string(Table* table, const char* chars, int length,
                              u32 hash);
+void       table_move_key(Table* table, ObjString* from, ObjString* to);
+void       table_remove_white(Table* table);
+void       mark_table(Table* table);
 
 #endif
@@ -0,0 +1,658 @@
+#include "common.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "trace.h"
+
+// A tracing compiler for hot loops. Every OP_LOOP in run() counts down the
+// hot counter of the header it jumps back to; when one runs out, run()
+// records the next iteration as the interpreter executes it. The recorder
+// sees the real values, so each instruction becomes IR specialized to the
+// types it met: numbers stay numbers, and every branch turns into a guard
+// on the direction it took, with a snapshot of the stack to leave through.
+// Instructions that cannot stay on numbers (calls, strings, upvalues,
+// printing) abandon the recording.
+//
+// Locals and globals below the header's stack depth become homes. The
+// trace loads and checks them once on entry and keeps them unboxed across
+// iterations, so a global costs one lookup per trip through the trace
+// rather than one per use. Nothing in a trace allocates or calls out, so
+// nothing else can see or change them until an exit writes them back.
+
+u16 trace_hot_counts[HOTCOUNT_SIZE];
+
+typedef struct
+{
+    CallFrame* frame;
+    u8*        code;
+    u16*       count;  // hot counter of the header
+    int        depth;  // stack depth the recorded code is at
+    int        stack[TRACE_MAX_STACK];  // refs above the entry depth
+    int        instructions;
+    bool       failed;
+} Recorder;
+
+static TraceIr  ir;
+static Recorder recorder;
+
+void trace_init()
+{
+    for (int i = 0; i < HOTCOUNT_SIZE; i++)
+        trace_hot_counts[i] = HOTLOOP_COUNT;
+    vm.recording = false;
+}
+
+// ---------------------- recording --------------------------
+
+static int emit(IrOp op, IrType type, int a, int b)
+{
+    if (ir.ir_count == TRACE_MAX_IR)
+    {
+        recorder.failed = true;
+        return 0;
+    }
+    ir.ir[ir.ir_count] = (IrIns){.op = op, .type = type, .a = a, .b = b};
+    return ir.ir_count++;
+}
+
+static int emit_number(double number)
+{
+    int ref = emit(IR_NUMBER, IR_TYPE_NUMBER, 0, 0);
+    ir.ir[ref].number = number;
+    return ref;
+}
+
+static IrType type_of(int ref)
+{
+    return (IrType)ir.ir[ref].type;
+}
+
+static bool is_constant(int ref)
+{
+    return ir.ir[ref].op <= IR_FALSE;
+}
+
+static void push_ref(int ref)
+{
+    if (recorder.depth - ir.entry_depth == TRACE_MAX_STACK)
+    {
+        recorder.failed = true;
+        return;
+    }
+    recorder.stack[recorder.depth++ - ir.entry_depth] = ref;
+}
+
+// The loop never pops below its header's depth before it exits, but the
+// recording gives up rather than trust that.
+static int pop_ref()
+{
+    if (recorder.depth == ir.entry_depth)
+    {
+        recorder.failed = true;
+        return 0;
+    }
+    return recorder.stack[--recorder.depth - ir.entry_depth];
+}
+
+static int peek_ref()
+{
+    if (recorder.depth == ir.entry_depth)
+    {
+        recorder.failed = true;
+        return 0;
+    }
+    return recorder.stack[recorder.depth - 1 - ir.entry_depth];
+}
+
+// Finds or adds the home of a variable, whose value must be a number when
+// the recording first touches it. Nothing has written it yet then, so
+// that is also the value it will have on entry.
+static int home_of(bool is_global, int index, Value value)
+{
+    for (int h = 0; h < ir.home_count; h++)
+        if (ir.homes[h].is_global == is_global && ir.homes[h].index == index)
+            return h;
+    if (!IS_NUMBER(value) || ir.home_count == TRACE_MAX_HOMES)
+    {
+        recorder.failed = true;
+        return 0;
+    }
+    ir.homes[ir.home_count] =
+        (Home){.is_global = is_global, .index = index, .stored = false};
+    return ir.home_count++;
+}
+
+static void store_home(int home, int ref)
+{
+    if (type_of(ref) != IR_TYPE_NUMBER)
+    {
+        recorder.failed = true;
+        return;
+    }
+    emit(IR_STORE, IR_TYPE_NONE, home, ref);
+    ir.homes[home].stored = true;
+}
+
+static void get_local(int slot)
+{
+    if (slot >= ir.entry_depth)
+    {
+        push_ref(recorder.stack[slot - ir.entry_depth]);
+        return;
+    }
+    int home = home_of(false, slot, recorder.frame->slots[slot]);
+    push_ref(emit(IR_HOME, IR_TYPE_NUMBER, home, 0));
+}
+
+static void set_local(int slot)
+{
+    if (slot >= ir.entry_depth)
+        recorder.stack[slot - ir.entry_depth] = peek_ref();
+    else
+        store_home(home_of(false, slot, recorder.frame->slots[slot]),
+                   peek_ref());
+}
+
+static void get_global(int slot)
+{
+    int home = home_of(true, slot, vm.global_values[slot]);
+    push_ref(emit(IR_HOME, IR_TYPE_NUMBER, home, 0));
+}
+
+static void set_global(int slot)
+{
+    store_home(home_of(true, slot, vm.global_values[slot]), peek_ref());
+}
+
+static void push_constant(Value value)
+{
+    if (IS_NUMBER(value))
+        push_ref(emit_number(AS_NUMBER(value)));
+    else if (IS_NIL(value))
+        push_ref(emit(IR_NIL, IR_TYPE_NIL, 0, 0));
+    else if (IS_BOOL(value))
+        push_ref(emit(AS_BOOL(value) ? IR_TRUE : IR_FALSE, IR_TYPE_BOOL, 0, 0));
+    else
+        recorder.failed = true;
+}
+
+static double fold(IrOp op, double a, double b)
+{
+    switch (op)
+    {
+    case IR_ADD:
+        return a + b;
+    case IR_SUBSTRACT:
+        return a - b;
+    case IR_MULTIPLY:
+        return a * b;
+    default:
+        return a / b;
+    }
+}
+
+static void arithmetic(IrOp op)
+{
+    int b = pop_ref();
+    int a = pop_ref();
+    if (type_of(a) != IR_TYPE_NUMBER || type_of(b) != IR_TYPE_NUMBER)
+        recorder.failed = true;
+    else if (ir.ir[a].op == IR_NUMBER && ir.ir[b].op == IR_NUMBER)
+        push_ref(emit_number(fold(op, ir.ir[a].number, ir.ir[b].number)));
+    else
+        push_ref(emit(op, IR_TYPE_NUMBER, a, b));
+}
+
+static void comparison(IrOp op)
+{
+    int b = pop_ref();
+    int a = pop_ref();
+    if (type_of(a) != IR_TYPE_NUMBER || type_of(b) != IR_TYPE_NUMBER)
+        recorder.failed = true;
+    else
+        push_ref(emit(op, IR_TYPE_BOOL, a, b));
+}
+
+static void not()
+{
+    int a = pop_ref();
+    switch (ir.ir[a].op)
+    {
+    case IR_NIL:
+    case IR_FALSE:
+        push_ref(emit(IR_TRUE, IR_TYPE_BOOL, 0, 0));
+        break;
+    case IR_TRUE:
+        push_ref(emit(IR_FALSE, IR_TYPE_BOOL, 0, 0));
+        break;
+    default:
+        if (type_of(a) == IR_TYPE_NUMBER)
+            push_ref(emit(IR_FALSE, IR_TYPE_BOOL, 0, 0));
+        else
+            push_ref(emit(IR_NOT, IR_TYPE_BOOL, a, 0));
+        break;
+    }
+}
+
+static int snapshot(int ip)
+{
+    int count = recorder.depth - ir.entry_depth;
+    if (ir.snapshot_ref_count + count > TRACE_MAX_SNAPSHOT_REFS)
+    {
+        recorder.failed = true;
+        return 0;
+    }
+    Snapshot* snapshot = &ir.snapshots[ir.snapshot_count];
+    snapshot->ip = ip;
+    snapshot->depth = recorder.depth;
+    snapshot->first = ir.snapshot_ref_count;
+    memcpy(ir.snapshot_refs + ir.snapshot_ref_count, recorder.stack,
+           sizeof(int) * count);
+    ir.snapshot_ref_count += count;
+    return ir.snapshot_count++;
+}
+
+// The branch on cond went the way taken says; the trace checks it goes the
+// same way next time and otherwise resumes the interpreter at other_ip,
+// with the stack as it is now. Constants and numbers need no check.
+static void guard(int cond, bool taken, int other_ip)
+{
+    if (is_constant(cond) || type_of(cond) != IR_TYPE_BOOL)
+        return;
+    // a jump is taken when its condition is false
+    emit(taken ? IR_GUARD_FALSE : IR_GUARD_TRUE, IR_TYPE_NONE, cond,
+         snapshot(other_ip));
+}
+
+static bool is_falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static int read_operand(int offset, int width)
+{
+    int operand = 0;
+    for (int i = 1; i <= width; i++)
+        operand = (operand << 8) | recorder.code[offset + i];
+    return operand;
+}
+
+// Records the conditional jump at offset, which taken says the interpreter
+// is about to take.
+static void conditional_jump(int offset, int cond, bool taken)
+{
+    int target = offset + 3 + read_operand(offset, 2);
+    guard(cond, taken, taken ? offset + 3 : target);
+}
+
+// ---------------------- optimization --------------------------
+
+// Marks the values the stores, guards and snapshots need, counting their
+// uses; everything else is dead and never compiled.
+static void eliminate_dead_code()
+{
+    for (int ref = ir.ir_count - 1; ref >= 0; ref--)
+    {
+        IrIns* ins = &ir.ir[ref];
+        if (ins->op == IR_STORE)
+            ir.ir[ins->b].uses++;
+        else if (ins->op == IR_GUARD_TRUE || ins->op == IR_GUARD_FALSE)
+        {
+            ir.ir[ins->a].uses++;
+            Snapshot* snapshot = &ir.snapshots[ins->b];
+            int count = snapshot->depth - ir.entry_depth;
+            for (int i = 0; i < count; i++)
+                ir.ir[ir.snapshot_refs[snapshot->first + i]].uses++;
+        }
+        else if (ins->uses > 0)
+        {
+            if (ins->op >= IR_ADD && ins->op <= IR_NOT_EQUAL &&
+                ins->op != IR_NEGATE)
+            {
+                ir.ir[ins->a].uses++;
+                ir.ir[ins->b].uses++;
+            }
+            else if (ins->op == IR_NEGATE || ins->op == IR_NOT)
+                ir.ir[ins->a].uses++;
+        }
+    }
+}
+
+// A read of a home normally copies it, since a later store in the same
+// iteration would change the value under it. When no store to the home
+// comes before the read's last use, the code uses the home itself.
+static void read_homes_in_place()
+{
+    int last_use[TRACE_MAX_IR];
+    for (int ref = 0; ref < ir.ir_count; ref++)
+    {
+        IrIns* ins = &ir.ir[ref];
+        last_use[ref] = ref;
+        switch (ins->op)
+        {
+        case IR_STORE:
+            last_use[ins->b] = ref;
+            break;
+        case IR_GUARD_TRUE:
+        case IR_GUARD_FALSE:
+        {
+            last_use[ins->a] = ref;
+            Snapshot* snapshot = &ir.snapshots[ins->b];
+            int count = snapshot->depth - ir.entry_depth;
+            for (int i = 0; i < count; i++)
+                last_use[ir.snapshot_refs[snapshot->first + i]] = ref;
+            break;
+        }
+        case IR_NEGATE:
+        case IR_NOT:
+            last_use[ins->a] = ref;
+            break;
+        default:
+            if (ins->op >= IR_ADD && ins->op <= IR_NOT_EQUAL)
+            {
+                last_use[ins->a] = ref;
+                last_use[ins->b] = ref;
+            }
+            break;
+        }
+    }
+
+    for (int ref = 0; ref < ir.ir_count; ref++)
+    {
+        IrIns* ins = &ir.ir[ref];
+        if (ins->op != IR_HOME)
+            continue;
+        ins->in_place = true;
+        for (int i = ref + 1; i < last_use[ref]; i++)
+            if (ir.ir[i].op == IR_STORE && ir.ir[i].a == ins->a)
+                ins->in_place = false;
+    }
+}
+
+// ---------------------- listing --------------------------
+
+static void print_trace()
+{
+    static const char* names[] = {
+        "number", "nil",   "true",     "false",  "home",  "add",
+        "sub",    "mul",   "div",      "neg",    "lt",    "gt",
+        "eq",     "ne",    "not",      "store",  "guardt", "guardf",
+    };
+    printf("== trace %s:%d ==\n",
+           ir.function->name != NULL ? ir.function->name->chars : "<script>",
+           ir.function->chunk.lines[ir.header]);
+    for (int h = 0; h < ir.home_count; h++)
+        printf("home %d   %s %d%s\n", h,
+               ir.homes[h].is_global ? "global" : "local", ir.homes[h].index,
+               ir.homes[h].stored ? " stored" : "");
+    for (int ref = 0; ref < ir.ir_count; ref++)
+    {
+        IrIns* ins = &ir.ir[ref];
+        bool   dead = ins->uses == 0 && ins->op < IR_STORE;
+        printf("%04d %c %-6s", ref, dead ? '-' : ' ', names[ins->op]);
+        if (ins->op == IR_NUMBER)
+            printf(" %g", ins->number);
+        else if (ins->op == IR_HOME)
+            printf(" h%d%s", ins->a, ins->in_place ? "" : " copy");
+        else if (ins->op == IR_STORE)
+            printf(" h%d %04d", ins->a, ins->b);
+        else if (ins->op == IR_GUARD_TRUE || ins->op == IR_GUARD_FALSE)
+            printf(" %04d exit %d", ins->a, ir.snapshots[ins->b].ip);
+        else if (ins->op == IR_NEGATE || ins->op == IR_NOT)
+            printf(" %04d", ins->a);
+        else if (ins->op > IR_HOME)
+            printf(" %04d %04d", ins->a, ins->b);
+        printf("\n");
+    }
+}
+
+// ---------------------- driving --------------------------
+
+static void abandon()
+{
+    *recorder.count = HOTLOOP_BACKOFF;
+    vm.recording = false;
+}
+
+static void finish()
+{
+    vm.recording = false;
+    if (recorder.depth != ir.entry_depth)
+    {
+        abandon();
+        return;
+    }
+    ir.function = recorder.frame->closure->function;
+    eliminate_dead_code();
+    read_homes_in_place();
+    if (vm.print_code)
+        print_trace();
+
+    Trace* trace = jit_compile_trace(&ir);
+    if (trace == NULL)
+    {
+        abandon();
+        return;
+    }
+    trace->next = ir.function->traces;
+    ir.function->traces = trace;
+    // so the back-edge about to run enters it
+    *recorder.count = 1;
+}
+
+bool trace_hot_loop(CallFrame* frame, u16* count)
+{
+    ObjFunction* function = frame->closure->function;
+    int          header = (int)(frame->ip - function->chunk.code);
+    if (vm.recording)
+    {
+        // an inner loop of the one being recorded
+        *count = 1;
+        return false;
+    }
+    for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->header == header)
+        {
+            *count = 1;
+            trace->entry(frame);
+            return false;
+        }
+    }
+    if (!vm.jit_enabled || vm.trace_execution)
+    {
+        *count = HOTLOOP_BACKOFF;
+        return false;
+    }
+
+    ir.header = header;
+    ir.entry_depth = (int)(vm.stack_top - frame->slots);
+    ir.ir_count = 0;
+    ir.home_count = 0;
+    ir.snapshot_count = 0;
+    ir.snapshot_ref_count = 0;
+    recorder.frame = frame;
+    recorder.code = function->chunk.code;
+    recorder.count = count;
+    recorder.depth = ir.entry_depth;
+    recorder.instructions = 0;
+    recorder.failed = false;
+    *count = HOTLOOP_COUNT;
+    vm.recording = true;
+    return true;
+}
+
+bool trace_record(CallFrame* frame)
+{
+    if (!vm.recording)
+        return false;
+    if (frame != &vm.frames[vm.frame_count - 1] || frame != recorder.frame ||
+        ++recorder.instructions > 4 * TRACE_MAX_IR)
+    {
+        abandon();
+        return false;
+    }
+
+    int    offset = (int)(frame->ip - recorder.code);
+    u8     instruction = generic_opcode(recorder.code[offset]);
+    Value* constants = frame->closure->function->chunk.constants.values;
+    Value* top = vm.stack_top;
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        push_constant(constants[read_operand(offset, 1)]);
+        break;
+    case OP_CONSTANT_LONG:
+        push_constant(constants[read_operand(offset, 3)]);
+        break;
+    case OP_NIL:
+        push_constant(NIL_VAL);
+        break;
+    case OP_TRUE:
+        push_constant(BOOL_VAL(true));
+        break;
+    case OP_FALSE:
+        push_constant(BOOL_VAL(false));
+        break;
+    case OP_POP:
+        pop_ref();
+        break;
+    case OP_GET_LOCAL:
+        get_local(read_operand(offset, 1));
+        break;
+    case OP_GET_LOCAL_LONG:
+        get_local(read_operand(offset, 3));
+        break;
+    case OP_SET_LOCAL:
+        set_local(read_operand(offset, 1));
+        break;
+    case OP_SET_LOCAL_LONG:
+        set_local(read_operand(offset, 3));
+        break;
+    case OP_SET_LOCAL_POP:
+        set_local(read_operand(offset, 1));
+        pop_ref();
+        break;
+    case OP_GET_GLOBAL:
+        get_global(read_operand(offset, 2));
+        break;
+    case OP_GET_GLOBAL_LONG:
+        get_global(read_operand(offset, 3));
+        break;
+    case OP_SET_GLOBAL:
+        set_global(read_operand(offset, 2));
+        break;
+    case OP_SET_GLOBAL_LONG:
+        set_global(read_operand(offset, 3));
+        break;
+    case OP_SET_GLOBAL_POP:
+        set_global(read_operand(offset, 2));
+        pop_ref();
+        break;
+    case OP_ADD:
+        arithmetic(IR_ADD);
+        break;
+    case OP_SUBSTRACT:
+        arithmetic(IR_SUBSTRACT);
+        break;
+    case OP_MULTIPLY:
+        arithmetic(IR_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+        arithmetic(IR_DIVIDE);
+        break;
+    case OP_NEGATE:
+    {
+        int a = pop_ref();
+        if (type_of(a) != IR_TYPE_NUMBER)
+            recorder.failed = true;
+        else
+            push_ref(emit(IR_NEGATE, IR_TYPE_NUMBER, a, 0));
+        break;
+    }
+    case OP_LESS:
+        comparison(IR_LESS);
+        break;
+    case OP_GREATER:
+        comparison(IR_GREATER);
+        break;
+    case OP_EQUAL:
+        comparison(IR_EQUAL);
+        break;
+    case OP_NOT_EQUAL:
+        comparison(IR_NOT_EQUAL);
+        break;
+    case OP_NOT:
+        not();
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBSTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+        get_local(read_operand(offset, 1));
+        push_constant(constants[recorder.code[offset + 2]]);
+        if (instruction == OP_LESS_LOCAL_CONSTANT)
+            comparison(IR_LESS);
+        else
+            arithmetic(instruction == OP_ADD_LOCAL_CONSTANT ? IR_ADD
+                                                            : IR_SUBSTRACT);
+        break;
+    case OP_JUMP:
+        break;
+    case OP_JUMP_IF_FALSE:
+        conditional_jump(offset, peek_ref(), is_falsey(top[-1]));
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        conditional_jump(offset, pop_ref(), is_falsey(top[-1]));
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+    {
+        if (!IS_NUMBER(top[-2]) || !IS_NUMBER(top[-1]))
+        {
+            recorder.failed = true;
+            break;
+        }
+        double a = AS_NUMBER(top[-2]);
+        double b = AS_NUMBER(top[-1]);
+        bool   holds = instruction == OP_LESS_JUMP_IF_FALSE ? a < b : a == b;
+        comparison(instruction == OP_LESS_JUMP_IF_FALSE ? IR_LESS : IR_EQUAL);
+        conditional_jump(offset, pop_ref(), !holds);
+        break;
+    }
+    case OP_LOOP:
+        if (offset + 3 - read_operand(offset, 2) == ir.header)
+        {
+            finish();
+            return false;
+        }
+        break;
+    default:
+        recorder.failed = true;
+        break;
+    }
+
+    if (recorder.failed)
+    {
+        abandon();
+        return false;
+    }
+    return true;
+}
+
+void trace_free(ObjFunction* function)
+{
+    Trace* trace = function->traces;
+    while (trace != NULL)
+    {
+        Trace* next = trace->next;
+        jit_free_trace(trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "object.h"
+#include "vm.h"
+
+// Back-edges into a loop header before the loop is recorded. The counters
+// sit in a small table hashed by header address, so two loops may share
+// one and get recorded a little early.
+#define HOTLOOP_COUNT 56
+#define HOTCOUNT_SIZE 64
+#define HOTCOUNT_INDEX(ip) ((uintptr_t)(ip) % HOTCOUNT_SIZE)
+// Back-edges to wait after a recording was abandoned before trying again.
+#define HOTLOOP_BACKOFF UINT16_MAX
+
+extern u16 trace_hot_counts[HOTCOUNT_SIZE];
+
+#define TRACE_MAX_IR 512
+#define TRACE_MAX_HOMES 64
+#define TRACE_MAX_STACK 128
+#define TRACE_MAX_SNAPSHOT_REFS 4096
+
+// The trace IR: one iteration of a loop, in SSA form, as the straight line
+// of code the recording saw. A ref is the index of the instruction that
+// produced a value. Numbers are unboxed doubles; booleans only live as
+// long as the branch or snapshot that needs them.
+typedef enum
+{
+    IR_NUMBER,  // a constant, in number
+    IR_NIL,
+    IR_TRUE,
+    IR_FALSE,
+    IR_HOME,    // a = home: the current value of a loop variable
+
+    // a op b on numbers, in the order the OP_ arithmetic comes in
+    IR_ADD,
+    IR_SUBSTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,  // a
+
+    // a op b on numbers, giving a boolean
+    IR_LESS,
+    IR_GREATER,
+    IR_EQUAL,
+    IR_NOT_EQUAL,
+    IR_NOT,     // a, a boolean
+
+    IR_STORE,       // home a = b
+    IR_GUARD_TRUE,  // leave through snapshot b unless a is true
+    IR_GUARD_FALSE,
+} IrOp;
+
+typedef enum
+{
+    IR_TYPE_NONE,  // stores and guards
+    IR_TYPE_NUMBER,
+    IR_TYPE_BOOL,
+    IR_TYPE_NIL,
+} IrType;
+
+typedef struct
+{
+    u8     op;
+    u8     type;
+    bool   in_place;  // an IR_HOME read straight from the home, see trace.c
+    int    a;
+    int    b;
+    int    uses;      // zero for dead values, which are not compiled
+    double number;
+} IrIns;
+
+// A variable the loop reads or writes below the stack depth of its header:
+// a local of the frame or a global. Homes are loaded and checked to hold
+// numbers once, on entry, and carried unboxed from iteration to iteration.
+typedef struct
+{
+    bool is_global;
+    int  index;   // frame slot or global slot
+    bool stored;  // written back on every exit
+} Home;
+
+// What a side exit rebuilds for the interpreter: the stack depth and the
+// values above the header's depth, refs[first .. first + depth - entry
+// depth), and where to resume.
+typedef struct
+{
+    int ip;  // bytecode offset
+    int depth;
+    int first;
+} Snapshot;
+
+typedef struct
+{
+    ObjFunction* function;
+    int          header;       // bytecode offset the loop jumps back to
+    int          entry_depth;  // stack depth there
+    IrIns        ir[TRACE_MAX_IR];
+    int          ir_count;
+    Home         homes[TRACE_MAX_HOMES];
+    int          home_count;
+    Snapshot     snapshots[TRACE_MAX_IR];
+    int          snapshot_count;
+    int          snapshot_refs[TRACE_MAX_SNAPSHOT_REFS];
+    int          snapshot_ref_count;
+} TraceIr;
+
+// Machine code for one loop, entered at its header with the interpreter's
+// frame; it runs iterations until a guard fails, then leaves frame->ip and
+// vm.stack_top where the interpreter carries on.
+typedef void (*TraceEntry)(CallFrame* frame);
+
+struct Trace
+{
+    Trace*     next;
+    int        header;
+    TraceEntry entry;
+    size_t     size;  // bytes mapped at entry
+};
+
+void trace_init();
+// Called by run() when the hot counter of the loop frame->ip just jumped
+// back to ran out. Runs the loop's trace if it has one; otherwise returns
+// true when the interpreter should start recording.
+bool trace_hot_loop(CallFrame* frame, u16* count);
+// Called by run() before each instruction while recording. Returns false
+// once the recording is over, compiled or abandoned.
+bool trace_record(CallFrame* frame);
+void trace_free(ObjFunction* function);
+
+// Defined in jit.c.
+Trace* jit_compile_trace(TraceIr* ir);
+void   jit_free_trace(Trace* trace);
+
+#endif
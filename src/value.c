@@ -35,6 +35,16 @@ void free_value_array(ValueArray* array)
 
 void print_value(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+        printf(AS_BOOL(value) ? "true" : "false");
+    else if (IS_NIL(value))
+        printf("nil");
+    else if (IS_NUMBER(value))
+        printf(" %g ", AS_NUMBER(value));
+    else if (IS_OBJ(value))
+        print_object(value);
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -49,11 +59,19 @@ void print_value(Value value)
     case VAL_OBJ:
         print_object(value);
         break;
+    case VAL_UNDEFINED:
+        break;
     }
+#endif
 }
 
 bool values_equal(Value v1, Value v2)
 {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(v1) && IS_NUMBER(v2))
+        return AS_NUMBER(v1) == AS_NUMBER(v2);
+    return v1 == v2;
+#else
     if (v1.type != v2.type)
         return false;
     switch (v1.type)
@@ -69,4 +87,5 @@ bool values_equal(Value v1, Value v2)
     default:
         return false;
     }
+#endif
 }
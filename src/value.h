@@ -2,16 +2,69 @@
 #define clox_value_h
 
 #include <stdbool.h>
+#include <string.h>
+
+#include "common.h"
 
 typedef struct Obj       Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// A Value is a raw 64-bit double. Anything that is not a number lives inside
+// the quiet NaN space: the sign bit flags an object pointer and the low bits
+// of the payload tag nil, false and true.
+#define SIGN_BIT ((u64)0x8000000000000000)
+#define QNAN ((u64)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+typedef u64 Value;
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(u64)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(u64)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(u64)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(u64)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) num_to_value(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (u64)(uintptr_t)(obj))
+
+static inline double value_to_num(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
     VAL_NUMBER,
     VAL_NIL,
     VAL_OBJ,
+    VAL_UNDEFINED,  // a global slot that has not been defined yet
 } ValueType;
 
 typedef struct
@@ -27,6 +80,7 @@ typedef struct
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -36,9 +90,12 @@ typedef struct
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 typedef struct
 {
     int    capacity;
@@ -3,19 +3,30 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "heap_stats.h"
+#include "jit.h"
 #include "memory.h"
 #include "native_fn.h"
 #include "object.h"
+#include "profiler.h"
+#include "register.h"
+#include "stats.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
 VM vm;
 
+static bool            call_register(Value* base, int arg_count);
+static InterpretResult run();
+static InterpretResult run_registers();
+
 static void reset_stack()
 {
     vm.stack_top = vm.stack;
@@ -23,6 +34,18 @@ static void reset_stack()
     vm.open_upvalues = NULL;
 }
 
+int frame_line(CallFrame* frame)
+{
+    Chunk* chunk = &frame->closure->function->chunk;
+    // ip is already past the instruction the frame is at
+    int offset = (int)(frame->ip - chunk->code) - 1;
+    if (offset < 0)
+        offset = 0;
+    if (offset >= chunk->count)
+        offset = chunk->count - 1;
+    return chunk->lines[offset];
+}
+
 static void runtime_error(const char* format, ...)
 {
     va_list args;
@@ -35,9 +58,8 @@ static void runtime_error(const char* format, ...)
     {
         CallFrame*   frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        size_t       instruction = frame->ip - function->chunk.code - 1;
 
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", frame_line(frame));
         if (function->name == NULL)
             fprintf(stderr, "script\n");
         else
@@ -47,11 +69,40 @@ static void runtime_error(const char* format, ...)
     }
 }
 
+// Returns the slot for the global called name, allocating an undefined
+// one the first time the name is seen.
+int global_slot(ObjString* name)
+{
+    Value index;
+    if (table_get(&vm.global_slots, name, &index))
+        return (int)AS_NUMBER(index);
+
+    push(OBJ_VAL(name));
+    if (vm.global_capacity < vm.global_count + 1)
+    {
+        int old_capacity = vm.global_capacity;
+        vm.global_capacity = GROW_CAPACITY(old_capacity);
+        vm.global_values = GROW_ARRAY(Value, vm.global_values, old_capacity,
+                                      vm.global_capacity);
+        vm.global_names = GROW_ARRAY(GlobalName, vm.global_names,
+                                     old_capacity, vm.global_capacity);
+    }
+
+    int slot = vm.global_count++;
+    vm.global_values[slot] = UNDEFINED_VAL;
+    vm.global_names[slot] = (GlobalName){.name = name, .is_immutable = false};
+
+    table_set(&vm.global_slots, name, NUMBER_VAL((double)slot));
+    pop();
+    return slot;
+}
+
 static void define_native(const char* name, NativeFn function)
 {
     push(OBJ_VAL(copy_string(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.global_values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -60,17 +111,88 @@ void init_VM()
 {
     reset_stack();
     vm.objects = NULL;
-    init_table(&vm.globals);
+    vm.bytes_allocated = 0;
+    vm.next_gc = 1024 * 1024;
+
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
+
+    vm.gc_incremental = false;
+    vm.gc_concurrent_sweep = true;
+    vm.sweeping = false;
+    vm.collecting = false;
+    vm.gc_marking = false;
+    vm.gc_max_pause_ns = GC_DEFAULT_MAX_PAUSE_NS;
+    vm.gc_pauses = (PauseHistogram){0};
+    vm.minor_pauses = (PauseHistogram){0};
+
+    init_nursery();
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm.instruction_count = 0;
+#endif
+#ifdef DEBUG_PROFILE_PAIRS
+    vm.previous_opcode = OP_RETURN;
+    memset(vm.pair_counts, 0, sizeof(vm.pair_counts));
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    vm.trace_execution = true;
+#else
+    vm.trace_execution = false;
+#endif
+#ifdef DEBUG_PRINT_CODE
+    vm.print_code = true;
+#else
+    vm.print_code = false;
+#endif
+    vm.optimize_code = true;
+    vm.register_mode = false;
+    vm.jit_enabled = true;
+    vm.use_cache = true;
+    vm.recording = false;
+    vm.collect_stats = false;
+#ifdef JIT
+    trace_init();
+#endif
+    init_table(&vm.global_slots);
+    vm.global_values = NULL;
+    vm.global_names = NULL;
+    vm.global_count = 0;
+    vm.global_capacity = 0;
     init_table(&vm.strings);
 
     define_native("clock", clock_native);
+    define_native("heapStats", heap_stats_native);
 }
 
 void free_VM()
 {
-    free_table(&vm.globals);
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    fprintf(stderr, "instructions: %llu\n",
+            (unsigned long long)vm.instruction_count);
+#endif
+#ifdef DEBUG_PROFILE_PAIRS
+    for (int first = 0; first < UINT8_COUNT; first++)
+    {
+        for (int second = 0; second < UINT8_COUNT; second++)
+        {
+            if (vm.pair_counts[first][second] == 0)
+                continue;
+            fprintf(stderr, "pair %s %s %llu\n", opcode_name(first),
+                    opcode_name(second),
+                    (unsigned long long)vm.pair_counts[first][second]);
+        }
+    }
+#endif
+    free_table(&vm.global_slots);
+    FREE_ARRAY(Value, vm.global_values, vm.global_capacity);
+    FREE_ARRAY(GlobalName, vm.global_names, vm.global_capacity);
+    vm.global_count = 0;
+    vm.global_capacity = 0;
     free_table(&vm.strings);
     free_objects();
+    free_cache_images();
 }
 
 void push(Value value)
@@ -90,27 +212,60 @@ static Value peek(int distance)
     return vm.stack_top[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int arg_count)
+// Pushes a frame for closure whose slots start at the callee itself.
+static bool push_frame(ObjClosure* closure, int arg_count, Value* slots)
 {
     if (arg_count != closure->function->arity)
     {
         runtime_error("Expected %d arguments but got %d.",
                       closure->function->arity, arg_count);
     }
-    if (vm.frame_count == FRAMES_MAX)
+    if (vm.frame_count == FRAMES_MAX ||
+        slots + closure->function->slot_count > vm.stack + STACK_MAX)
     {
         // as Java developer i hate this exception,
         // but sorry there no way to increase stack size here like jvm does
         runtime_error("Stack Overflow");
         return false;
     }
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+    // filled in before it is counted, the profiler may look at any moment
+    CallFrame* frame = &vm.frames[vm.frame_count];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = slots;
+    SIGNAL_FENCE();
+    vm.frame_count++;
     return true;
 }
 
+// Register code called from stack code runs to its return right here, so
+// run() only ever meets frames of its own. The result takes the callee's
+// place on the stack, as if it had returned there.
+static bool call_registers_from_stack(int arg_count)
+{
+    Value* base = vm.stack_top - arg_count - 1;
+    if (!call_register(base, arg_count) || run_registers() != INTERPRET_OK)
+        return false;
+    vm.stack_top = base + 1;
+    return true;
+}
+
+static bool call(ObjClosure* closure, int arg_count)
+{
+    ObjFunction* function = closure->function;
+    if (function->register_code)
+        return call_registers_from_stack(arg_count);
+#ifdef JIT
+    // jit_return() hands frames back to the run() below it, which a stack
+    // function called from register code does not have
+    if (function->call_count < JIT_CALL_THRESHOLD &&
+        ++function->call_count == JIT_CALL_THRESHOLD && vm.jit_enabled &&
+        !vm.trace_execution && !vm.register_mode)
+        jit_compile(function);
+#endif
+    return push_frame(closure, arg_count, vm.stack_top - arg_count - 1);
+}
+
 static bool call_value(Value callee, int arg_count)
 {
     if (IS_OBJ(callee))
@@ -144,7 +299,8 @@ static void close_upvalues(Value* last)
         ObjUpvalue* upvalue = vm.open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.open_upvalues->next = upvalue->next;
+        write_barrier((Obj*)upvalue, upvalue->closed);
+        vm.open_upvalues = upvalue->next;
     }
 }
 
@@ -178,29 +334,226 @@ static bool is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static ObjString* concatenate_strings(ObjString* a, ObjString* b)
+{
+    ObjString* result = allocate_string(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    return intern_string(result);
+}
+
 static void concatenate()
 {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+    ObjString* result =
+        concatenate_strings(AS_STRING(peek(1)), AS_STRING(peek(0)));
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+}
 
-    int   length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Minor collections move objects, so they only run where the interpreter
+// loops hold no object pointers of their own: backward jumps, calls and
+// returns.
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() collect_nursery()
+#else
+#define SAFEPOINT()                                                            \
+    do                                                                         \
+    {                                                                          \
+        if (vm.minor_gc_pending)                                               \
+            collect_nursery();                                                 \
+    } while (false)
+#endif
 
-    ObjString* result = take_string(chars, length);
-    push(OBJ_VAL(result));
+#ifdef JIT
+int jit_call(int arg_count)
+{
+    int frame_count = vm.frame_count;
+    if (!call_value(peek(arg_count), arg_count))
+        return JIT_ERROR;
+    SAFEPOINT();
+    if (vm.frame_count == frame_count)
+        return JIT_RETURN;  // a native function, already done
+
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    if (frame->closure->function->jit == NULL)
+        return JIT_EXIT;
+    return jit_run(frame);
+}
+
+// Returns false for the outermost frame, which run() has to finish.
+bool jit_return()
+{
+    if (vm.frame_count == 1)
+        return false;
+
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    Value      result = pop();
+    close_upvalues(frame->slots);
+    vm.frame_count--;
+    vm.stack_top = frame->slots;
+    push(result);
+    SAFEPOINT();
+    return true;
+}
+
+bool jit_arithmetic(u8 instruction)
+{
+    if (instruction == OP_NEGATE)
+    {
+        if (!IS_NUMBER(peek(0)))
+        {
+            runtime_error("Operand must be a number");
+            return false;
+        }
+        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        return true;
+    }
+    if (instruction == OP_ADD && IS_STRING(peek(0)) && IS_STRING(peek(1)))
+    {
+        concatenate();
+        return true;
+    }
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+    {
+        runtime_error(instruction == OP_ADD
+                          ? "Operands must be two numbers or strings"
+                          : "Operands must be numbers ");
+        return false;
+    }
+
+    double b = AS_NUMBER(pop());
+    double a = AS_NUMBER(pop());
+    switch (instruction)
+    {
+    case OP_ADD:
+        push(NUMBER_VAL(a + b));
+        break;
+    case OP_SUBSTRACT:
+        push(NUMBER_VAL(a - b));
+        break;
+    case OP_MULTIPLY:
+        push(NUMBER_VAL(a * b));
+        break;
+    case OP_DIVIDE:
+        push(NUMBER_VAL(a / b));
+        break;
+    case OP_GREATER:
+        push(BOOL_VAL(a > b));
+        break;
+    default:
+        push(BOOL_VAL(a < b));
+        break;
+    }
+    return true;
 }
 
+bool jit_undefined_global(int slot)
+{
+    runtime_error("Undefined Variable %s", vm.global_names[slot].name->chars);
+    return false;
+}
+
+void jit_set_upvalue(CallFrame* frame, int index)
+{
+    ObjUpvalue* upvalue = frame->closure->upvalues[index];
+    *upvalue->location = peek(0);
+    write_barrier((Obj*)upvalue, peek(0));
+}
+
+void jit_equal(bool negate)
+{
+    Value v2 = pop();
+    Value v1 = pop();
+    push(BOOL_VAL(values_equal(v1, v2) != negate));
+}
+
+void jit_not()
+{
+    push(BOOL_VAL(is_falsey(pop())));
+}
+
+void jit_print()
+{
+    print_value(pop());
+    printf("\n");
+}
+
+void jit_closure(CallFrame* frame, u8* ip)
+{
+    bool         is_long = *ip++ == OP_CLOSURE_LONG;
+    int          constant = is_long ? (ip[0] << 16) | (ip[1] << 8) | ip[2]
+                                    : ip[0];
+    ObjFunction* function = AS_FUNCTION(
+        frame->closure->function->chunk.constants.values[constant]);
+    ObjClosure*  closure = new_closure(function);
+    push(OBJ_VAL(closure));
+
+    ip += is_long ? 3 : 1;
+    for (int i = 0; i < closure->upvalue_count; i++)
+    {
+        u8  islocal = *ip++;
+        int index = is_long ? (ip[0] << 16) | (ip[1] << 8) | ip[2] : ip[0];
+        ip += is_long ? 3 : 1;
+        if (islocal)
+            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        else
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+    }
+}
+
+void jit_close_upvalue()
+{
+    close_upvalues(vm.stack_top - 1);
+    pop();
+}
+
+// The hot counter of a loop in machine code ran out with frame->ip at the
+// header. Runs the loop's trace and returns where the machine code goes on
+// from, or NULL when the interpreter should take over to record one.
+u8* jit_hot_loop(u16* count)
+{
+    CallFrame*   frame = &vm.frames[vm.frame_count - 1];
+    ObjFunction* function = frame->closure->function;
+    if (trace_hot_loop(frame, count))
+        return NULL;
+    return function->jit->code +
+           function->jit->entries[frame->ip - function->chunk.code];
+}
+#endif
+
+static void trace_instruction(CallFrame* frame)
+{
+    printf("                   ");
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
+    {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(
+        &frame->closure->function->chunk,
+        (int)(frame->ip - frame->closure->function->chunk.code));
+}
+
+// Runs until the frame on top returns: the script's, or that of a call
+// from register code.
 static InterpretResult run()
 {
     CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    int        base = vm.frame_count - 1;
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (u16)(frame->ip[-2] << 8) | frame->ip[-1])
+#define READ_LONG()                                                            \
+    (frame->ip += 3,                                                           \
+     (u32)(frame->ip[-3] << 16) | (u32)(frame->ip[-2] << 8) | frame->ip[-1])
 #define READ_CONSTANT()                                                        \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG()                                                   \
+    (frame->closure->function->chunk.constants.values[READ_LONG()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(value_type, op)                                              \
     do                                                                         \
@@ -215,109 +568,269 @@ static InterpretResult run()
         push(value_type(a op b));                                              \
     } while (false)
 
-    for (;;)
-    {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("                   ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
-        {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+// The generic arithmetic and comparison opcodes quicken: they rewrite
+// themselves, at frame->ip[-1], into the form for the operand types they
+// just met. A quickened opcode checks its guess and, when it is wrong,
+// turns back into the generic one and runs again as that. Code mapped from
+// a bytecode image is read-only and stays generic; it never holds a
+// quickened opcode to take back, the image is written before it runs.
+#define QUICKEN(op)                                                            \
+    (frame->closure->function->chunk.mapped ? (void)0                          \
+                                            : (void)(frame->ip[-1] = (op)))
+#define DEQUICKEN(op) (frame->ip[-1] = (op), frame->ip--)
+#define NUMBER_OPERANDS() (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+#define NUMBER_OP(value_type, op)                                              \
+    do                                                                         \
+    {                                                                          \
+        double b = AS_NUMBER(vm.stack_top[-1]);                                \
+        double a = AS_NUMBER(vm.stack_top[-2]);                                \
+        vm.stack_top[-2] = value_type(a op b);                                 \
+        vm.stack_top--;                                                        \
+    } while (false)
+
+// Frames of compiled functions run as machine code. It comes back when the
+// frame returns, and the caller may be compiled too, or when the top frame
+// needs the interpreter.
+#ifdef JIT
+#define ENTER_JIT()                                                            \
+    do                                                                         \
+    {                                                                          \
+        while (frame->closure->function->jit != NULL)                          \
+        {                                                                      \
+            int status = jit_run(frame);                                       \
+            if (status == JIT_ERROR)                                           \
+                return INTERPRET_RUNTIME_ERROR;                                \
+            frame = &vm.frames[vm.frame_count - 1];                            \
+            if (status == JIT_EXIT)                                            \
+                break;                                                         \
+        }                                                                      \
+        if (vm.recording)                                                      \
+            START_RECORDING();                                                 \
+    } while (false)
+// A back-edge counts down the hot counter of the loop header it lands on;
+// when that runs out the loop's trace runs, or the recording of one starts.
+#define HOT_LOOP()                                                             \
+    do                                                                         \
+    {                                                                          \
+        u16* count = &trace_hot_counts[HOTCOUNT_INDEX(frame->ip)];             \
+        if (--*count == 0 && trace_hot_loop(frame, count))                     \
+            START_RECORDING();                                                 \
+    } while (false)
+#define RECORD_INSTRUCTION()                                                   \
+    (vm.recording ? (void)trace_record(frame) : (void)0)
+#else
+#define ENTER_JIT() ((void)0)
+#define HOT_LOOP() ((void)0)
+#define RECORD_INSTRUCTION() ((void)0)
 #endif
-        u8 instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
+
+#if defined(DEBUG_PROFILE_PAIRS)
+#define BEFORE_INSTRUCTION()                                                   \
+    (vm.pair_counts[vm.previous_opcode][*frame->ip]++,                         \
+     vm.previous_opcode = *frame->ip)
+#elif defined(DEBUG_COUNT_INSTRUCTIONS)
+#define BEFORE_INSTRUCTION() (vm.instruction_count++)
+#else
+#define BEFORE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef THREADED_DISPATCH
+    // One indirect jump per handler instead of a single shared one, so the
+    // branch predictor can learn opcode-to-opcode transitions.
+    static void* dispatch_table[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBSTRACT] = &&label_OP_SUBSTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_ADD_LOCAL_CONSTANT] = &&label_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBSTRACT_LOCAL_CONSTANT] = &&label_OP_SUBSTRACT_LOCAL_CONSTANT,
+        [OP_LESS_LOCAL_CONSTANT] = &&label_OP_LESS_LOCAL_CONSTANT,
+        [OP_LESS_JUMP_IF_FALSE] = &&label_OP_LESS_JUMP_IF_FALSE,
+        [OP_EQUAL_JUMP_IF_FALSE] = &&label_OP_EQUAL_JUMP_IF_FALSE,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+        [OP_GET_LOCAL_LONG] = &&label_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG] = &&label_OP_SET_LOCAL_LONG,
+        [OP_GET_GLOBAL_LONG] = &&label_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&label_OP_SET_GLOBAL_LONG,
+        [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+        [OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&label_OP_ADD_STRING,
+        [OP_SUBSTRACT_NUMBER] = &&label_OP_SUBSTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&label_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&label_OP_DIVIDE_NUMBER,
+        [OP_GREATER_NUMBER] = &&label_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER] = &&label_OP_LESS_NUMBER,
+        [OP_LESS_JUMP_IF_FALSE_NUMBER] = &&label_OP_LESS_JUMP_IF_FALSE_NUMBER,
+    };
+    // --trace swaps in a table that sends every opcode through the tracer,
+    // so an untraced run pays nothing for it
+    static void* trace_table[] = {
+        [0 ... sizeof(dispatch_table) / sizeof(void*) - 1] = &&trace_dispatch,
+    };
+    // and --stats one that counts it first
+    static void* stats_table[] = {
+        [0 ... sizeof(dispatch_table) / sizeof(void*) - 1] = &&stats_dispatch,
+    };
+    void** active_table = vm.collect_stats     ? stats_table
+                          : vm.trace_execution ? trace_table
+                                               : dispatch_table;
+#ifdef JIT
+    // and recording a hot loop one that sends it through the recorder
+    static void* record_table[] = {
+        [0 ... sizeof(dispatch_table) / sizeof(void*) - 1] = &&record_dispatch,
+    };
+#define START_RECORDING() (active_table = record_table)
+#endif
+
+#define DISPATCH()                                                             \
+    do                                                                         \
+    {                                                                          \
+        BEFORE_INSTRUCTION();                                                  \
+        goto* active_table[READ_BYTE()];                                       \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) label_##op
+#define NEXT() DISPATCH()
+#else
+#define INTERPRET_LOOP                                                         \
+    for (;;)                                                                   \
+        switch (BEFORE_INSTRUCTION(),                                          \
+                vm.collect_stats ? stats_count(frame) : (void)0,               \
+                vm.trace_execution ? trace_instruction(frame) : (void)0,       \
+                RECORD_INSTRUCTION(), READ_BYTE())
+#define START_RECORDING() ((void)0)
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT):
         {
             Value constant = READ_CONSTANT();
             push(constant);
-            break;
+            NEXT();
         }
-        case OP_NIL:
+        CASE(OP_NIL):
             push(NIL_VAL);
-            break;
-        case OP_TRUE:
+            NEXT();
+        CASE(OP_TRUE):
             push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
+            NEXT();
+        CASE(OP_FALSE):
             push(BOOL_VAL(false));
-            break;
-        case OP_POP:
+            NEXT();
+        CASE(OP_POP):
             pop();
-            break;
-        case OP_GET_LOCAL:
+            NEXT();
+        CASE(OP_GET_LOCAL):
         {
             u8 slot = READ_BYTE();
             push(frame->slots[slot]);
-            break;
+            NEXT();
         }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL):
         {
             u8 slot = READ_BYTE();
             frame->slots[slot] = peek(0);
-            break;
+            NEXT();
         }
-        case OP_GET_GLOBAL:
+        CASE(OP_GET_GLOBAL):
         {
-            ObjString* name = READ_STRING();
-            Value      value;
-            if (!table_get(&vm.globals, name, &value))
+            u16   slot = READ_SHORT();
+            Value value = vm.global_values[slot];
+            if (IS_UNDEFINED(value))
             {
-                runtime_error("Undefined Variable %s", name->chars);
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(value);
-            break;
+            NEXT();
         }
-        case OP_DEFINE_GLOBAL:
+        CASE(OP_DEFINE_GLOBAL):
         {
-            ObjString* name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
+            u16 slot = READ_SHORT();
+            vm.global_values[slot] = pop();
+            NEXT();
         }
-        case OP_SET_GLOBAL:
+        CASE(OP_SET_GLOBAL):
         {
-            ObjString* name = READ_STRING();
-            if (table_set(&vm.globals, name, peek(0)))
+            u16 slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values[slot]))
             {
-                table_delete(&vm.globals, name);
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            vm.global_values[slot] = peek(0);
+            NEXT();
         }
-        case OP_GET_UPVALUE:
+        CASE(OP_GET_UPVALUE):
         {
             u8 slot = READ_BYTE();
             push(*frame->closure->upvalues[slot]->location);
-            break;
+            NEXT();
         }
-        case OP_SET_UPVALUE:
+        CASE(OP_SET_UPVALUE):
         {
-            u8 slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            u8          slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = peek(0);
+            write_barrier((Obj*)upvalue, peek(0));
+            NEXT();
         }
-        case OP_EQUAL:
+        CASE(OP_EQUAL):
         {
             Value v2 = pop();
             Value v1 = pop();
             push(BOOL_VAL(values_equal(v1, v2)));
-            break;
+            NEXT();
         }
-        case OP_GREATER:
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            QUICKEN(OP_GREATER_NUMBER);
+            NEXT();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
+            QUICKEN(OP_LESS_NUMBER);
+            NEXT();
+        CASE(OP_ADD):
+            if (NUMBER_OPERANDS())
+                QUICKEN(OP_ADD_NUMBER);
+            else if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+                QUICKEN(OP_ADD_STRING);
+        add_values:
         {
             if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
             {
@@ -334,54 +847,122 @@ static InterpretResult run()
                 runtime_error("Operands must be two numbers or strings");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            NEXT();
         }
-        case OP_SUBSTRACT:
+        CASE(OP_SUBSTRACT):
             BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            QUICKEN(OP_SUBSTRACT_NUMBER);
+            NEXT();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
+            QUICKEN(OP_MULTIPLY_NUMBER);
+            NEXT();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
+            QUICKEN(OP_DIVIDE_NUMBER);
+            NEXT();
+        CASE(OP_ADD_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_ADD);
+                NEXT();
+            }
+            NUMBER_OP(NUMBER_VAL, +);
+            NEXT();
+        CASE(OP_ADD_STRING):
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1)))
+            {
+                DEQUICKEN(OP_ADD);
+                NEXT();
+            }
+            concatenate();
+            NEXT();
+        CASE(OP_SUBSTRACT_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_SUBSTRACT);
+                NEXT();
+            }
+            NUMBER_OP(NUMBER_VAL, -);
+            NEXT();
+        CASE(OP_MULTIPLY_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_MULTIPLY);
+                NEXT();
+            }
+            NUMBER_OP(NUMBER_VAL, *);
+            NEXT();
+        CASE(OP_DIVIDE_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_DIVIDE);
+                NEXT();
+            }
+            NUMBER_OP(NUMBER_VAL, /);
+            NEXT();
+        CASE(OP_GREATER_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_GREATER);
+                NEXT();
+            }
+            NUMBER_OP(BOOL_VAL, >);
+            NEXT();
+        CASE(OP_LESS_NUMBER):
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_LESS);
+                NEXT();
+            }
+            NUMBER_OP(BOOL_VAL, <);
+            NEXT();
+        CASE(OP_NOT):
             push(BOOL_VAL(is_falsey(pop())));
-            break;
-        case OP_NEGATE:
+            NEXT();
+        CASE(OP_NEGATE):
             if (!IS_NUMBER(peek(0)))
             {
                 runtime_error("Operand must be a number");
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_PRINT:
+            NEXT();
+        CASE(OP_PRINT):
         {
             print_value(pop());
             printf("\n");
-            break;
+            NEXT();
         }
-        case OP_JUMP:
+        CASE(OP_JUMP):
         {
             u16 offset = READ_SHORT();
             frame->ip += offset;
-            break;
+            NEXT();
         }
-        case OP_JUMP_IF_FALSE:
+        CASE(OP_JUMP_IF_FALSE):
         {
             u16 offset = READ_SHORT();
             if (is_falsey(peek(0)))
                 frame->ip += offset;
-            break;
+            NEXT();
         }
-        case OP_LOOP:
+        CASE(OP_POP_JUMP_IF_FALSE):
+        {
+            u16 offset = READ_SHORT();
+            if (is_falsey(pop()))
+                frame->ip += offset;
+            NEXT();
+        }
+        CASE(OP_LOOP):
         {
             u16 offset = READ_SHORT();
             frame->ip -= offset;
-            break;
+            SAFEPOINT();
+            HOT_LOOP();
+            NEXT();
         }
-        case OP_CALL:
+        CASE(OP_CALL):
         {
             u8 arg_count = READ_BYTE();
             if (!call_value(peek(arg_count), arg_count))
@@ -389,9 +970,11 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            SAFEPOINT();
+            ENTER_JIT();
+            NEXT();
         }
-        case OP_CLOSURE:
+        CASE(OP_CLOSURE):
         {
             ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
             ObjClosure*  closure = new_closure(function);
@@ -405,45 +988,708 @@ static InterpretResult run()
                         capture_upvalue(frame->slots + index);
                 else
                     closure->upvalues[i] = frame->closure->upvalues[index];
+                write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
             }
-            break;
+            NEXT();
         }
-        case OP_CLOSE_UPVALUE:
+        CASE(OP_CLOSE_UPVALUE):
         {
             close_upvalues(vm.stack_top - 1);
             pop();
-            break;
+            NEXT();
         }
-        case OP_RETURN:
+        CASE(OP_RETURN):
         {
             Value result = pop();
             close_upvalues(frame->slots);
 
-            if (--vm.frame_count == 0)
+            vm.stack_top = frame->slots;
+            if (--vm.frame_count == base)
             {
-                pop();
+                // the script's result is dropped along with it
+                if (base != 0)
+                    push(result);
                 return INTERPRET_OK;
             }
 
-            vm.stack_top = frame->slots;
             push(result);
 
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            SAFEPOINT();
+            ENTER_JIT();
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL):
+        {
+            Value v2 = pop();
+            Value v1 = pop();
+            push(BOOL_VAL(!values_equal(v1, v2)));
+            NEXT();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT):
+        {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                // strings and type errors take the generic path
+                push(a);
+                push(b);
+                goto add_values;
+            }
+            push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            NEXT();
+        }
+        CASE(OP_SUBSTRACT_LOCAL_CONSTANT):
+        {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                runtime_error("Operands must be numbers ");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+            NEXT();
         }
+        CASE(OP_LESS_LOCAL_CONSTANT):
+        {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                runtime_error("Operands must be numbers ");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+            NEXT();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE):
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                runtime_error("Operands must be numbers ");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            QUICKEN(OP_LESS_JUMP_IF_FALSE_NUMBER);
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            u16    offset = READ_SHORT();
+            if (!(a < b))
+                frame->ip += offset;
+            NEXT();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE_NUMBER):
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEQUICKEN(OP_LESS_JUMP_IF_FALSE);
+                NEXT();
+            }
+            double b = AS_NUMBER(vm.stack_top[-1]);
+            double a = AS_NUMBER(vm.stack_top[-2]);
+            vm.stack_top -= 2;
+            u16 offset = READ_SHORT();
+            if (!(a < b))
+                frame->ip += offset;
+            NEXT();
+        }
+        CASE(OP_EQUAL_JUMP_IF_FALSE):
+        {
+            Value v2 = pop();
+            Value v1 = pop();
+            u16   offset = READ_SHORT();
+            if (!values_equal(v1, v2))
+                frame->ip += offset;
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL_POP):
+        {
+            u8 slot = READ_BYTE();
+            frame->slots[slot] = pop();
+            NEXT();
+        }
+        CASE(OP_SET_GLOBAL_POP):
+        {
+            u16 slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values[slot]))
+            {
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.global_values[slot] = pop();
+            NEXT();
+        }
+        CASE(OP_CONSTANT_LONG):
+        {
+            Value constant = READ_CONSTANT_LONG();
+            push(constant);
+            NEXT();
+        }
+        CASE(OP_GET_LOCAL_LONG):
+        {
+            u32 slot = READ_LONG();
+            push(frame->slots[slot]);
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL_LONG):
+        {
+            u32 slot = READ_LONG();
+            frame->slots[slot] = peek(0);
+            NEXT();
+        }
+        CASE(OP_GET_GLOBAL_LONG):
+        {
+            u32   slot = READ_LONG();
+            Value value = vm.global_values[slot];
+            if (IS_UNDEFINED(value))
+            {
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+            NEXT();
+        }
+        CASE(OP_DEFINE_GLOBAL_LONG):
+        {
+            u32 slot = READ_LONG();
+            vm.global_values[slot] = pop();
+            NEXT();
+        }
+        CASE(OP_SET_GLOBAL_LONG):
+        {
+            u32 slot = READ_LONG();
+            if (IS_UNDEFINED(vm.global_values[slot]))
+            {
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.global_values[slot] = peek(0);
+            NEXT();
+        }
+        CASE(OP_CLOSURE_LONG):
+        {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT_LONG());
+            ObjClosure*  closure = new_closure(function);
+            push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalue_count; i++)
+            {
+                u8  islocal = READ_BYTE();
+                u32 index = READ_LONG();
+                if (islocal)
+                    closure->upvalues[i] =
+                        capture_upvalue(frame->slots + index);
+                else
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+            }
+            NEXT();
         }
     }
 
+#ifdef THREADED_DISPATCH
+trace_dispatch:
+    frame->ip--;
+    trace_instruction(frame);
+    goto* dispatch_table[READ_BYTE()];
+stats_dispatch:
+    frame->ip--;
+    stats_count(frame);
+    if (vm.trace_execution)
+        trace_instruction(frame);
+    goto* dispatch_table[READ_BYTE()];
+#ifdef JIT
+record_dispatch:
+    frame->ip--;
+    if (!trace_record(frame))
+        active_table = dispatch_table;
+    goto* dispatch_table[READ_BYTE()];
+#endif
+#endif
+
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
 #undef BINARY_OP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef NUMBER_OPERANDS
+#undef NUMBER_OP
+#undef ENTER_JIT
+#undef HOT_LOOP
+#undef RECORD_INSTRUCTION
+#undef START_RECORDING
+#undef BEFORE_INSTRUCTION
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+}
+
+// A function left as stack code, because it was too large for registers,
+// runs to its return in run(). The stack starts above its arguments, and
+// the caller's registers from base on belong to the callee anyway.
+static bool call_stack_from_registers(ObjClosure* closure, Value* base,
+                                      int arg_count)
+{
+    Value* top = vm.stack_top;
+    vm.stack_top = base + arg_count + 1;
+    if (!push_frame(closure, arg_count, base) || run() != INTERPRET_OK)
+        return false;
+    vm.stack_top = top;
+    return true;
+}
+
+// Calls the value in register base with the n registers after it as
+// arguments. A closure's frame starts at base, so its registers overlap the
+// caller's from there on; the stack top is kept above every live register
+// for the garbage collector.
+static bool call_register(Value* base, int arg_count)
+{
+    Value callee = *base;
+    if (IS_OBJ(callee))
+    {
+        switch (OBJ_TYPE(callee))
+        {
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = AS_CLOSURE(callee);
+            if (!closure->function->register_code)
+                return call_stack_from_registers(closure, base, arg_count);
+            if (!push_frame(closure, arg_count, base))
+                return false;
+            Value* top = base + closure->function->slot_count - 1;
+            while (vm.stack_top < top)
+                *vm.stack_top++ = NIL_VAL;
+            return true;
+        }
+        case OBJ_NATIVE:
+            *base = AS_NATIVE(callee)(arg_count, base + 1);
+            return true;
+        default:
+            break;
+        }
+    }
+
+    runtime_error("Can only call functions and classes");
+    return false;
+}
+
+// Runs until the frame on top returns, like run().
+static InterpretResult run_registers()
+{
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    Value*     r = frame->slots;
+    int        base = vm.frame_count - 1;
+
+#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT() (frame->ip += 2, (u16)(frame->ip[-2] << 8) | frame->ip[-1])
+#define CONSTANTS() (frame->closure->function->chunk.constants.values)
+#define REGISTER() (r[READ_BYTE()])
+#define SMALL_CONSTANT() (CONSTANTS()[READ_BYTE()])
+#define NUMBER_OPERANDS(b, c)                                                  \
+    do                                                                         \
+    {                                                                          \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c))                                    \
+        {                                                                      \
+            runtime_error("Operands must be numbers ");                        \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+    } while (false)
+#define BINARY_OP(value_type, op, right)                                       \
+    do                                                                         \
+    {                                                                          \
+        u8    a = READ_BYTE();                                                 \
+        Value b = REGISTER();                                                  \
+        Value c = right;                                                       \
+        NUMBER_OPERANDS(b, c);                                                 \
+        r[a] = value_type(AS_NUMBER(b) op AS_NUMBER(c));                       \
+    } while (false)
+#define ADD_OP(right)                                                          \
+    do                                                                         \
+    {                                                                          \
+        u8    a = READ_BYTE();                                                 \
+        Value b = REGISTER();                                                  \
+        Value c = right;                                                       \
+        if (IS_NUMBER(b) && IS_NUMBER(c))                                      \
+            r[a] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));                    \
+        else if (IS_STRING(b) && IS_STRING(c))                                 \
+            r[a] = OBJ_VAL(concatenate_strings(AS_STRING(b), AS_STRING(c)));   \
+        else                                                                   \
+        {                                                                      \
+            runtime_error("Operands must be two numbers or strings");          \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+    } while (false)
+#define EQUAL_OP(negate, right)                                                \
+    do                                                                         \
+    {                                                                          \
+        u8    a = READ_BYTE();                                                 \
+        Value b = REGISTER();                                                  \
+        Value c = right;                                                       \
+        r[a] = BOOL_VAL(values_equal(b, c) != negate);                         \
+    } while (false)
+#define COMPARE_JUMP(op, right)                                                \
+    do                                                                         \
+    {                                                                          \
+        Value b = REGISTER();                                                  \
+        Value c = right;                                                       \
+        NUMBER_OPERANDS(b, c);                                                 \
+        u16 offset = READ_SHORT();                                             \
+        if (!(AS_NUMBER(b) op AS_NUMBER(c)))                                   \
+            frame->ip += offset;                                               \
+    } while (false)
+#define EQUAL_JUMP(negate, right)                                              \
+    do                                                                         \
+    {                                                                          \
+        Value b = REGISTER();                                                  \
+        Value c = right;                                                       \
+        u16   offset = READ_SHORT();                                           \
+        if (values_equal(b, c) == negate)                                      \
+            frame->ip += offset;                                               \
+    } while (false)
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+#define BEFORE_INSTRUCTION() (vm.instruction_count++)
+#else
+#define BEFORE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef THREADED_DISPATCH
+    static void* dispatch_table[] = {
+        [REG_LOADK] = &&label_REG_LOADK,
+        [REG_LOADNIL] = &&label_REG_LOADNIL,
+        [REG_LOADTRUE] = &&label_REG_LOADTRUE,
+        [REG_LOADFALSE] = &&label_REG_LOADFALSE,
+        [REG_MOVE] = &&label_REG_MOVE,
+        [REG_GET_GLOBAL] = &&label_REG_GET_GLOBAL,
+        [REG_DEFINE_GLOBAL] = &&label_REG_DEFINE_GLOBAL,
+        [REG_SET_GLOBAL] = &&label_REG_SET_GLOBAL,
+        [REG_GET_UPVALUE] = &&label_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE] = &&label_REG_SET_UPVALUE,
+        [REG_ADD] = &&label_REG_ADD,
+        [REG_SUBSTRACT] = &&label_REG_SUBSTRACT,
+        [REG_MULTIPLY] = &&label_REG_MULTIPLY,
+        [REG_DIVIDE] = &&label_REG_DIVIDE,
+        [REG_EQUAL] = &&label_REG_EQUAL,
+        [REG_NOT_EQUAL] = &&label_REG_NOT_EQUAL,
+        [REG_GREATER] = &&label_REG_GREATER,
+        [REG_LESS] = &&label_REG_LESS,
+        [REG_ADD_K] = &&label_REG_ADD_K,
+        [REG_SUBSTRACT_K] = &&label_REG_SUBSTRACT_K,
+        [REG_MULTIPLY_K] = &&label_REG_MULTIPLY_K,
+        [REG_DIVIDE_K] = &&label_REG_DIVIDE_K,
+        [REG_EQUAL_K] = &&label_REG_EQUAL_K,
+        [REG_NOT_EQUAL_K] = &&label_REG_NOT_EQUAL_K,
+        [REG_GREATER_K] = &&label_REG_GREATER_K,
+        [REG_LESS_K] = &&label_REG_LESS_K,
+        [REG_EQUAL_JUMP_IF_FALSE] = &&label_REG_EQUAL_JUMP_IF_FALSE,
+        [REG_NOT_EQUAL_JUMP_IF_FALSE] = &&label_REG_NOT_EQUAL_JUMP_IF_FALSE,
+        [REG_GREATER_JUMP_IF_FALSE] = &&label_REG_GREATER_JUMP_IF_FALSE,
+        [REG_LESS_JUMP_IF_FALSE] = &&label_REG_LESS_JUMP_IF_FALSE,
+        [REG_EQUAL_K_JUMP_IF_FALSE] = &&label_REG_EQUAL_K_JUMP_IF_FALSE,
+        [REG_NOT_EQUAL_K_JUMP_IF_FALSE] =
+            &&label_REG_NOT_EQUAL_K_JUMP_IF_FALSE,
+        [REG_GREATER_K_JUMP_IF_FALSE] = &&label_REG_GREATER_K_JUMP_IF_FALSE,
+        [REG_LESS_K_JUMP_IF_FALSE] = &&label_REG_LESS_K_JUMP_IF_FALSE,
+        [REG_NOT] = &&label_REG_NOT,
+        [REG_NEGATE] = &&label_REG_NEGATE,
+        [REG_PRINT] = &&label_REG_PRINT,
+        [REG_JUMP] = &&label_REG_JUMP,
+        [REG_LOOP] = &&label_REG_LOOP,
+        [REG_JUMP_IF_FALSE] = &&label_REG_JUMP_IF_FALSE,
+        [REG_CALL] = &&label_REG_CALL,
+        [REG_CLOSURE] = &&label_REG_CLOSURE,
+        [REG_CLOSE_UPVALUE] = &&label_REG_CLOSE_UPVALUE,
+        [REG_RETURN] = &&label_REG_RETURN,
+    };
+
+#define DISPATCH()                                                             \
+    do                                                                         \
+    {                                                                          \
+        BEFORE_INSTRUCTION();                                                  \
+        goto* dispatch_table[READ_BYTE()];                                     \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) label_##op
+#define NEXT() DISPATCH()
+#else
+#define INTERPRET_LOOP                                                         \
+    for (;;)                                                                   \
+        switch (BEFORE_INSTRUCTION(), READ_BYTE())
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(REG_LOADK):
+        {
+            u8 a = READ_BYTE();
+            r[a] = CONSTANTS()[READ_SHORT()];
+            NEXT();
+        }
+        CASE(REG_LOADNIL):
+            REGISTER() = NIL_VAL;
+            NEXT();
+        CASE(REG_LOADTRUE):
+            REGISTER() = BOOL_VAL(true);
+            NEXT();
+        CASE(REG_LOADFALSE):
+            REGISTER() = BOOL_VAL(false);
+            NEXT();
+        CASE(REG_MOVE):
+        {
+            u8 a = READ_BYTE();
+            r[a] = REGISTER();
+            NEXT();
+        }
+        CASE(REG_GET_GLOBAL):
+        {
+            u8    a = READ_BYTE();
+            u16   slot = READ_SHORT();
+            Value value = vm.global_values[slot];
+            if (IS_UNDEFINED(value))
+            {
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            r[a] = value;
+            NEXT();
+        }
+        CASE(REG_DEFINE_GLOBAL):
+        {
+            u8 a = READ_BYTE();
+            vm.global_values[READ_SHORT()] = r[a];
+            NEXT();
+        }
+        CASE(REG_SET_GLOBAL):
+        {
+            u8  a = READ_BYTE();
+            u16 slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values[slot]))
+            {
+                runtime_error("Undefined Variable %s",
+                              vm.global_names[slot].name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.global_values[slot] = r[a];
+            NEXT();
+        }
+        CASE(REG_GET_UPVALUE):
+        {
+            u8 a = READ_BYTE();
+            r[a] = *frame->closure->upvalues[READ_BYTE()]->location;
+            NEXT();
+        }
+        CASE(REG_SET_UPVALUE):
+        {
+            u8          a = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = r[a];
+            write_barrier((Obj*)upvalue, r[a]);
+            NEXT();
+        }
+        CASE(REG_ADD):
+            ADD_OP(REGISTER());
+            NEXT();
+        CASE(REG_SUBSTRACT):
+            BINARY_OP(NUMBER_VAL, -, REGISTER());
+            NEXT();
+        CASE(REG_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *, REGISTER());
+            NEXT();
+        CASE(REG_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /, REGISTER());
+            NEXT();
+        CASE(REG_EQUAL):
+            EQUAL_OP(false, REGISTER());
+            NEXT();
+        CASE(REG_NOT_EQUAL):
+            EQUAL_OP(true, REGISTER());
+            NEXT();
+        CASE(REG_GREATER):
+            BINARY_OP(BOOL_VAL, >, REGISTER());
+            NEXT();
+        CASE(REG_LESS):
+            BINARY_OP(BOOL_VAL, <, REGISTER());
+            NEXT();
+        CASE(REG_ADD_K):
+            ADD_OP(SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_SUBSTRACT_K):
+            BINARY_OP(NUMBER_VAL, -, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_MULTIPLY_K):
+            BINARY_OP(NUMBER_VAL, *, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_DIVIDE_K):
+            BINARY_OP(NUMBER_VAL, /, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_EQUAL_K):
+            EQUAL_OP(false, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_NOT_EQUAL_K):
+            EQUAL_OP(true, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_GREATER_K):
+            BINARY_OP(BOOL_VAL, >, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_LESS_K):
+            BINARY_OP(BOOL_VAL, <, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_EQUAL_JUMP_IF_FALSE):
+            EQUAL_JUMP(false, REGISTER());
+            NEXT();
+        CASE(REG_NOT_EQUAL_JUMP_IF_FALSE):
+            EQUAL_JUMP(true, REGISTER());
+            NEXT();
+        CASE(REG_GREATER_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, REGISTER());
+            NEXT();
+        CASE(REG_LESS_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, REGISTER());
+            NEXT();
+        CASE(REG_EQUAL_K_JUMP_IF_FALSE):
+            EQUAL_JUMP(false, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_NOT_EQUAL_K_JUMP_IF_FALSE):
+            EQUAL_JUMP(true, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_GREATER_K_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_LESS_K_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, SMALL_CONSTANT());
+            NEXT();
+        CASE(REG_NOT):
+        {
+            u8 a = READ_BYTE();
+            r[a] = BOOL_VAL(is_falsey(REGISTER()));
+            NEXT();
+        }
+        CASE(REG_NEGATE):
+        {
+            u8    a = READ_BYTE();
+            Value b = REGISTER();
+            if (!IS_NUMBER(b))
+            {
+                runtime_error("Operand must be a number");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            r[a] = NUMBER_VAL(-AS_NUMBER(b));
+            NEXT();
+        }
+        CASE(REG_PRINT):
+            print_value(REGISTER());
+            printf("\n");
+            NEXT();
+        CASE(REG_JUMP):
+        {
+            u16 offset = READ_SHORT();
+            frame->ip += offset;
+            NEXT();
+        }
+        CASE(REG_LOOP):
+        {
+            u16 offset = READ_SHORT();
+            frame->ip -= offset;
+            SAFEPOINT();
+            NEXT();
+        }
+        CASE(REG_JUMP_IF_FALSE):
+        {
+            Value condition = REGISTER();
+            u16   offset = READ_SHORT();
+            if (is_falsey(condition))
+                frame->ip += offset;
+            NEXT();
+        }
+        CASE(REG_CALL):
+        {
+            u8 a = READ_BYTE();
+            u8 arg_count = READ_BYTE();
+            if (!call_register(r + a, arg_count))
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frame_count - 1];
+            r = frame->slots;
+            SAFEPOINT();
+            NEXT();
+        }
+        CASE(REG_CLOSURE):
+        {
+            u8           a = READ_BYTE();
+            ObjFunction* function = AS_FUNCTION(CONSTANTS()[READ_SHORT()]);
+            ObjClosure*  closure = new_closure(function);
+            r[a] = OBJ_VAL(closure);
+            for (int i = 0; i < closure->upvalue_count; i++)
+            {
+                u8 islocal = READ_BYTE();
+                u8 index = READ_BYTE();
+                if (islocal)
+                    closure->upvalues[i] = capture_upvalue(r + index);
+                else
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+            }
+            NEXT();
+        }
+        CASE(REG_CLOSE_UPVALUE):
+            close_upvalues(&REGISTER());
+            NEXT();
+        CASE(REG_RETURN):
+        {
+            Value result = REGISTER();
+            close_upvalues(r);
+
+            // the callee's first register is the caller's call register
+            *r = result;
+            if (--vm.frame_count == base)
+            {
+                if (base == 0)
+                    vm.stack_top = vm.stack;
+                return INTERPRET_OK;
+            }
+
+            frame = &vm.frames[vm.frame_count - 1];
+            r = frame->slots;
+            SAFEPOINT();
+            NEXT();
+        }
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef CONSTANTS
+#undef REGISTER
+#undef SMALL_CONSTANT
+#undef NUMBER_OPERANDS
+#undef BINARY_OP
+#undef ADD_OP
+#undef EQUAL_OP
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef BEFORE_INSTRUCTION
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
 }
 
 InterpretResult interpret(char* source)
 {
-    ObjFunction* function = compile(source);
+    return interpret_function(compile(source));
+}
+
+InterpretResult interpret_function(ObjFunction* function)
+{
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
@@ -451,7 +1697,14 @@ InterpretResult interpret(char* source)
     ObjClosure* closure = new_closure(function);
     pop();
     push(OBJ_VAL(closure));
+    if (function->register_code)
+    {
+        call_register(vm.stack_top - 1, 0);
+        return run_registers();
+    }
     call_value(OBJ_VAL(closure), 0);
+    // a run that stopped on an error may have left a recording behind
+    vm.recording = false;
 
     return run();
 }
@@ -10,6 +10,18 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+#define GC_PAUSE_BUCKETS 24
+
+// Collector pauses bucketed by powers of two microseconds: bucket i counts
+// pauses shorter than 2^i us.
+typedef struct
+{
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 buckets[GC_PAUSE_BUCKETS];
+} PauseHistogram;
+
 typedef struct
 {
     ObjClosure* closure;
@@ -17,16 +29,68 @@ typedef struct
     Value*      slots;
 } CallFrame;
 
+// Globals live in a flat array the compiler indexes into. Slots are handed
+// out by name at compile time, so a program can refer to a global before
+// the code defining it has run.
+typedef struct
+{
+    ObjString* name;
+    bool       is_immutable;  // declared with val
+} GlobalName;
+
 typedef struct
 {
     CallFrame frames[FRAMES_MAX];
     int       frame_count;
     Value     stack[STACK_MAX];
     Value*    stack_top;
-    Table     globals;
+    Table       global_slots;    // name -> NUMBER_VAL(index)
+    Value*      global_values;   // UNDEFINED_VAL until the global is defined
+    GlobalName* global_names;
+    int         global_count;
+    int         global_capacity;
     Table     strings;  // for string interning just like (string pool in java)
     ObjUpvalue* open_upvalues;
-    Obj*        objects;
+
+    size_t bytes_allocated;
+    size_t next_gc;
+    Obj*   objects;
+    int    gray_count;
+    int    gray_capacity;
+    Obj**  gray_stack;
+
+    bool           gc_incremental;
+    bool           gc_concurrent_sweep;
+    bool           sweeping;  // a background sweep owns the old object list
+    bool           gc_marking;  // an incremental cycle is in progress
+    u64            gc_max_pause_ns;
+    PauseHistogram gc_pauses;     // full collections and incremental slices
+    PauseHistogram minor_pauses;  // nursery collections
+
+    u8*   nursery;
+    u8*   nursery_top;
+    u8*   nursery_end;
+    bool  minor_gc_pending;
+    bool  collecting;  // inside a collection, for the profiler
+    int   remembered_count;
+    int   remembered_capacity;
+    Obj** remembered;
+    bool trace_execution;  // --trace: print the stack before every opcode
+    bool print_code;       // --print-code: disassemble each compiled function
+    bool optimize_code;    // cleared by --no-optimize: skip optimize_chunk()
+    bool register_mode;    // --registers: compile to and run register code
+    bool jit_enabled;      // cleared by --no-jit: never compile hot code
+    bool use_cache;        // cleared by --no-cache: no .loxc files
+    bool recording;        // run() is recording a trace of a hot loop
+    bool collect_stats;    // --stats: count opcodes, branches and calls
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    u64 instruction_count;
+#endif
+#ifdef DEBUG_PROFILE_PAIRS
+    u8  previous_opcode;
+    u64 pair_counts[UINT8_COUNT][UINT8_COUNT];
+#endif
 } VM;
 
 typedef enum
@@ -41,6 +105,12 @@ extern VM vm;
 void            init_VM();
 void            free_VM();
 InterpretResult interpret(char* source);
+// Runs a compiled script; NULL for one that did not compile.
+InterpretResult interpret_function(ObjFunction* function);
+int             global_slot(ObjString* name);
+// The line of the instruction the frame is at; for a frame in machine
+// code, of the last one that synced its ip. Safe in a signal handler.
+int             frame_line(CallFrame* frame);
 void            push(Value value);
 Value           pop();
 
@@ -0,0 +1,170 @@
+// truncate(), link(), getpid() and umask() are not C99
+#define _DEFAULT_SOURCE
+
+#include "../src/cache.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char         source_path[64];
+static char         cache_path[64];
+static char         kept_path[64];
+static ObjFunction* last_script;
+
+static const char* source = "var total = 0;"
+                            "fun add(n) { total = total + n; return total; }"
+                            "for (var i = 0; i < 10; i = i + 1) add(i);"
+                            "print total;";
+
+static void setup()
+{
+    init_VM();
+    snprintf(source_path, sizeof(source_path), "/tmp/cache_test_%ld.lox",
+             (long)getpid());
+    snprintf(cache_path, sizeof(cache_path), "%sc", source_path);
+    snprintf(kept_path, sizeof(kept_path), "%s.kept", cache_path);
+    remove(cache_path);
+    remove(kept_path);
+}
+
+static void teardown()
+{
+    remove(cache_path);
+    remove(kept_path);
+    free_VM();
+}
+
+TestSuite(cache, .init = setup, .fini = teardown);
+
+// Compiles source through the cache, keeping the script on the stack so
+// the next compile does not collect it.
+static ObjFunction* compile_through_cache(const char* code)
+{
+    ObjFunction* script = compile_cached(source_path, code);
+    cr_assert_not_null(script);
+    push(OBJ_VAL(script));
+    last_script = script;
+    return script;
+}
+
+static long cache_size()
+{
+    struct stat file;
+    return stat(cache_path, &file) == 0 ? (long)file.st_size : -1;
+}
+
+// Whether compiling code went past the cache: a cache that is not used is
+// written again, and renamed over the old file. A second link keeps the
+// old file, so its inode cannot be handed to the new one.
+static bool compiled_past_cache(const char* code)
+{
+    remove(kept_path);
+    cr_assert_eq(link(cache_path, kept_path), 0);
+    compile_through_cache(code);
+
+    struct stat kept, cache;
+    cr_assert_eq(stat(kept_path, &kept), 0);
+    cr_assert_eq(stat(cache_path, &cache), 0);
+    return kept.st_ino != cache.st_ino;
+}
+
+Test(cache, should_write_a_cache_and_read_it_back)
+{
+    ObjFunction* compiled = compile_through_cache(source);
+    cr_assert_eq(compiled->chunk.mapped, false);
+    cr_assert_gt(cache_size(), 0);
+
+    cr_assert_not(compiled_past_cache(source));
+    ObjFunction* cached = last_script;
+    cr_assert_eq(cached->chunk.mapped, true);
+    cr_assert_eq(cached->chunk.count, compiled->chunk.count);
+    cr_assert_eq(memcmp(cached->chunk.code, compiled->chunk.code,
+                        compiled->chunk.count),
+                 0);
+    cr_assert_eq(interpret_function(cached), INTERPRET_OK);
+}
+
+Test(cache, should_recompile_a_changed_source)
+{
+    compile_through_cache(source);
+    cr_assert(compiled_past_cache("print 1;"));
+    ObjFunction* changed = last_script;
+    cr_assert_eq(AS_NUMBER(changed->chunk.constants.values[0]), 1);
+
+    // and the cache now holds the new source
+    cr_assert_not(compiled_past_cache("print 1;"));
+}
+
+Test(cache, should_recompile_for_other_flags)
+{
+    compile_through_cache(source);
+
+    vm.register_mode = true;
+    cr_assert(compiled_past_cache(source));
+    cr_assert_not(compiled_past_cache(source));
+
+    vm.register_mode = false;
+    vm.optimize_code = false;
+    cr_assert(compiled_past_cache(source));
+    cr_assert_not(compiled_past_cache(source));
+}
+
+Test(cache, should_recompile_over_a_truncated_cache)
+{
+    compile_through_cache(source);
+    long size = cache_size();
+    cr_assert_eq(truncate(cache_path, size / 2), 0);
+
+    cr_assert(compiled_past_cache(source));
+    cr_assert_eq(cache_size(), size);
+    cr_assert_eq(interpret_function(last_script), INTERPRET_OK);
+}
+
+Test(cache, should_recompile_over_a_corrupt_cache)
+{
+    compile_through_cache(source);
+    long size = cache_size();
+
+    // a few bits in the code and constants, past the header
+    FILE* file = fopen(cache_path, "r+b");
+    cr_assert_not_null(file);
+    for (long offset = size / 2; offset < size; offset += size / 8)
+    {
+        fseek(file, offset, SEEK_SET);
+        int byte = fgetc(file);
+        fseek(file, offset, SEEK_SET);
+        fputc(byte ^ 0x5a, file);
+    }
+    fclose(file);
+
+    cr_assert(compiled_past_cache(source));
+    cr_assert_eq(interpret_function(last_script), INTERPRET_OK);
+    cr_assert_not(compiled_past_cache(source));
+}
+
+Test(cache, should_write_the_cache_like_any_new_file)
+{
+    mode_t mask = umask(022);
+    compile_through_cache(source);
+    umask(mask);
+
+    struct stat file;
+    cr_assert_eq(stat(cache_path, &file), 0);
+    cr_assert_eq(file.st_mode & 0777, 0644);
+
+    // and nothing is left behind under the temporary name
+    const char*    name = strrchr(cache_path, '/') + 1;
+    size_t         length = strlen(name);
+    DIR*           directory = opendir("/tmp");
+    struct dirent* entry;
+    cr_assert_not_null(directory);
+    while ((entry = readdir(directory)) != NULL)
+        cr_assert_not(strncmp(entry->d_name, name, length) == 0 &&
+                      entry->d_name[length] == '.');
+    closedir(directory);
+}
@@ -1,92 +1,200 @@
 #include "../src/compiler.h"
 #include "../src/debug.h"
+#include "../src/vm.h"
 #include <criterion/criterion.h>
 #include <criterion/internal/assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-static void assert_bytecode(Chunk* chunk, const u8* expected, int count);
-static void assert_constants(Chunk* chunk, const double* expected, int count);
+static Chunk* compile_chunk(const char* source);
+static void   assert_bytecode(Chunk* chunk, const u8* expected, int count);
+static void   assert_constants(Chunk* chunk, const double* expected, int count);
+
+TestSuite(compiler, .init = init_VM, .fini = free_VM);
 
 Test(compiler, should_compile_expressions)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char*   source = "print 3 + 2;";
-    bool    result = compile(source, &chunk);
-    u8 expected_bytes[] = {OP_CONSTANT, 0,        OP_CONSTANT, 1,
-                                OP_ADD,      OP_PRINT, OP_RETURN};
-    double  expected_constants[] = {3, 2};
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, expected_bytes, 7);
-    assert_constants(&chunk, expected_constants, 2);
+    Chunk*  chunk = compile_chunk("print 3 + 2;");
+    u8      expected_bytes[] = {OP_CONSTANT, 0,      OP_PRINT,
+                                OP_NIL,      OP_RETURN};
+    double  expected_constants[] = {5};
+    assert_bytecode(chunk, expected_bytes, 5);
+    assert_constants(chunk, expected_constants, 1);
 }
 
+// Variable operands keep the compiler from folding, so the order of the
+// emitted arithmetic shows precedence and grouping.
 Test(compiler, should_start_with_multiplication)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char*   source = "print 3 + 2 * 9;";
-    bool    result = compile(source, &chunk);
-    u8 expected_bytes[] = {OP_CONSTANT, 0,        OP_CONSTANT, 1,
-                                OP_CONSTANT, 2,        OP_MULTIPLY, OP_ADD,
-                                OP_PRINT,    OP_RETURN};
-    double  expected_constants[] = {3, 2, 9};
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, expected_bytes, 10);
-    assert_constants(&chunk, expected_constants, 3);
+    Chunk*  chunk = compile_chunk("{ var a = 3; print a + a * a; }");
+    u8      expected_bytes[] = {OP_CONSTANT,  0,           OP_GET_LOCAL, 1,
+                                OP_GET_LOCAL, 1,           OP_GET_LOCAL, 1,
+                                OP_MULTIPLY,  OP_ADD,      OP_PRINT,     OP_POP,
+                                OP_NIL,       OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 14);
 }
 
 Test(compiler, should_respect_grouping)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char*   source = "print 3 + 2 * (9 + 3);";
-    bool    result = compile(source, &chunk);
-    u8 expected_bytes[] = {OP_CONSTANT, 0,           OP_CONSTANT, 1,
-                                OP_CONSTANT, 2,           OP_CONSTANT, 3,
-                                OP_ADD,      OP_MULTIPLY, OP_ADD,      OP_PRINT,
-                                OP_RETURN};
-    double  expected_constants[] = {3, 2, 9, 3};
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, expected_bytes, 13);
-    assert_constants(&chunk, expected_constants, 4);
+    Chunk*  chunk = compile_chunk("{ var a = 3; print a * (a + a); }");
+    u8      expected_bytes[] = {OP_CONSTANT,  0,           OP_GET_LOCAL, 1,
+                                OP_GET_LOCAL, 1,           OP_GET_LOCAL, 1,
+                                OP_ADD,       OP_MULTIPLY, OP_PRINT,     OP_POP,
+                                OP_NIL,       OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 14);
+}
+
+Test(compiler, should_fold_grouped_literals)
+{
+    Chunk*  chunk = compile_chunk("print 3 + 2 * (9 + 3);");
+    u8      expected_bytes[] = {OP_CONSTANT, 0,      OP_PRINT,
+                                OP_NIL,      OP_RETURN};
+    double  expected_constants[] = {27};
+    assert_bytecode(chunk, expected_bytes, 5);
+    assert_constants(chunk, expected_constants, 1);
 }
 
 Test(compiler, should_compile_nil)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char* source = "print nil;";
-    bool  result = compile(source, &chunk);
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, (u8[]){OP_NIL, OP_PRINT, OP_RETURN}, 3);
+    Chunk* chunk = compile_chunk("print nil;");
+    assert_bytecode(chunk, (u8[]){OP_NIL, OP_PRINT, OP_NIL, OP_RETURN}, 4);
 }
 
 Test(compiler, should_compile_booleans)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char* source = "print true;";
-    bool  result = compile(source, &chunk);
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, (u8[]){OP_TRUE, OP_PRINT, OP_RETURN}, 3);
+    Chunk* chunk = compile_chunk("print true;");
+    assert_bytecode(chunk, (u8[]){OP_TRUE, OP_PRINT, OP_NIL, OP_RETURN}, 4);
 }
 
 Test(compiler, should_compile_equality_expressions)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-    char*   source = "print 12 == 6 * 2;";
-    bool    result = compile(source, &chunk);
-    u8 expected_bytecodes[] = {
-        OP_CONSTANT, 0,           OP_CONSTANT, 1,        OP_CONSTANT,
-        2,           OP_MULTIPLY, OP_EQUAL,    OP_PRINT, OP_RETURN};
-    double expected_constants[] = {12, 6, 2};
-    cr_assert_eq(result, true);
-    assert_bytecode(&chunk, expected_bytecodes, 10);
-    assert_constants(&chunk, expected_constants, 3);
+    Chunk* chunk = compile_chunk("print 12 == 6 * 2;");
+    assert_bytecode(chunk, (u8[]){OP_TRUE, OP_PRINT, OP_NIL, OP_RETURN}, 4);
+    cr_assert_eq(chunk->constants.count, 0);
+}
+
+Test(compiler, should_fold_string_concatenation)
+{
+    Chunk* chunk = compile_chunk("print \"ab\" + \"cd\";");
+    assert_bytecode(chunk,
+                    (u8[]){OP_CONSTANT, 0, OP_PRINT, OP_NIL, OP_RETURN}, 5);
+    cr_assert_eq(chunk->constants.count, 1);
+    cr_assert_str_eq(AS_CSTRING(chunk->constants.values[0]), "abcd");
+}
+
+Test(compiler, should_fold_division_by_zero_like_the_vm)
+{
+    Chunk* chunk = compile_chunk("print 1 / 0; print -1 / 0;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               1,           OP_PRINT, OP_NIL,   OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 8);
+    cr_assert(isinf(AS_NUMBER(chunk->constants.values[0])));
+    cr_assert_gt(AS_NUMBER(chunk->constants.values[0]), 0);
+    cr_assert(isinf(AS_NUMBER(chunk->constants.values[1])));
+    cr_assert_lt(AS_NUMBER(chunk->constants.values[1]), 0);
+}
+
+Test(compiler, should_fold_negated_literals)
+{
+    Chunk* chunk = compile_chunk("print -3; print -(2 * 3);");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               1,           OP_PRINT, OP_NIL,   OP_RETURN};
+    double expected_constants[] = {-3, -6};
+    assert_bytecode(chunk, expected_bytes, 8);
+    assert_constants(chunk, expected_constants, 2);
+    cr_assert_eq(chunk->constants.count, 2);
+}
+
+Test(compiler, should_leave_operands_the_vm_rejects_to_runtime)
+{
+    Chunk* chunk = compile_chunk("print -\"a\"; print \"a\" + 1;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_NEGATE,   OP_PRINT,
+                               OP_CONSTANT, 0,        OP_CONSTANT, 1,
+                               OP_ADD,      OP_PRINT, OP_NIL,      OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 12);
+}
+
+Test(compiler, should_drop_the_constants_of_folded_operands)
+{
+    Chunk* chunk = compile_chunk("print 4 + 1; print 6;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               1,           OP_PRINT, OP_NIL,   OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 8);
+    assert_constants(chunk, (double[]){5, 6}, 2);
+    cr_assert_eq(chunk->constants.count, 2);
 }
+
+Test(compiler, should_share_the_slot_of_a_folded_constant)
+{
+    Chunk* chunk = compile_chunk("print 1 + 2; print 3;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               0,           OP_PRINT, OP_NIL,   OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 8);
+    assert_constants(chunk, (double[]){3}, 1);
+    cr_assert_eq(chunk->constants.count, 1);
+}
+
+Test(compiler, should_reuse_slots_dropped_by_folding)
+{
+    // 4 stays in the slot it shares, 1 is dropped and 5 takes its slot
+    Chunk* chunk = compile_chunk("print 4; print 4 + 1; print 5;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               1,           OP_PRINT, OP_CONSTANT, 1,
+                               OP_PRINT,    OP_NIL,   OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 11);
+    assert_constants(chunk, (double[]){4, 5}, 2);
+    cr_assert_eq(chunk->constants.count, 2);
+}
+
+Test(compiler, should_keep_zero_and_negative_zero_apart)
+{
+    Chunk* chunk = compile_chunk("print 0; print -0;");
+    u8     expected_bytes[] = {OP_CONSTANT, 0,        OP_PRINT, OP_CONSTANT,
+                               1,           OP_PRINT, OP_NIL,   OP_RETURN};
+    assert_bytecode(chunk, expected_bytes, 8);
+    cr_assert_eq(chunk->constants.count, 2);
+    cr_assert_not(signbit(AS_NUMBER(chunk->constants.values[0])));
+    cr_assert(signbit(AS_NUMBER(chunk->constants.values[1])));
+}
+
+Test(compiler, should_assign_captured_variables)
+{
+    // upvalue indexes that are also slots of immutable globals
+    char* source = "val g0 = 0; val g1 = 0; val g2 = 0; val g3 = 0;"
+                   "val g4 = 0; val g5 = 0; val g6 = 0; val g7 = 0;"
+                   "val g8 = 0; val g9 = 0; val g10 = 0; val g11 = 0;"
+                   "fun outer() {"
+                   "  var a = 1; var b = 1; var c = 1; var d = 1;"
+                   "  var e = 1; var f = 1; var g = 1; var h = 1;"
+                   "  var i = 1; var j = 1; var k = 1; var l = 12;"
+                   "  fun inner() {"
+                   "    a = a; b = b; c = c; d = d; e = e; f = f;"
+                   "    g = g; h = h; i = i; j = j; k = k; l = l + 1;"
+                   "  }"
+                   "}";
+    cr_assert_not_null(compile(source));
+}
+
+Test(compiler, should_reject_assigning_captured_immutables)
+{
+    cr_assert_null(compile("fun f() { val x = 1; fun g() { x = 2; } }"));
+    cr_assert_null(compile("fun f() { val x = 1;"
+                           "  fun g() { fun h() { x = 2; } } }"));
+    cr_assert_null(compile("val x = 1; fun f() { x = 2; }"));
+}
+
+// The function compiled from source, kept on the stack so the collector
+// leaves it alone.
+static Chunk* compile_chunk(const char* source)
+{
+    ObjFunction* function = compile(source);
+    cr_assert_not_null(function, "'%s' should compile", source);
+    push(OBJ_VAL(function));
+    return &function->chunk;
+}
+
 static void assert_bytecode(Chunk* chunk, const u8* expected, int count)
 {
     cr_assert_eq(chunk->count, count);
@@ -104,6 +212,6 @@ static void assert_constants(Chunk* chunk, const double* expected, int count)
     {
         cr_assert_eq(AS_NUMBER(chunk->constants.values[i]), expected[i],
                      "constant[%d]: expected %f, got %f", i, expected[i],
-                     chunk->constants.values[i]);
+                     AS_NUMBER(chunk->constants.values[i]));
     }
 }
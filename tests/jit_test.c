@@ -0,0 +1,117 @@
+#include "../src/compiler.h"
+#include "../src/jit.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <criterion/redirect.h>
+#include <string.h>
+
+// Every program leaves its answer in the global result. The loops run
+// past JIT_CALL_THRESHOLD calls and HOTLOOP_COUNT iterations, so the
+// second run has them in machine code.
+static double run_program(const char* source, bool jit,
+                          InterpretResult expected);
+static void   assert_same_result(const char* source);
+static Value  global(const char* name);
+
+Test(jit, should_match_the_interpreter)
+{
+    assert_same_result("fun poly(x) { var y = x * x - 3 * x + 2;"
+                       "  if (y > 50) return y / 2; return -y; }"
+                       "var result = 0;"
+                       "for (var i = 0; i < 300; i = i + 1)"
+                       "  result = result + poly(i);");
+    assert_same_result("fun fib(n) { if (n < 2) return n;"
+                       "  return fib(n - 1) + fib(n - 2); }"
+                       "var result = fib(20);");
+    assert_same_result("fun counter() { var c = 0;"
+                       "  fun inc() { c = c + 1; return c; } return inc; }"
+                       "var inc = counter(); var result = 0;"
+                       "for (var i = 0; i < 250; i = i + 1)"
+                       "  result = result + inc();");
+    assert_same_result("fun twice(s) { return s + s; }"
+                       "var result = 0;"
+                       "for (var i = 0; i < 200; i = i + 1)"
+                       "  if (twice(\"ab\") == \"abab\") result = result + 1;");
+    assert_same_result("var result = 0;"
+                       "for (var i = 0; i < 1000; i = i + 1)"
+                       "  if (i < 500) result = result + i * 2;"
+                       "  else result = result - 1;");
+}
+
+Test(jit, should_compile_hot_code)
+{
+    init_VM();
+    ObjFunction* script = compile("fun poly(x) { return x * x + 1; }"
+                                  "var result = 0;"
+                                  "for (var i = 0; i < 300; i = i + 1)"
+                                  "  result = result + poly(i);"
+                                  "for (var i = 0; i < 300; i = i + 1)"
+                                  "  result = result - i;");
+    cr_assert_not_null(script);
+    cr_assert_eq(interpret_function(script), INTERPRET_OK);
+#ifdef JIT
+    cr_assert_not_null(script->traces);
+    cr_assert_not_null(AS_CLOSURE(global("poly"))->function->jit);
+#endif
+    cr_assert_eq(AS_NUMBER(global("result")), 8910500);
+    free_VM();
+}
+
+// The error is raised in the machine code of add, then on the way out of
+// a trace; the lines are those of the interpreter either way.
+Test(jit, should_report_errors_in_compiled_code, .init = cr_redirect_stderr)
+{
+    const char* call = "fun add(a, b) {\n"
+                       "  return a + b;\n"
+                       "}\n"
+                       "var result = 0;\n"
+                       "for (var i = 0; i < 150; i = i + 1)"
+                       "  result = add(result, i);\n"
+                       "add(result, nil);\n";
+    const char* loop = "var result = 0;\n"
+                       "var step = 1;\n"
+                       "for (var i = 0; i < 200; i = i + 1) {\n"
+                       "  if (i == 150) step = nil;\n"
+                       "  result = result + step;\n"
+                       "}\n";
+    cr_assert_eq(run_program(call, false, INTERPRET_RUNTIME_ERROR),
+                 run_program(call, true, INTERPRET_RUNTIME_ERROR));
+    cr_assert_eq(run_program(loop, false, INTERPRET_RUNTIME_ERROR),
+                 run_program(loop, true, INTERPRET_RUNTIME_ERROR));
+    cr_assert_stderr_eq_str("Operands must be two numbers or strings\n"
+                            "[line 2] in add()\n"
+                            "[line 6] in script\n"
+                            "Operands must be two numbers or strings\n"
+                            "[line 2] in add()\n"
+                            "[line 6] in script\n"
+                            "Operands must be two numbers or strings\n"
+                            "[line 5] in script\n"
+                            "Operands must be two numbers or strings\n"
+                            "[line 5] in script\n");
+}
+
+static double run_program(const char* source, bool jit,
+                          InterpretResult expected)
+{
+    init_VM();
+    vm.jit_enabled = jit;
+    cr_assert_eq(interpret((char*)source), expected);
+    Value result = global("result");
+    cr_assert(IS_NUMBER(result));
+    double number = AS_NUMBER(result);
+    free_VM();
+    return number;
+}
+
+static void assert_same_result(const char* source)
+{
+    cr_assert_eq(run_program(source, true, INTERPRET_OK),
+                 run_program(source, false, INTERPRET_OK));
+}
+
+static Value global(const char* name)
+{
+    int slot = global_slot(copy_string(name, (int)strlen(name)));
+    return vm.global_values[slot];
+}
@@ -0,0 +1,198 @@
+#include "../src/compiler.h"
+#include "../src/debug.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static ObjFunction* compile_script(const char* source, bool optimize);
+static Chunk*       nested_chunk(ObjFunction* script, const char* name);
+static void         assert_opcodes(Chunk* chunk, const u8* expected, int count);
+static int          jump_target(Chunk* chunk, int offset);
+static double       run_result(const char* source, bool optimize);
+
+TestSuite(peephole, .init = init_VM, .fini = free_VM);
+
+Test(peephole, should_thread_and_chains_to_the_end_of_the_condition)
+{
+    ObjFunction* script = compile_script(
+        "var a = 1; var b = 2; var c = 3; var n = 0;"
+        "if (a and b and c) n = 1;",
+        true);
+    Chunk* chunk = &script->chunk;
+    u8     expected[] = {
+        OP_CONSTANT,          OP_DEFINE_GLOBAL,     OP_CONSTANT,
+        OP_DEFINE_GLOBAL,     OP_CONSTANT,          OP_DEFINE_GLOBAL,
+        OP_CONSTANT,          OP_DEFINE_GLOBAL,     OP_GET_GLOBAL,
+        OP_POP_JUMP_IF_FALSE, OP_GET_GLOBAL,        OP_POP_JUMP_IF_FALSE,
+        OP_GET_GLOBAL,        OP_POP_JUMP_IF_FALSE, OP_CONSTANT,
+        OP_SET_GLOBAL_POP,    OP_NIL,               OP_RETURN};
+    assert_opcodes(chunk, expected, 18);
+
+    // every operand that is falsey skips the body at once
+    int end = chunk->count - 2;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+    {
+        if (chunk->code[offset] == OP_POP_JUMP_IF_FALSE)
+            cr_assert_eq(jump_target(chunk, offset), end);
+    }
+}
+
+Test(peephole, should_thread_jumps_landing_on_jumps)
+{
+    // the inner else jumps to the outer one, which jumps past the outer
+    // else; or chains jump over the next operand to the end
+    ObjFunction* script = compile_script(
+        "var a = nil; var b = nil; var c = 3; var n = 0;"
+        "if (a) { if (b) n = 1; else n = 2; } else n = 3;"
+        "if (a or b or c) n = 1;"
+        "while (a or b) a = false;",
+        true);
+    Chunk* chunk = &script->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+    {
+        u8 instruction = chunk->code[offset];
+        if (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE &&
+            instruction != OP_POP_JUMP_IF_FALSE)
+            continue;
+        int target = jump_target(chunk, offset);
+        cr_assert_lt(target, chunk->count);
+        cr_assert_neq(chunk->code[target], OP_JUMP,
+                      "jump at %d lands on a jump at %d", offset, target);
+    }
+}
+
+Test(peephole, should_drop_values_pushed_only_to_be_popped)
+{
+    ObjFunction* script = compile_script("1; \"two\"; nil; true;", true);
+    assert_opcodes(&script->chunk, (u8[]){OP_NIL, OP_RETURN}, 2);
+
+    ObjFunction* unoptimized =
+        compile_script("1; \"two\"; nil; true;", false);
+    assert_opcodes(&unoptimized->chunk,
+                   (u8[]){OP_CONSTANT, OP_POP, OP_CONSTANT, OP_POP, OP_NIL,
+                          OP_POP, OP_TRUE, OP_POP, OP_NIL, OP_RETURN},
+                   10);
+}
+
+Test(peephole, should_loop_without_testing_while_true)
+{
+    ObjFunction* script = compile_script(
+        "fun f() {"
+        "  var i = 0;"
+        "  while (true) { i = i + 1; if (i > 3) return i; }"
+        "}",
+        true);
+    // no condition, and nothing after the loop since it never exits
+    u8 expected[] = {OP_CONSTANT,          OP_ADD_LOCAL_CONSTANT,
+                     OP_SET_LOCAL_POP,     OP_GET_LOCAL,
+                     OP_CONSTANT,          OP_GREATER,
+                     OP_POP_JUMP_IF_FALSE, OP_GET_LOCAL,
+                     OP_RETURN,            OP_LOOP};
+    assert_opcodes(nested_chunk(script, "f"), expected, 10);
+}
+
+Test(peephole, should_drop_code_after_return)
+{
+    ObjFunction* script =
+        compile_script("fun f() { return 1; print 2; }", true);
+    assert_opcodes(nested_chunk(script, "f"), (u8[]){OP_CONSTANT, OP_RETURN},
+                   2);
+
+    ObjFunction* unoptimized =
+        compile_script("fun f() { return 1; print 2; }", false);
+    assert_opcodes(nested_chunk(unoptimized, "f"),
+                   (u8[]){OP_CONSTANT, OP_RETURN, OP_CONSTANT, OP_PRINT,
+                          OP_NIL, OP_RETURN},
+                   6);
+}
+
+Test(peephole, should_compute_the_same_results_as_unoptimized_code)
+{
+    const char* source =
+        "var result = 0;"
+        "fun all(a, b, c) { return a and b and c; }"
+        "fun any(a, b, c) { return a or b or c; }"
+        "fun count(limit) {"
+        "  var i = 0;"
+        "  while (true) { i = i + 1; if (i >= limit) return i; }"
+        "  print \"unreachable\";"
+        "}"
+        "for (var i = 0; i < 50; i = i + 1) {"
+        "  1; nil; \"dropped\";"
+        "  if (all(i, i > 10, i < 40) and !any(nil, false, i == 20))"
+        "    result = result + i;"
+        "  if (any(i < 5, nil, i > 45) or false) result = result + 100;"
+        "  var j = i;"
+        "  while (j > 47 and true) { result = result + 1; j = j - 1; }"
+        "  result = result + count(i + 1);"
+        "}";
+    double optimized = run_result(source, true);
+    cr_assert_eq(optimized, run_result(source, false));
+    cr_assert_eq(optimized, 2883);
+}
+
+static ObjFunction* compile_script(const char* source, bool optimize)
+{
+    vm.optimize_code = optimize;
+    ObjFunction* script = compile(source);
+    cr_assert_not_null(script, "'%s' should compile", source);
+    push(OBJ_VAL(script));
+    return script;
+}
+
+static Chunk* nested_chunk(ObjFunction* script, const char* name)
+{
+    ValueArray* constants = &script->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        Value constant = constants->values[i];
+        if (IS_FUNCTION(constant) && AS_FUNCTION(constant)->name != NULL &&
+            strcmp(AS_FUNCTION(constant)->name->chars, name) == 0)
+            return &AS_FUNCTION(constant)->chunk;
+    }
+    cr_assert_fail("no function %s", name);
+    return NULL;
+}
+
+// Compares the opcodes alone, whatever their operands.
+static void assert_opcodes(Chunk* chunk, const u8* expected, int count)
+{
+    int i = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset), i++)
+    {
+        cr_assert_lt(i, count, "more than %d instructions", count);
+        cr_assert_eq(chunk->code[offset], expected[i],
+                     "instruction %d: expected %s, got %s", i,
+                     opcode_name(expected[i]),
+                     opcode_name(chunk->code[offset]));
+    }
+    cr_assert_eq(i, count);
+}
+
+static int jump_target(Chunk* chunk, int offset)
+{
+    int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - distance
+                                          : offset + 3 + distance;
+}
+
+// Runs source in a VM of its own and gives the number it left in the
+// global called result.
+static double run_result(const char* source, bool optimize)
+{
+    free_VM();
+    init_VM();
+    vm.optimize_code = optimize;
+    cr_assert_eq(interpret((char*)source), INTERPRET_OK);
+
+    Value slot;
+    cr_assert(table_get(&vm.global_slots, copy_string("result", 6), &slot));
+    Value result = vm.global_values[(int)AS_NUMBER(slot)];
+    cr_assert(IS_NUMBER(result));
+    return AS_NUMBER(result);
+}
@@ -0,0 +1,89 @@
+#include "../src/chunk.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <string.h>
+
+static Value global(const char* name);
+static u8*   find_opcode(ObjFunction* function, u8 generic);
+
+TestSuite(quicken, .init = init_VM, .fini = free_VM);
+
+// The globals outlive each interpret(), so the same add runs with numbers,
+// then strings, then numbers again.
+Test(quicken, should_follow_the_operand_types)
+{
+    cr_assert_eq(interpret("fun join(a, b) { return a + b; }"
+                           "var result = join(1, 2);"),
+                 INTERPRET_OK);
+    u8* add = find_opcode(AS_CLOSURE(global("join"))->function, OP_ADD);
+    cr_assert_eq(*add, OP_ADD_NUMBER);
+    cr_assert_eq(AS_NUMBER(global("result")), 3);
+
+    cr_assert_eq(interpret("result = join(\"a\", \"b\");"), INTERPRET_OK);
+    cr_assert_eq(*add, OP_ADD_STRING);
+    cr_assert_str_eq(AS_CSTRING(global("result")), "ab");
+
+    cr_assert_eq(interpret("result = join(4, 5);"), INTERPRET_OK);
+    cr_assert_eq(*add, OP_ADD_NUMBER);
+    cr_assert_eq(AS_NUMBER(global("result")), 9);
+}
+
+// The passes that read code which has run take it back to what the
+// compiler wrote through generic_opcode(), so it has to know every form.
+Test(quicken, should_take_every_quickened_form_back)
+{
+    cr_assert_eq(interpret("fun all(a, b, x, y) {"
+                           "  var sum = a + b; var product = a * b;"
+                           "  var difference = a - b; var quotient = a / b;"
+                           "  var greater = a > b; var less = a < b;"
+                           "  var joined = x + y;"
+                           "  for (var i = 0; i < b; i = i + 1) {}"
+                           "  return sum + product + difference + quotient;"
+                           "}"),
+                 INTERPRET_OK);
+    Chunk* chunk = &AS_CLOSURE(global("all"))->function->chunk;
+    u8     compiled[256];
+    cr_assert_lt(chunk->count, (int)sizeof(compiled));
+    memcpy(compiled, chunk->code, chunk->count);
+
+    cr_assert_eq(interpret("var result = all(6, 3, \"x\", \"y\");"),
+                 INTERPRET_OK);
+    cr_assert_eq(AS_NUMBER(global("result")), 32);
+
+    bool seen[UINT8_COUNT] = {false};
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+    {
+        u8 opcode = chunk->code[offset];
+        cr_assert_eq(generic_opcode(opcode), compiled[offset]);
+        seen[opcode] = true;
+    }
+    // the quickened forms close the opcode list
+    for (int opcode = OP_ADD_NUMBER; opcode <= OP_LESS_JUMP_IF_FALSE_NUMBER;
+         opcode++)
+    {
+        cr_assert(seen[opcode], "opcode %d never quickened", opcode);
+        cr_assert_lt(generic_opcode((u8)opcode), OP_ADD_NUMBER);
+    }
+}
+
+static Value global(const char* name)
+{
+    int slot = global_slot(copy_string(name, (int)strlen(name)));
+    return vm.global_values[slot];
+}
+
+// The first instruction of function that is generic or quickened from it.
+static u8* find_opcode(ObjFunction* function, u8 generic)
+{
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+    {
+        if (generic_opcode(chunk->code[offset]) == generic)
+            return &chunk->code[offset];
+    }
+    cr_assert_fail("no opcode %d", generic);
+    return NULL;
+}
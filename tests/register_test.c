@@ -0,0 +1,116 @@
+#include "../src/compiler.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <criterion/redirect.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every program leaves its answer in the global result.
+static double run_program(const char* source, bool registers,
+                          InterpretResult expected);
+static void   assert_same_result(const char* source);
+static char*  wide_function(const char* name, const char* tail);
+
+Test(registers, should_match_the_stack_code)
+{
+    assert_same_result("fun fib(n) { if (n < 2) return n;"
+                       "  return fib(n - 1) + fib(n - 2); }"
+                       "var result = fib(15);");
+    assert_same_result("var result = 0;"
+                       "for (var i = 0; i < 100; i = i + 1)"
+                       "  if (i / 2 > 20) result = result + i; else result = "
+                       "result - 1;");
+    assert_same_result("fun counter() { var c = 0;"
+                       "  fun inc(by) { c = c + by; return c; } return inc; }"
+                       "var inc = counter(); inc(3); inc(4);"
+                       "var result = inc(5);");
+}
+
+// More locals than there are registers: the function stays stack code and
+// calls register code, which calls it back.
+Test(registers, should_run_functions_too_large_for_registers)
+{
+    char* wide = wide_function("wide", "return v0 + v299 + narrow(v150);");
+    char  source[16384];
+    snprintf(source, sizeof(source),
+             "%s fun narrow(x) { return x * 2; }"
+             "fun outer(n) { var t = 0;"
+             "  for (var i = 0; i < n; i = i + 1) t = t + wide(i);"
+             "  return t; }"
+             "var result = outer(3);",
+             wide);
+    free(wide);
+    assert_same_result(source);
+
+    init_VM();
+    vm.register_mode = true;
+    ObjFunction* script = compile(source);
+    cr_assert_not_null(script);
+    cr_assert(script->register_code);
+    for (int i = 0; i < script->chunk.constants.count; i++)
+    {
+        Value constant = script->chunk.constants.values[i];
+        if (!IS_FUNCTION(constant))
+            continue;
+        ObjFunction* function = AS_FUNCTION(constant);
+        bool         is_wide = strcmp(function->name->chars, "wide") == 0;
+        cr_assert_eq(function->register_code, !is_wide);
+    }
+    free_VM();
+}
+
+Test(registers, should_report_errors_in_stack_code_called_from_registers,
+     .init = cr_redirect_stderr)
+{
+    char* bad = wide_function("bad", "return v0 + nil;");
+    char  source[16384];
+    snprintf(source, sizeof(source),
+             "var result = 1;%s\nfun caller() { return bad(1); }\n"
+             "caller();",
+             bad);
+    free(bad);
+
+    run_program(source, false, INTERPRET_RUNTIME_ERROR);
+    run_program(source, true, INTERPRET_RUNTIME_ERROR);
+    cr_assert_stderr_eq_str("Operands must be two numbers or strings\n"
+                            "[line 303] in bad()\n"
+                            "[line 304] in caller()\n"
+                            "[line 305] in script\n"
+                            "Operands must be two numbers or strings\n"
+                            "[line 303] in bad()\n"
+                            "[line 304] in caller()\n"
+                            "[line 305] in script\n");
+}
+
+static double run_program(const char* source, bool registers,
+                          InterpretResult expected)
+{
+    init_VM();
+    vm.register_mode = registers;
+    cr_assert_eq(interpret((char*)source), expected);
+    Value result = vm.global_values[global_slot(copy_string("result", 6))];
+    cr_assert(IS_NUMBER(result));
+    double number = AS_NUMBER(result);
+    free_VM();
+    return number;
+}
+
+static void assert_same_result(const char* source)
+{
+    cr_assert_eq(run_program(source, true, INTERPRET_OK),
+                 run_program(source, false, INTERPRET_OK));
+}
+
+// A function of one argument with 300 locals v0 to v299, one per line,
+// ending in tail on the line after them.
+static char* wide_function(const char* name, const char* tail)
+{
+    char* source = malloc(12288);
+    int   length = sprintf(source, "\nfun %s(a) {\n", name);
+    for (int i = 0; i < 300; i++)
+        length += sprintf(source + length, "var v%d = a + %d;\n", i, i);
+    sprintf(source + length, "%s }", tail);
+    return source;
+}
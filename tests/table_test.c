@@ -0,0 +1,186 @@
+#include "../src/table.h"
+#include "../src/object.h"
+#include "../src/vm.h"
+#include <criterion/criterion.h>
+#include <criterion/internal/assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keys are built by hand rather than interned, so each test picks the
+// hashes and with them the group a key starts probing at (hash >> 7) and
+// its control byte tag (hash & 0x7f). They live outside the heap, where the
+// collector never moves or frees them.
+#define MAX_KEYS 4096
+#define GROUP_SIZE 16
+
+static ObjString* keys[MAX_KEYS];
+static Table      table;
+
+static void setup()
+{
+    init_VM();
+    init_table(&table);
+}
+
+static void teardown()
+{
+    free_table(&table);
+    for (int i = 0; i < MAX_KEYS; i++)
+    {
+        free(keys[i]);
+        keys[i] = NULL;
+    }
+    free_VM();
+}
+
+TestSuite(table, .init = setup, .fini = teardown);
+
+static ObjString* make_key(int i, u32 hash)
+{
+    char chars[16];
+    int  length = snprintf(chars, sizeof(chars), "key%d", i);
+
+    ObjString* key = calloc(1, sizeof(ObjString) + length + 1);
+    cr_assert_not_null(key);
+    key->obj.type = OBJ_STRING;
+    key->length = length;
+    key->hash = hash;
+    memcpy(key->chars, chars, length + 1);
+    keys[i] = key;
+    return key;
+}
+
+// A key starting at group with the given tag; i keeps keys apart.
+static ObjString* make_grouped_key(int i, u32 group, u8 tag)
+{
+    return make_key(i, (group << 7) | tag);
+}
+
+static void assert_found(int i, double expected)
+{
+    Value value;
+    cr_assert(table_get(&table, keys[i], &value), "key%d is missing", i);
+    cr_assert_eq(AS_NUMBER(value), expected, "key%d", i);
+}
+
+static void assert_missing(int i)
+{
+    Value value;
+    cr_assert_not(table_get(&table, keys[i], &value), "key%d is there", i);
+}
+
+Test(table, should_find_every_key_across_resizes)
+{
+    srand(7);
+    for (int i = 0; i < 2000; i++)
+    {
+        make_key(i, (u32)rand() * 2654435761u);
+        cr_assert(table_set(&table, keys[i], NUMBER_VAL(i)));
+        cr_assert_eq(table.count, i + 1);
+        cr_assert_eq(table.capacity & (table.capacity - 1), 0);
+        cr_assert_leq(table.count, table.capacity * 3 / 4);
+    }
+    for (int i = 0; i < 2000; i++)
+    {
+        assert_found(i, i);
+        cr_assert_eq(table_find_string(&table, keys[i]->chars,
+                                       keys[i]->length, keys[i]->hash),
+                     keys[i]);
+    }
+
+    // overwriting is not a new key
+    cr_assert_not(table_set(&table, keys[0], NUMBER_VAL(-1)));
+    assert_found(0, -1);
+    cr_assert_eq(table.count, 2000);
+}
+
+Test(table, should_probe_past_full_groups)
+{
+    // 40 keys of one tag, all starting at group 0 of a four-group table:
+    // every lookup has to skip tag matches and carry on into other groups
+    for (int i = 0; i < 40; i++)
+    {
+        make_grouped_key(i, (u32)i << 2, 0x2a);
+        table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+    cr_assert_eq(table.capacity, 64);
+    for (int i = 0; i < 40; i++)
+        assert_found(i, i);
+
+    for (int i = 0; i < 40; i += 3)
+        cr_assert(table_delete(&table, keys[i]));
+    for (int i = 0; i < 40; i++)
+    {
+        if (i % 3 == 0)
+            assert_missing(i);
+        else
+            assert_found(i, i);
+    }
+
+    // put back, into whatever slots the deletes left
+    for (int i = 0; i < 40; i += 3)
+        cr_assert(table_set(&table, keys[i], NUMBER_VAL(i * 10)));
+    for (int i = 0; i < 40; i++)
+        assert_found(i, i % 3 == 0 ? i * 10 : i);
+}
+
+Test(table, should_leave_tombstones_only_in_full_groups)
+{
+    // sixteen keys fill group 0 of a two-group table, the seventeenth
+    // probes on into group 1
+    for (int i = 0; i < 17; i++)
+    {
+        make_grouped_key(i, 0, (u8)i);
+        table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+    cr_assert_eq(table.capacity, 32);
+    cr_assert_eq(table.tombstones, 0);
+
+    // group 0 has no empty slot: a lookup for key16 must not stop there
+    cr_assert(table_delete(&table, keys[3]));
+    cr_assert_eq(table.tombstones, 1);
+    assert_found(16, 16);
+    assert_missing(3);
+
+    // group 1 has empty slots, so its freed slot is simply empty again
+    cr_assert(table_delete(&table, keys[16]));
+    cr_assert_eq(table.tombstones, 1);
+    assert_missing(16);
+
+    // a new key of group 0 takes the tombstone
+    make_grouped_key(17, 0, 0x7f);
+    table_set(&table, keys[17], NUMBER_VAL(17));
+    cr_assert_eq(table.tombstones, 0);
+    for (int i = 0; i < 16; i++)
+    {
+        if (i != 3)
+            assert_found(i, i);
+    }
+    assert_found(17, 17);
+}
+
+Test(table, should_not_grow_from_deletes_alone)
+{
+    // Each round fills a group and deletes all of it again. The group never
+    // has an empty slot, so every delete leaves a tombstone, and the table
+    // has to rehash them away at its size instead of growing.
+    int key = 0;
+    for (int round = 0; round < 50; round++)
+    {
+        int first = key;
+        for (int i = 0; i < GROUP_SIZE; i++, key++)
+        {
+            make_grouped_key(key, (u32)round & 1, (u8)i);
+            table_set(&table, keys[key], NUMBER_VAL(key));
+        }
+        for (int i = first; i < key; i++)
+            cr_assert(table_delete(&table, keys[i]));
+
+        cr_assert_eq(table.count, 0);
+        cr_assert_eq(table.tombstones, GROUP_SIZE);
+        cr_assert_eq(table.capacity, 32);
+    }
+    for (int i = 0; i < key; i += 7)
+        assert_missing(i);
+}